@@ -4,14 +4,17 @@ TARGET                  = opensc.dll opensc_a.lib
 OBJECTS			= \
 	sc.obj ctx.obj log.obj errors.obj \
 	asn1.obj base64.obj sec.obj card.obj iso7816.obj dir.obj ef-atr.obj padding.obj apdu.obj \
+	async.obj linger.obj \
 	\
 	pkcs15.obj pkcs15-cert.obj pkcs15-data.obj pkcs15-pin.obj \
 	pkcs15-prkey.obj pkcs15-pubkey.obj pkcs15-sec.obj \
 	pkcs15-algo.obj pkcs15-cache.obj pkcs15-syn.obj \
+	probe-cache.obj \
 	\
 	muscle.obj muscle-filesystem.obj \
 	\
 	ctbcs.obj reader-ctapi.obj reader-pcsc.obj reader-openct.obj \
+	reader-virtual.obj \
 	\
 	card-setcos.obj card-miocos.obj card-flex.obj card-gpk.obj \
 	card-cardos.obj card-tcos.obj card-default.obj \
@@ -21,7 +24,7 @@ OBJECTS			= \
 	card-asepcos.obj card-akis.obj card-gemsafeV1.obj card-rutoken.obj \
 	card-rtecp.obj card-westcos.obj card-myeid.obj card-ias.obj \
 	card-javacard.obj card-itacns.obj card-authentic.obj \
-	card-iasecc.obj iasecc-sdo.obj \
+	card-iasecc.obj iasecc-sdo.obj card-virtual.obj \
 	\
 	pkcs15-openpgp.obj pkcs15-infocamere.obj pkcs15-starcert.obj \
 	pkcs15-tcos.obj pkcs15-esteid.obj pkcs15-postecert.obj pkcs15-gemsafeGPK.obj \
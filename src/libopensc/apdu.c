@@ -202,14 +202,36 @@ int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 	if (nbuf == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 	/* encode the APDU in the buffer */
-	if (sc_apdu2bytes(ctx, apdu, proto, nbuf, nlen) != SC_SUCCESS)
+	if (sc_apdu2bytes(ctx, apdu, proto, nbuf, nlen) != SC_SUCCESS) {
+		free(nbuf);
 		return SC_ERROR_INTERNAL;
+	}
 	*buf = nbuf;
 	*len = nlen;
 
 	return SC_SUCCESS;
 }
 
+int sc_apdu_write_octets(sc_context_t *ctx, const sc_apdu_t *apdu,
+	unsigned int proto, u8 *buf, size_t buflen, size_t *len)
+{
+	size_t	nlen;
+
+	if (apdu == NULL || len == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	nlen = sc_apdu_get_length(apdu, proto);
+	if (nlen == 0)
+		return SC_ERROR_INTERNAL;
+	*len = nlen;
+	if (buf == NULL || buflen < nlen)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	if (sc_apdu2bytes(ctx, apdu, proto, buf, nlen) != SC_SUCCESS)
+		return SC_ERROR_INTERNAL;
+
+	return SC_SUCCESS;
+}
+
 int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 	size_t len)
 {
@@ -365,6 +387,33 @@ static void sc_detect_apdu_cse(const sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
+/* Interindustry commands that leave the current file as it is.
+ * Reading or updating through a short EF identifier selects that EF. */
+static int apdu_keeps_current_file(const sc_apdu_t *apdu)
+{
+	if (apdu->cla & 0x80)
+		return 0;
+	switch (apdu->ins) {
+	case 0x20:	/* VERIFY */
+	case 0x22:	/* MANAGE SECURITY ENVIRONMENT */
+	case 0x24:	/* CHANGE REFERENCE DATA */
+	case 0x2A:	/* PERFORM SECURITY OPERATION */
+	case 0x2C:	/* RESET RETRY COUNTER */
+	case 0x84:	/* GET CHALLENGE */
+	case 0x88:	/* INTERNAL AUTHENTICATE */
+	case 0xC0:	/* GET RESPONSE */
+	case 0xCA:	/* GET DATA */
+		return 1;
+	case 0xB0:	/* READ BINARY */
+	case 0xD6:	/* UPDATE BINARY */
+		return (apdu->p1 & 0x80) == 0;
+	case 0xB2:	/* READ RECORD */
+	case 0xDC:	/* UPDATE RECORD */
+		return (apdu->p2 >> 3) == 0;
+	}
+	return 0;
+}
+
 /** Sends a single APDU to the card reader and calls 
  *  GET RESPONSE to get the return data if necessary.
  *  @param  card  sc_card_t object for the smartcard
@@ -391,8 +440,17 @@ static int do_single_transmit(sc_card_t *card, sc_apdu_t *apdu)
 	/* send APDU to the reader driver */
 	if (card->reader->ops->transmit == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
+	card->apdu_stats.transmitted++;
+	if (apdu->ins == 0xC0 && (apdu->flags & SC_APDU_FLAGS_NO_GET_RESP))
+		card->apdu_stats.get_response++;
+	if (apdu->ins == 0xA4)
+		card->apdu_stats.selects++;
+	if (!apdu_keeps_current_file(apdu))
+		_sc_invalidate_select_cache(card);
 	r = card->reader->ops->transmit(card->reader, apdu);
 	if (r != 0) {
+		/* the card may have been reset or replaced */
+		_sc_invalidate_select_cache(card);
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "unable to transmit APDU");
 		return r;
 	}
@@ -417,6 +475,7 @@ static int do_single_transmit(sc_card_t *card, sc_apdu_t *apdu)
 			if (card->type == SC_CARD_TYPE_BELPIC_EID)
 				msleep(40);
 			/* re-transmit the APDU with new Le length */
+			card->apdu_stats.transmitted++;
 			r = card->reader->ops->transmit(card->reader, apdu);
 			if (r != SC_SUCCESS) {
 				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "unable to transmit APDU");
@@ -475,19 +534,42 @@ static int do_single_transmit(sc_card_t *card, sc_apdu_t *apdu)
 			minlen = le;
 
 			do {
-				u8 tbuf[256];
+				u8 tbuf[256], *rbuf = tbuf;
+				size_t rlen = le;
+
+				/* with extended Le, ask for everything that
+				 * fits in the buffer at once rather than in
+				 * 256 byte pieces */
+				if (le == 256 && buflen > 256 && card->use_ext_le
+				 && card->ops->get_response == sc_get_iso7816_driver()->ops->get_response)
+					rlen = buflen > 65536 ? 65536 : buflen;
+				/* read straight into the buffer if it fits */
+				if (rlen <= buflen)
+					rbuf = buf;
 				/* call GET RESPONSE to get more date from
 				 * the card; note: GET RESPONSE returns the
 				 * amount of data left (== SW2) */
-				r = card->ops->get_response(card, &le, tbuf);
+				r = card->ops->get_response(card, &rlen, rbuf);
+				if (r < 0 && rlen > 256) {
+					sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "extended GET RESPONSE failed, falling back to short APDUs");
+					card->use_ext_le = 0;
+					card->apdu_stats.fallbacks++;
+					rlen = le;
+					rbuf = (rlen <= buflen) ? buf : tbuf;
+					r = card->ops->get_response(card, &rlen, rbuf);
+				}
 				if (r < 0)
 					SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, r);
+				if (rlen > 256)
+					card->apdu_stats.saved += (rlen + 255) / 256 - 1;
+				le = rlen;
 
 				if (buflen < le)
 				/* copy as much as will fit in requested buffer */
 					le = buflen;
 
-				memcpy(buf, tbuf, le);
+				if (rbuf != buf)
+					memcpy(buf, rbuf, le);
 				buf    += le;
 				buflen -= le;
 
@@ -496,7 +578,7 @@ static int do_single_transmit(sc_card_t *card, sc_apdu_t *apdu)
 				if (buflen == 0)
 					break;
 
-				minlen -= le;
+				minlen -= le < minlen ? le : minlen;
 				if (r != 0) 
 					le = minlen = (size_t)r;
 				else
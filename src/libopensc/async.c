@@ -0,0 +1,607 @@
+/*
+ * async.c: Signing jobs that run in worker threads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <fcntl.h>
+#endif
+
+#include "internal.h"
+#include "pkcs15.h"
+
+/*
+ * Jobs are queued per card and a card runs one job at a time, in the
+ * order they were submitted; the worker threads take turns over the
+ * cards that have work, so that a few threads keep many cards busy.
+ * The card is locked with sc_lock() for each job, as it would be for
+ * a synchronous call, so jobs and other users of the card exclude
+ * each other as usual.
+ *
+ * A finished job is handed to its callback, or else put on the list
+ * of completed jobs of the queue. The read end of a pipe is readable
+ * while that list is not empty, so it can go into the poll() set of
+ * an event loop.
+ *
+ * A job without a callback belongs to the caller until sc_job_free(),
+ * also across sc_job_queue_destroy(): the queue keeps such jobs on
+ * its list of owned jobs, and lets go of them when it is destroyed.
+ */
+
+#ifdef HAVE_PTHREAD
+
+struct sc_job {
+	sc_job_queue_t *queue;
+	struct sc_job_card *jcard;
+	int (*run)(sc_job_t *job);
+
+	struct sc_pkcs15_card *p15card;
+	const struct sc_pkcs15_object *obj;
+	sc_security_env_t env;
+	unsigned long flags;
+	u8 *in, *out;
+	size_t inlen, outlen;
+	int result;
+
+	int done;
+	int completed;		/* on the completed list */
+	int detached;		/* freed when done */
+	int owned;		/* on the owned list */
+	sc_job_callback_t callback;
+	void *callback_arg;
+	struct sc_job *next;
+	struct sc_job *owned_prev, *owned_next;
+};
+
+struct sc_job_card {
+	sc_card_t *card;
+	sc_job_t *head, *tail;
+	int busy;
+	struct sc_job_card *next;
+};
+
+struct sc_job_queue {
+	sc_context_t *ctx;
+	pthread_mutex_t mutex;
+	pthread_cond_t work;	/* a job was queued, or shutdown */
+	pthread_cond_t done;	/* a job finished */
+	struct sc_job_card *cards;
+	sc_job_t *completed, *completed_tail;
+	sc_job_t *owned;	/* jobs of the caller, not freed yet */
+	unsigned int pending;	/* queued or running */
+	int pipe[2];
+	int shutdown;
+	pthread_t *threads;
+	unsigned int nthreads;
+};
+
+static void job_release(sc_job_t *job)
+{
+	if (job->in != NULL) {
+		sc_mem_clear(job->in, job->inlen);
+		free(job->in);
+	}
+	if (job->out != NULL) {
+		sc_mem_clear(job->out, job->outlen);
+		free(job->out);
+	}
+	free(job);
+}
+
+/* Called with the queue mutex held */
+static void unlink_owned(sc_job_queue_t *q, sc_job_t *job)
+{
+	if (!job->owned)
+		return;
+	if (job->owned_prev != NULL)
+		job->owned_prev->owned_next = job->owned_next;
+	else
+		q->owned = job->owned_next;
+	if (job->owned_next != NULL)
+		job->owned_next->owned_prev = job->owned_prev;
+	job->owned_prev = job->owned_next = NULL;
+	job->owned = 0;
+}
+
+/* Called with the queue mutex held */
+static struct sc_job_card *next_card(sc_job_queue_t *q)
+{
+	struct sc_job_card **p, *jc;
+
+	for (p = &q->cards; (jc = *p) != NULL; p = &jc->next) {
+		if (jc->busy || jc->head == NULL)
+			continue;
+		/* Move it to the end, so that the other cards get their turn */
+		*p = jc->next;
+		jc->next = NULL;
+		for (p = &q->cards; *p != NULL; p = &(*p)->next)
+			;
+		*p = jc;
+		return jc;
+	}
+	return NULL;
+}
+
+/* Called with the queue mutex held */
+static void drop_card(sc_job_queue_t *q, struct sc_job_card *jcard)
+{
+	struct sc_job_card **p;
+
+	for (p = &q->cards; *p != NULL; p = &(*p)->next) {
+		if (*p == jcard) {
+			*p = jcard->next;
+			free(jcard);
+			return;
+		}
+	}
+}
+
+/* Called with the queue mutex held */
+static void complete_job(sc_job_queue_t *q, sc_job_t *job)
+{
+	char c = 0;
+
+	job->done = 1;
+	q->pending--;
+	pthread_cond_broadcast(&q->done);
+	if (job->detached) {
+		unlink_owned(q, job);
+		job_release(job);
+		return;
+	}
+	job->completed = 1;
+	if (q->completed == NULL) {
+		q->completed = job;
+		if (write(q->pipe[1], &c, 1) != 1)
+			sc_debug(q->ctx, SC_LOG_DEBUG_NORMAL, "unable to signal a completed job");
+	} else {
+		q->completed_tail->next = job;
+	}
+	q->completed_tail = job;
+}
+
+/* Called with the queue mutex held */
+static void unlink_completed(sc_job_queue_t *q, sc_job_t *job)
+{
+	sc_job_t **p;
+	char c;
+
+	for (p = &q->completed; *p != NULL; p = &(*p)->next) {
+		if (*p != job)
+			continue;
+		*p = job->next;
+		if (q->completed_tail == job) {
+			q->completed_tail = NULL;
+			for (job = q->completed; job != NULL; job = job->next)
+				q->completed_tail = job;
+		}
+		break;
+	}
+	if (q->completed == NULL && read(q->pipe[0], &c, 1) != 1)
+		sc_debug(q->ctx, SC_LOG_DEBUG_NORMAL, "completed job pipe is out of sync");
+}
+
+static void *job_worker(void *arg)
+{
+	sc_job_queue_t *q = (sc_job_queue_t *) arg;
+	struct sc_job_card *jcard;
+	sc_job_t *job;
+
+	pthread_mutex_lock(&q->mutex);
+	while (1) {
+		while ((jcard = next_card(q)) == NULL && !q->shutdown)
+			pthread_cond_wait(&q->work, &q->mutex);
+		if (jcard == NULL)
+			break;
+
+		job = jcard->head;
+		jcard->head = job->next;
+		if (jcard->head == NULL)
+			jcard->tail = NULL;
+		job->next = NULL;
+		jcard->busy = 1;
+		pthread_mutex_unlock(&q->mutex);
+
+		job->result = job->run(job);
+
+		pthread_mutex_lock(&q->mutex);
+		jcard->busy = 0;
+		if (jcard->head == NULL)
+			drop_card(q, jcard);
+		else
+			pthread_cond_signal(&q->work);
+		job->jcard = NULL;
+
+		if (job->callback != NULL) {
+			pthread_mutex_unlock(&q->mutex);
+			job->callback(job, job->callback_arg);
+			pthread_mutex_lock(&q->mutex);
+			job->detached = 1;
+		}
+		complete_job(q, job);
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return NULL;
+}
+
+int sc_job_queue_create(sc_context_t *ctx, unsigned int threads, sc_job_queue_t **queue_out)
+{
+	sc_job_queue_t *q;
+	unsigned int i;
+
+	if (ctx == NULL || queue_out == NULL || threads == 0)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(ctx);
+	/* Without a thread context sc_lock() does not keep the workers
+	 * and the other users of a card apart */
+	if (ctx->thread_ctx == NULL)
+		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "job queues need a context with a thread context");
+
+	q = calloc(1, sizeof(sc_job_queue_t));
+	if (q == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	q->ctx = ctx;
+	q->threads = calloc(threads, sizeof(pthread_t));
+	if (q->threads == NULL) {
+		free(q);
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	}
+	if (pipe(q->pipe) != 0) {
+		free(q->threads);
+		free(q);
+		LOG_TEST_RET(ctx, SC_ERROR_INTERNAL, "pipe() failed");
+	}
+	fcntl(q->pipe[0], F_SETFL, O_NONBLOCK);
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->work, NULL);
+	pthread_cond_init(&q->done, NULL);
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&q->threads[i], NULL, job_worker, q) != 0)
+			break;
+		q->nthreads++;
+	}
+	if (q->nthreads == 0) {
+		sc_job_queue_destroy(q);
+		LOG_TEST_RET(ctx, SC_ERROR_INTERNAL, "unable to start a worker thread");
+	}
+	sc_log(ctx, "job queue with %u worker threads", q->nthreads);
+	*queue_out = q;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+void sc_job_queue_destroy(sc_job_queue_t *q)
+{
+	sc_job_t *job;
+	unsigned int i;
+
+	if (q == NULL)
+		return;
+
+	/* Let the workers run what has been submitted */
+	pthread_mutex_lock(&q->mutex);
+	while (q->pending > 0 && q->nthreads > 0)
+		pthread_cond_wait(&q->done, &q->mutex);
+	q->shutdown = 1;
+	pthread_cond_broadcast(&q->work);
+	pthread_mutex_unlock(&q->mutex);
+	for (i = 0; i < q->nthreads; i++)
+		pthread_join(q->threads[i], NULL);
+
+	/* All jobs are done; those the caller has not freed yet stay
+	 * with the caller */
+	while ((job = q->owned) != NULL) {
+		q->owned = job->owned_next;
+		job->owned_prev = job->owned_next = NULL;
+		job->owned = 0;
+		job->completed = 0;
+		job->next = NULL;
+		job->queue = NULL;
+	}
+	pthread_cond_destroy(&q->done);
+	pthread_cond_destroy(&q->work);
+	pthread_mutex_destroy(&q->mutex);
+	close(q->pipe[0]);
+	close(q->pipe[1]);
+	free(q->threads);
+	free(q);
+}
+
+int sc_job_queue_get_fd(sc_job_queue_t *q)
+{
+	if (q == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	return q->pipe[0];
+}
+
+sc_job_t *sc_job_queue_get_completed(sc_job_queue_t *q)
+{
+	sc_job_t *job;
+
+	if (q == NULL)
+		return NULL;
+	pthread_mutex_lock(&q->mutex);
+	job = q->completed;
+	if (job != NULL) {
+		unlink_completed(q, job);
+		job->completed = 0;
+		job->next = NULL;
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return job;
+}
+
+static int submit_job(sc_job_queue_t *q, sc_card_t *card, sc_job_t *job, sc_job_t **job_out)
+{
+	struct sc_job_card *jcard;
+
+	pthread_mutex_lock(&q->mutex);
+	if (q->shutdown) {
+		pthread_mutex_unlock(&q->mutex);
+		return SC_ERROR_NOT_ALLOWED;
+	}
+	for (jcard = q->cards; jcard != NULL; jcard = jcard->next)
+		if (jcard->card == card)
+			break;
+	if (jcard == NULL) {
+		jcard = calloc(1, sizeof(struct sc_job_card));
+		if (jcard == NULL) {
+			pthread_mutex_unlock(&q->mutex);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		jcard->card = card;
+		jcard->next = q->cards;
+		q->cards = jcard;
+	}
+	job->queue = q;
+	job->jcard = jcard;
+	if (jcard->tail != NULL)
+		jcard->tail->next = job;
+	else
+		jcard->head = job;
+	jcard->tail = job;
+	q->pending++;
+	if (job->callback == NULL) {
+		job->owned = 1;
+		job->owned_next = q->owned;
+		if (q->owned != NULL)
+			q->owned->owned_prev = job;
+		q->owned = job;
+	}
+
+	/* A job with a callback belongs to the queue */
+	if (job_out != NULL)
+		*job_out = job->callback != NULL ? NULL : job;
+	pthread_cond_signal(&q->work);
+	pthread_mutex_unlock(&q->mutex);
+	return SC_SUCCESS;
+}
+
+static sc_job_t *new_job(const u8 *in, size_t inlen, size_t outlen,
+		sc_job_callback_t callback, void *callback_arg)
+{
+	sc_job_t *job;
+
+	job = calloc(1, sizeof(sc_job_t));
+	if (job == NULL)
+		return NULL;
+	job->in = malloc(inlen ? inlen : 1);
+	job->out = malloc(outlen ? outlen : 1);
+	if (job->in == NULL || job->out == NULL) {
+		job_release(job);
+		return NULL;
+	}
+	memcpy(job->in, in, inlen);
+	job->inlen = inlen;
+	job->outlen = outlen;
+	job->callback = callback;
+	job->callback_arg = callback_arg;
+	return job;
+}
+
+static int run_card_signature(sc_job_t *job)
+{
+	sc_card_t *card = job->jcard->card;
+	int r;
+
+	r = sc_lock(card);
+	if (r != SC_SUCCESS)
+		return r;
+	r = sc_set_security_env(card, &job->env, 0);
+	if (r == SC_SUCCESS)
+		r = sc_compute_signature(card, job->in, job->inlen, job->out, job->outlen);
+	sc_unlock(card);
+	return r;
+}
+
+static int run_pkcs15_signature(sc_job_t *job)
+{
+	return sc_pkcs15_compute_signature(job->p15card, job->obj, job->flags,
+			job->in, job->inlen, job->out, job->outlen);
+}
+
+int sc_compute_signature_async(sc_job_queue_t *q, sc_card_t *card,
+		const sc_security_env_t *env, const u8 *data, size_t datalen,
+		size_t outlen, sc_job_callback_t callback, void *callback_arg,
+		sc_job_t **job_out)
+{
+	sc_job_t *job;
+	int r;
+
+	if (q == NULL || card == NULL || env == NULL || data == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (callback == NULL && job_out == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	job = new_job(data, datalen, outlen, callback, callback_arg);
+	if (job == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	job->env = *env;
+	job->run = run_card_signature;
+	r = submit_job(q, card, job, job_out);
+	if (r != SC_SUCCESS)
+		job_release(job);
+	return r;
+}
+
+int sc_pkcs15_compute_signature_async(sc_job_queue_t *q,
+		struct sc_pkcs15_card *p15card, const struct sc_pkcs15_object *obj,
+		unsigned long alg_flags, const u8 *in, size_t inlen, size_t outlen,
+		sc_job_callback_t callback, void *callback_arg, sc_job_t **job_out)
+{
+	sc_job_t *job;
+	int r;
+
+	if (q == NULL || p15card == NULL || obj == NULL || in == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (callback == NULL && job_out == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	job = new_job(in, inlen, outlen, callback, callback_arg);
+	if (job == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	job->p15card = p15card;
+	job->obj = obj;
+	job->flags = alg_flags;
+	job->run = run_pkcs15_signature;
+	r = submit_job(q, p15card->card, job, job_out);
+	if (r != SC_SUCCESS)
+		job_release(job);
+	return r;
+}
+
+int sc_job_wait(sc_job_t *job)
+{
+	sc_job_queue_t *q;
+
+	if (job == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	q = job->queue;
+	if (q == NULL)		/* the queue is gone, the job is done */
+		return job->result;
+	pthread_mutex_lock(&q->mutex);
+	while (!job->done)
+		pthread_cond_wait(&q->done, &q->mutex);
+	pthread_mutex_unlock(&q->mutex);
+	return job->result;
+}
+
+int sc_job_get_result(sc_job_t *job, const u8 **out, size_t *outlen)
+{
+	int done;
+
+	if (job == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (job->queue != NULL) {
+		pthread_mutex_lock(&job->queue->mutex);
+		done = job->done;
+		pthread_mutex_unlock(&job->queue->mutex);
+	} else {
+		done = 1;
+	}
+	/* A job with a callback is still running while the callback is */
+	if (!done && job->callback == NULL)
+		return SC_ERROR_NOT_ALLOWED;
+	if (out != NULL)
+		*out = job->result > 0 ? job->out : NULL;
+	if (outlen != NULL)
+		*outlen = job->result > 0 ? (size_t) job->result : 0;
+	return job->result;
+}
+
+void sc_job_free(sc_job_t *job)
+{
+	sc_job_queue_t *q;
+
+	if (job == NULL)
+		return;
+	q = job->queue;
+	if (q == NULL) {	/* outlived its queue */
+		job_release(job);
+		return;
+	}
+	pthread_mutex_lock(&q->mutex);
+	if (!job->done) {
+		/* The worker releases it when it is done */
+		job->detached = 1;
+		pthread_mutex_unlock(&q->mutex);
+		return;
+	}
+	if (job->completed)
+		unlink_completed(q, job);
+	unlink_owned(q, job);
+	pthread_mutex_unlock(&q->mutex);
+	job_release(job);
+}
+
+#else	/* HAVE_PTHREAD */
+
+int sc_job_queue_create(sc_context_t *ctx, unsigned int threads, sc_job_queue_t **queue_out)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+void sc_job_queue_destroy(sc_job_queue_t *q)
+{
+}
+
+int sc_job_queue_get_fd(sc_job_queue_t *q)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+sc_job_t *sc_job_queue_get_completed(sc_job_queue_t *q)
+{
+	return NULL;
+}
+
+int sc_compute_signature_async(sc_job_queue_t *q, sc_card_t *card,
+		const sc_security_env_t *env, const u8 *data, size_t datalen,
+		size_t outlen, sc_job_callback_t callback, void *callback_arg,
+		sc_job_t **job_out)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+int sc_pkcs15_compute_signature_async(sc_job_queue_t *q,
+		struct sc_pkcs15_card *p15card, const struct sc_pkcs15_object *obj,
+		unsigned long alg_flags, const u8 *in, size_t inlen, size_t outlen,
+		sc_job_callback_t callback, void *callback_arg, sc_job_t **job_out)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+int sc_job_wait(sc_job_t *job)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+int sc_job_get_result(sc_job_t *job, const u8 **out, size_t *outlen)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+void sc_job_free(sc_job_t *job)
+{
+}
+
+#endif	/* HAVE_PTHREAD */
@@ -111,6 +111,7 @@ static int atrust_acos_init(struct sc_card *card)
 
 	card->cla  = 0x00;
 	card->drv_data = (void *)ex_data;
+	card->caps |= SC_CARD_CAP_NO_SELECT_CACHE;
 
 	/* set the supported algorithm */
 
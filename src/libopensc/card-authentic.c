@@ -433,6 +433,7 @@ authentic_init_oberthur_authentic_3_2(struct sc_card *card)
 	card->caps = SC_CARD_CAP_RNG;
 	card->caps |= SC_CARD_CAP_APDU_EXT; 
 	card->caps |= SC_CARD_CAP_USE_FCI_AC;
+	card->caps |= SC_CARD_CAP_NO_SELECT_CACHE;
 
 	rv = authentic_select_aid(card, aid_AuthentIC_3_2, sizeof(aid_AuthentIC_3_2), NULL, NULL);
 	LOG_TEST_RET(ctx, rv, "AuthentIC application select error");
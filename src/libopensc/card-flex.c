@@ -203,6 +203,7 @@ static int flex_init(sc_card_t *card)
 
 	/* State that we have an RNG */
 	card->caps |= SC_CARD_CAP_RNG;
+	card->caps |= SC_CARD_CAP_NO_SELECT_CACHE;
 
 	return 0;
 }
@@ -200,6 +200,7 @@ gpk_init(sc_card_t *card)
 
 	/* State that we have an RNG */
 	card->caps |= SC_CARD_CAP_RNG;
+	card->caps |= SC_CARD_CAP_NO_SELECT_CACHE;
 
 	/* Make sure max send/receive size is 4 byte aligned and <256. */
 	card->max_recv_size = 252;
@@ -372,6 +372,7 @@ iasecc_init_gemalto(struct sc_card *card)
 	card->caps = SC_CARD_CAP_RNG;
 	card->caps |= SC_CARD_CAP_APDU_EXT; 
 	card->caps |= SC_CARD_CAP_USE_FCI_AC;
+	card->caps |= SC_CARD_CAP_NO_SELECT_CACHE;
 
 	sc_format_path("3F00", &path);
 	sc_select_file(card, &path, NULL);
@@ -441,6 +442,7 @@ iasecc_init_oberthur(struct sc_card *card)
 	card->caps = SC_CARD_CAP_RNG;
 	card->caps |= SC_CARD_CAP_APDU_EXT; 
 	card->caps |= SC_CARD_CAP_USE_FCI_AC;
+	card->caps |= SC_CARD_CAP_NO_SELECT_CACHE;
 
 	iasecc_parse_ef_atr(card);
 
@@ -481,6 +483,7 @@ iasecc_init_sagem(struct sc_card *card)
 	card->caps = SC_CARD_CAP_RNG;
 	card->caps |= SC_CARD_CAP_APDU_EXT; 
 	card->caps |= SC_CARD_CAP_USE_FCI_AC;
+	card->caps |= SC_CARD_CAP_NO_SELECT_CACHE;
 
 	rv = iasecc_parse_ef_atr(card);
 	if (rv == SC_ERROR_FILE_NOT_FOUND)   {
@@ -293,6 +293,7 @@ static int mcrd_init(sc_card_t * card)
 	card->drv_data = priv;
 	card->cla = 0x00;
 	card->caps = SC_CARD_CAP_RNG;
+	card->caps |= SC_CARD_CAP_NO_SELECT_CACHE;
 
 
 	if (is_esteid_card(card)) {
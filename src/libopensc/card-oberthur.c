@@ -240,6 +240,7 @@ auth_init(struct sc_card *card)
 
 	card->caps |= SC_CARD_CAP_RNG;
 	card->caps |= SC_CARD_CAP_USE_FCI_AC;
+	card->caps |= SC_CARD_CAP_NO_SELECT_CACHE;
 
 	if (auth_select_aid(card))   {
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "Failed to initialize %s\n", card->name);
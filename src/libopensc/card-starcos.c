@@ -108,6 +108,7 @@ static int starcos_init(sc_card_t *card)
 	_sc_card_add_rsa_alg(card,1024, flags, 0x10001);
 
 	card->caps = SC_CARD_CAP_RNG; 
+	card->caps |= SC_CARD_CAP_NO_SELECT_CACHE;
 
 	/* we need read_binary&friends with max 128 bytes per read */
 	card->max_send_size = 128;
@@ -0,0 +1,110 @@
+/*
+ * card-virtual.c: Support for the software card of the virtual reader
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "internal.h"
+
+static struct sc_atr_table virtual_atrs[] = {
+	{"3b:8a:80:01:4f:70:65:6e:53:43:56:69:72:74:16", NULL, "OpenSC virtual card", SC_CARD_TYPE_VIRTUAL, 0, NULL},
+	{NULL, NULL, NULL, 0, 0, NULL}
+};
+
+static struct sc_card_operations virtual_ops;
+static struct sc_card_driver virtual_drv = {
+	"OpenSC virtual card",
+	"virtual",
+	&virtual_ops,
+	NULL, 0, NULL
+};
+
+static int virtual_match_card(sc_card_t *card)
+{
+	if (_sc_match_atr(card, virtual_atrs, &card->type) < 0)
+		return 0;
+	return 1;
+}
+
+static int virtual_init(sc_card_t *card)
+{
+	unsigned long flags;
+
+	card->name = "OpenSC virtual card";
+	card->drv_data = NULL;
+	card->caps |= SC_CARD_CAP_APDU_EXT | SC_CARD_CAP_RNG;
+
+	flags = SC_ALGORITHM_RSA_RAW | SC_ALGORITHM_RSA_HASH_NONE;
+	_sc_card_add_rsa_alg(card, 1024, flags, 0);
+	_sc_card_add_rsa_alg(card, 2048, flags, 0);
+	_sc_card_add_rsa_alg(card, 4096, flags, 0);
+
+	return SC_SUCCESS;
+}
+
+static int virtual_finish(sc_card_t *card)
+{
+	return SC_SUCCESS;
+}
+
+/* Same as the ISO operation, but the input may be longer than 255
+ * bytes and goes out in one extended APDU */
+static int virtual_compute_signature(sc_card_t *card,
+		const u8 *data, size_t datalen, u8 *out, size_t outlen)
+{
+	sc_apdu_t apdu;
+	int r;
+
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+	if (data == NULL || out == NULL || datalen == 0 || outlen < datalen)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_INVALID_ARGUMENTS);
+
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_4, 0x2A, 0x9E, 0x9A);
+	apdu.data = data;
+	apdu.lc = datalen;
+	apdu.datalen = datalen;
+	apdu.resp = out;
+	apdu.resplen = outlen;
+	apdu.le = datalen;
+
+	r = sc_transmit_apdu(card, &apdu);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "APDU transmit failed");
+	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "Card returned error");
+
+	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, apdu.resplen);
+}
+
+static struct sc_card_driver *sc_get_driver(void)
+{
+	struct sc_card_driver *iso_drv = sc_get_iso7816_driver();
+
+	virtual_ops = *iso_drv->ops;
+	virtual_ops.match_card = virtual_match_card;
+	virtual_ops.init = virtual_init;
+	virtual_ops.finish = virtual_finish;
+	virtual_ops.compute_signature = virtual_compute_signature;
+
+	return &virtual_drv;
+}
+
+struct sc_card_driver *sc_get_virtual_driver(void)
+{
+	return sc_get_driver();
+}
@@ -34,6 +34,9 @@
 #define INVALIDATE_CARD_CACHE_IN_UNLOCK
 */
 
+static int match_config_atr(sc_context_t *ctx, struct sc_atr *atr, int skip_default,
+		struct sc_card_driver **driver_out);
+
 int sc_check_sw(sc_card_t *card, unsigned int sw1, unsigned int sw2)
 {
 	if (card == NULL)
@@ -88,8 +91,10 @@ static void sc_card_free(sc_card_t *card)
 {
 	sc_free_apps(card);
 	sc_free_ef_atr(card);
+	_sc_linger_free(card);
 	if (card->ef_dir != NULL)
 		sc_file_free(card->ef_dir);
+	_sc_invalidate_select_cache(card);
 	free(card->ops);
 	if (card->algorithms != NULL)
 		free(card->algorithms);
@@ -102,6 +107,135 @@ static void sc_card_free(sc_card_t *card)
 	free(card);
 }
 
+/* Look for the "extended Lc and Le fields" bit in the card capabilities
+ * (tag 7, third software function table) of the compact-TLV historical
+ * bytes, see ISO 7816-4 8.1.1.2.7 */
+static int hist_bytes_ext_apdu(const u8 *hb, size_t len)
+{
+	size_t i, end;
+
+	if (hb == NULL || len < 1)
+		return 0;
+	if (hb[0] == 0x00 && len >= 4)
+		end = len - 3;	/* three status bytes follow the objects */
+	else if (hb[0] == 0x80)
+		end = len;
+	else
+		return 0;
+
+	for (i = 1; i < end; i += 1 + (hb[i] & 0x0F)) {
+		if ((hb[i] & 0xF0) == 0x70 && (hb[i] & 0x0F) >= 3 && i + 3 < end)
+			return (hb[i + 3] & 0x40) != 0;
+	}
+	return 0;
+}
+
+/* Decide whether extended APDUs may be used to read large files and
+ * responses in one go. Drivers announce SC_CARD_CAP_APDU_EXT themselves,
+ * otherwise it is taken from the ATR or an EF.ATR the driver has read.
+ * The reader must be able to carry them, which rules out T=0 and any
+ * configured max_recv_size. */
+static void sc_card_detect_ext_le(sc_card_t *card)
+{
+	sc_reader_t *reader = card->reader;
+	const struct sc_card_operations *iso_ops = sc_get_iso7816_driver()->ops;
+
+	card->use_ext_le = 0;
+	if (!reader->driver->enable_ext_apdu || reader->active_protocol != SC_PROTO_T1)
+		return;
+
+	if (!(card->caps & SC_CARD_CAP_APDU_EXT)) {
+		if (hist_bytes_ext_apdu(reader->atr_info.hist_bytes, reader->atr_info.hist_bytes_len)
+		 || (card->ef_atr != NULL && (card->ef_atr->card_capabilities & 0x40))) {
+			sc_log(card->ctx, "card announces extended APDU support");
+			card->caps |= SC_CARD_CAP_APDU_EXT;
+		}
+	}
+
+	/* Only the ISO operations are known to size their buffers
+	 * by the length asked for */
+	if ((card->caps & SC_CARD_CAP_APDU_EXT) && card->max_recv_size == 0
+	 && card->ops->read_binary == iso_ops->read_binary)
+		card->use_ext_le = 1;
+}
+
+size_t _sc_get_max_read_size(sc_card_t *card)
+{
+	if (card->max_recv_size > 0)
+		return card->max_recv_size;
+	return card->use_ext_le ? SC_MAX_EXT_APDU_BUFFER_SIZE - 2 : 256;
+}
+
+/* Try one built-in driver on the card. Returns 1 if the driver took
+ * the card, 0 if it does not handle it, or the error from init() */
+static int sc_card_try_driver(sc_card_t *card, struct sc_card_driver *drv)
+{
+	sc_context_t *ctx = card->ctx;
+	const struct sc_card_operations *ops = drv->ops;
+	int r;
+
+	sc_debug(ctx, SC_LOG_DEBUG_MATCH, "trying driver: %s", drv->short_name);
+	if (ops == NULL || ops->match_card == NULL)
+		return 0;
+	/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
+	*card->ops = *ops;
+	if (ops->match_card(card) != 1)
+		return 0;
+	sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matched: %s", drv->name);
+	memcpy(card->ops, ops, sizeof(struct sc_card_operations));
+	card->driver = drv;
+	r = ops->init(card);
+	if (r) {
+		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "driver '%s' init() failed: %s", drv->name,
+		      sc_strerror(r));
+		card->driver = NULL;
+		if (r == SC_ERROR_INVALID_CARD)
+			return 0;
+		return r;
+	}
+	return 1;
+}
+
+static struct sc_card_driver *sc_card_cached_driver(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	char name[64];
+	int i;
+
+	if (_sc_probe_cache_get(ctx, &card->atr, "driver", name, sizeof(name)) != SC_SUCCESS)
+		return NULL;
+	for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		if (!strcmp(ctx->card_drivers[i]->short_name, name)) {
+			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "cached driver for this ATR: %s", name);
+			return ctx->card_drivers[i];
+		}
+	}
+	return NULL;
+}
+
+/* Undo what a failed match_card()/init() may have left behind */
+static void sc_card_reset_probe(sc_card_t *card)
+{
+	card->driver = NULL;
+	card->name = NULL;
+	card->type = -1;
+	card->flags = 0;
+	card->caps = 0;
+	card->max_send_size = 0;
+	card->max_recv_size = 0;
+	if (card->algorithms != NULL) {
+		free(card->algorithms);
+		card->algorithms = NULL;
+	}
+	card->algorithm_count = 0;
+	/* finish() may expect a complete init(), the private data is
+	 * all there is to free */
+	if (card->drv_data != NULL) {
+		free(card->drv_data);
+		card->drv_data = NULL;
+	}
+}
+
 int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 {
 	sc_card_t *card;
@@ -134,26 +268,16 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	/* See if the ATR matches any ATR specified in the config file */
 	if ((driver = ctx->forced_driver) == NULL) {
 		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matching configured ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
-			driver = ctx->card_drivers[i];
-
-			if (driver->atr_map == NULL ||
-			    !strcmp(driver->short_name, "default")) {
-				driver = NULL;
-				continue;
-			}
-			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "trying driver: %s", driver->short_name);
-			idx = _sc_match_atr(card, driver->atr_map, NULL);
-			if (idx >= 0) {
-				struct sc_atr_table *src = &driver->atr_map[idx];
-
-				sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matched: %s", driver->name);
-				/* It's up to card driver to notice these correctly */
-				card->name = src->name;
-				card->type = src->type;
-				card->flags = src->flags;
-				break;
-			}
+		idx = match_config_atr(ctx, &card->atr, 1, &driver);
+		if (idx >= 0) {
+			struct sc_atr_table *src = &driver->atr_map[idx];
+
+			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matched: %s", driver->name);
+			/* It's up to card driver to notice these correctly */
+			card->name = src->name;
+			card->type = src->type;
+			card->flags = src->flags;
+		} else {
 			driver = NULL;
 		}
 	}
@@ -172,33 +296,30 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 			}
 		}
 	} else {
-		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matching built-in ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
-			struct sc_card_driver *drv = ctx->card_drivers[i];
-			const struct sc_card_operations *ops = drv->ops;
+		struct sc_card_driver *cached = NULL;
 
-			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "trying driver: %s", drv->short_name);
-			if (ops == NULL || ops->match_card == NULL)
-				continue;
-			/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
-			*card->ops = *ops;
-			if (ops->match_card(card) != 1)
+		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matching built-in ATRs");
+		r = 0;
+		/* A known card goes straight to the driver that took it
+		 * last time; everything is probed if that does not work */
+		if (ctx->use_probe_cache && (cached = sc_card_cached_driver(card)) != NULL) {
+			r = sc_card_try_driver(card, cached);
+			if (r != 1) {
+				sc_debug(ctx, SC_LOG_DEBUG_MATCH, "cached driver '%s' failed, probing all drivers",
+					cached->short_name);
+				sc_card_reset_probe(card);
+			}
+		}
+		for (i = 0; r != 1 && ctx->card_drivers[i] != NULL; i++) {
+			if (ctx->card_drivers[i] == cached)
 				continue;
-			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matched: %s", drv->name);
-			memcpy(card->ops, ops, sizeof(struct sc_card_operations));
-			card->driver = drv;
-			r = ops->init(card);
-			if (r) {
-				sc_debug(ctx, SC_LOG_DEBUG_MATCH, "driver '%s' init() failed: %s", drv->name,
-				      sc_strerror(r));
-				if (r == SC_ERROR_INVALID_CARD) {
-					card->driver = NULL;
-					continue;
-				}
+			r = sc_card_try_driver(card, ctx->card_drivers[i]);
+			if (r < 0)
 				goto err;
-			}
-			break;
 		}
+		if (ctx->use_probe_cache && card->driver != cached)
+			_sc_probe_cache_set(ctx, &card->atr, "driver",
+					card->driver ? card->driver->short_name : NULL);
 	}
 	if (card->driver == NULL) {
 		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "unable to find driver for inserted card");
@@ -220,8 +341,11 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
            ((reader->driver->max_send_size != 0) && (reader->driver->max_send_size < card->max_send_size)))
                 card->max_send_size = reader->driver->max_send_size;
 
-	sc_log(ctx, "card info name:'%s', type:%i, flags:0x%X, max_send/recv_size:%i/%i",
-		card->name, card->type, card->flags, card->max_send_size, card->max_recv_size);
+	sc_card_detect_ext_le(card);
+
+	sc_log(ctx, "card info name:'%s', type:%i, flags:0x%X, max_send/recv_size:%i/%i, ext Le:%i",
+		card->name, card->type, card->flags, card->max_send_size, card->max_recv_size,
+		card->use_ext_le);
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 err:
 	if (connected)
@@ -242,11 +366,20 @@ int sc_disconnect_card(sc_card_t *card)
 	LOG_FUNC_CALLED(ctx);
 
 	assert(card->lock_count == 0);
+	sc_log(ctx, "APDUs: %lu transmitted, %lu GET RESPONSE, %lu round trips saved, %lu fallbacks, "
+		"%lu bytes updated, %lu SELECTs, %lu SELECTs skipped",
+		card->apdu_stats.transmitted, card->apdu_stats.get_response,
+		card->apdu_stats.saved, card->apdu_stats.fallbacks,
+		card->apdu_stats.update_bytes, card->apdu_stats.selects,
+		card->apdu_stats.selects_skipped);
+	sc_log(ctx, "%lu reader transactions for %lu card operations",
+		card->apdu_stats.transactions, card->apdu_stats.operations);
 	if (card->ops->finish) {
 		int r = card->ops->finish(card);
 		if (r)
 			sc_log(ctx, "card driver finish() failed: %s", sc_strerror(r));
 	}
+	_sc_linger_free(card);
 
 	if (card->reader->ops->disconnect) {
 		int r = card->reader->ops->disconnect(card->reader);
@@ -275,6 +408,8 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 	/* invalidate cache */
 	memset(&card->cache, 0, sizeof(card->cache));
 	card->cache.valid = 0;
+	_sc_invalidate_select_cache(card);
+	_sc_pin_states_lost(card);
 
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -287,7 +422,7 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 
 int sc_lock(sc_card_t *card)
 {
-	int r = 0, r2 = 0;
+	int r = 0, r2 = 0, resumed = 0;
 
 	LOG_FUNC_CALLED(card->ctx);
 	
@@ -297,20 +432,30 @@ int sc_lock(sc_card_t *card)
 	if (r != SC_SUCCESS)
 		return r;
 	if (card->lock_count == 0) {
-		if (card->reader->ops->lock != NULL) {
+		card->apdu_stats.operations++;
+		resumed = _sc_linger_resume(card);
+		if (!resumed && card->reader->ops->lock != NULL) {
 			r = card->reader->ops->lock(card->reader);
 			if (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
 				/* invalidate cache */
 				memset(&card->cache, 0, sizeof(card->cache));
 				card->cache.valid = 0;
+				_sc_invalidate_select_cache(card);
+				_sc_pin_states_lost(card);
 				r = card->reader->ops->lock(card->reader);
 			}
+			if (r == 0)
+				card->apdu_stats.transactions++;
 		}
 		if (r == 0)
 			card->cache.valid = 1;
 	}
-	if (r == 0)
+	if (r == 0) {
+		/* nobody else could use the card while the transaction lingered */
+		if (card->lock_count == 0 && !resumed)
+			card->lock_serial++;
 		card->lock_count++;
+	}
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
 		sc_log(card->ctx, "unable to release lock");
@@ -341,8 +486,9 @@ int sc_unlock(sc_card_t *card)
 		card->cache.valid = 0;
 		sc_log(card->ctx, "cache invalidated");
 #endif
-		/* release reader lock */
-		if (card->reader->ops->unlock != NULL)
+		/* release reader lock, unless it is kept for a while */
+		if (card->reader->ops->unlock != NULL
+		 && _sc_linger_begin(card) != SC_SUCCESS)
 			r = card->reader->ops->unlock(card->reader);
 	}
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
@@ -412,10 +558,19 @@ int sc_delete_file(sc_card_t *card, const sc_path_t *path)
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+/* Errors that may come from a card or reader choking on an extended
+ * Le rather than from the command itself. Anything else (a wrong
+ * offset, an access condition) fails the same with short APDUs and
+ * must not cost the card its extended Le for good */
+static int sc_ext_le_failed(int r)
+{
+	return r == SC_ERROR_WRONG_LENGTH || r == SC_ERROR_TRANSMIT_FAILED;
+}
+
 int sc_read_binary(sc_card_t *card, unsigned int idx,
 		   unsigned char *buf, size_t count, unsigned long flags)
 {
-	size_t max_le = card->max_recv_size > 0 ? card->max_recv_size : 256;
+	size_t max_le = _sc_get_max_read_size(card);
 	int r;
 
 	assert(card != NULL && card->ops != NULL && buf != NULL);
@@ -452,6 +607,15 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 		LOG_FUNC_RETURN(card->ctx, bytes_read);
 	}
 	r = card->ops->read_binary(card, idx, buf, count, flags);
+	if (count > 256 && card->use_ext_le && sc_ext_le_failed(r)) {
+		/* The card or reader did not live up to its promise */
+		sc_log(card->ctx, "extended READ BINARY failed, falling back to short APDUs");
+		card->use_ext_le = 0;
+		card->apdu_stats.fallbacks++;
+		r = sc_read_binary(card, idx, buf, count, flags);
+	} else if (r > 256) {
+		card->apdu_stats.saved += (r + 255) / 256 - 1;
+	}
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -538,6 +702,8 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	r = card->ops->update_binary(card, idx, buf, count, flags);
+	if (r > 0)
+		card->apdu_stats.update_bytes += r;
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -557,9 +723,44 @@ int sc_erase_binary(struct sc_card *card, unsigned int offs, size_t count,  unsi
 }
 
 
+/* Forget the file selected last, see sc_select_file() */
+void _sc_invalidate_select_cache(sc_card_t *card)
+{
+	struct sc_select_cache *c = &card->select_cache;
+
+	if (c->file != NULL)
+		sc_file_free(c->file);
+	memset(c, 0, sizeof(*c));
+}
+
+/* Only paths from the MF and DF names are the same file whatever
+ * was current before */
+static int select_cache_trackable(const sc_path_t *path)
+{
+	if (path->type == SC_PATH_TYPE_DF_NAME)
+		return path->len != 0;
+	if (path->type == SC_PATH_TYPE_PATH)
+		return path->len >= 2 && path->value[0] == 0x3F && path->value[1] == 0x00;
+	return 0;
+}
+
+static int select_cache_match(sc_card_t *card, const sc_path_t *path, int want_file)
+{
+	const struct sc_select_cache *c = &card->select_cache;
+
+	return c->valid && card->lock_count > 0 && c->lock_serial == card->lock_serial
+		&& (!want_file || c->file != NULL)
+		&& c->path.type == path->type && c->path.len == path->len
+		&& memcmp(c->path.value, path->value, path->len) == 0
+		&& c->path.aid.len == path->aid.len
+		&& memcmp(c->path.aid.value, path->aid.value, path->aid.len) == 0;
+}
+
 int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 {
 	int r;
+	unsigned long selects;
+	struct sc_select_cache *c = &card->select_cache;
 	char pbuf[SC_MAX_PATH_STRING_SIZE];
 
 	assert(card != NULL && in_path != NULL);
@@ -589,11 +790,40 @@ int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 	}
 	if (card->ops->select_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+
+	/* Within one transaction nobody else can select another file,
+	 * and the APDU layer forgets the file on any command that may */
+	if (card->ctx->skip_redundant_select && !(card->caps & SC_CARD_CAP_NO_SELECT_CACHE)
+			&& select_cache_match(card, in_path, file != NULL)) {
+		if (file != NULL) {
+			sc_file_dup(file, c->file);
+			if (*file == NULL)
+				LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+			(*file)->path = *in_path;
+		}
+		card->apdu_stats.selects_skipped++;
+		sc_log(card->ctx, "already selected");
+		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+	}
+	_sc_invalidate_select_cache(card);
+
+	selects = card->apdu_stats.selects;
 	r = card->ops->select_file(card, in_path, file);
 	/* Remember file path */
 	if (r == 0 && file && *file)
 		(*file)->path = *in_path;
 
+	/* Drivers that emulate the file system send no SELECT, and
+	 * may change the current file with other commands */
+	if (r == 0 && card->apdu_stats.selects != selects
+			&& card->lock_count > 0 && select_cache_trackable(in_path)) {
+		c->path = *in_path;
+		c->lock_serial = card->lock_serial;
+		if (file != NULL && *file != NULL)
+			sc_file_dup(&c->file, *file);
+		c->valid = 1;
+	}
+
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -813,65 +1043,230 @@ sc_algorithm_info_t * sc_card_find_gostr3410_alg(sc_card_t *card,
 	return sc_card_find_alg(card, SC_ALGORITHM_GOSTR3410, key_length);
 }
 
-static int match_atr_table(sc_context_t *ctx, struct sc_atr_table *table, struct sc_atr *atr)
+/*
+ * ATR tables are compiled once per context: the ATRs and masks are
+ * converted to binary and the entries sorted by ATR length, so that
+ * matching a card only compares the bytes of the entries with the
+ * length of its ATR. The table of a card driver is compiled the first
+ * time the driver looks at a card; the ATRs configured for all
+ * drivers (table NULL) go into a single index.
+ */
+struct sc_atr_index_entry {
+	u8 value[SC_MAX_ATR_SIZE];	/* already AND'd with the mask */
+	u8 mask[SC_MAX_ATR_SIZE];
+	size_t len;
+	int has_mask;
+	unsigned int seq;		/* position in table order */
+	int idx;			/* index into the driver's table */
+	struct sc_card_driver *driver;	/* configured ATRs only */
+};
+
+struct sc_atr_index {
+	const struct sc_atr_table *table;
+	struct sc_atr_index_entry *entries;
+	size_t count;
+	struct sc_atr_index *next;
+};
+
+static int atr_index_entry_cmp(const void *a, const void *b)
 {
-	u8 *card_atr_bin = atr->value;
-	size_t card_atr_bin_len = atr->len;
-	char card_atr_hex[3 * SC_MAX_ATR_SIZE];
-	size_t card_atr_hex_len;
-	unsigned int i = 0;
+	const struct sc_atr_index_entry *ea = (const struct sc_atr_index_entry *) a;
+	const struct sc_atr_index_entry *eb = (const struct sc_atr_index_entry *) b;
 
-	if (ctx == NULL || table == NULL || atr == NULL)
+	if (ea->len != eb->len)
+		return ea->len < eb->len ? -1 : 1;
+	/* the first matching entry of a table wins */
+	return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+static int atr_index_add(sc_context_t *ctx, struct sc_atr_index *index,
+		const struct sc_atr_table *table, int idx, struct sc_card_driver *driver)
+{
+	struct sc_atr_index_entry *e = &index->entries[index->count];
+	size_t len = sizeof(e->value), mask_len = sizeof(e->mask), i;
+
+	memset(e, 0, sizeof(*e));
+	if (sc_hex_to_bin(table[idx].atr, e->value, &len) != SC_SUCCESS || len == 0) {
+		sc_log(ctx, "invalid ATR ignored: %s", table[idx].atr);
 		return -1;
-	sc_bin_to_hex(card_atr_bin, card_atr_bin_len, card_atr_hex, sizeof(card_atr_hex), ':');
-	card_atr_hex_len = strlen(card_atr_hex);
+	}
+	if (table[idx].atrmask != NULL) {
+		if (sc_hex_to_bin(table[idx].atrmask, e->mask, &mask_len) != SC_SUCCESS
+		 || mask_len != len) {
+			sc_log(ctx, "length of atr and atr mask do not match - ignored: %s - %s",
+				table[idx].atr, table[idx].atrmask);
+			return -1;
+		}
+		for (i = 0; i < len; i++)
+			e->value[i] &= e->mask[i];
+		e->has_mask = 1;
+	}
+	e->len = len;
+	e->seq = index->count;
+	e->idx = idx;
+	e->driver = driver;
+	index->count++;
+	return 0;
+}
 
-	sc_log(ctx, "ATR     : %s", card_atr_hex);
+static struct sc_atr_index *atr_index_build(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_index *index;
+	struct sc_card_driver *drv;
+	size_t count = 0;
+	int i, j;
 
-	for (i = 0; table[i].atr != NULL; i++) {
-		const char *tatr = table[i].atr;
-		const char *matr = table[i].atrmask;
-		size_t tatr_len = strlen(tatr);
-		u8 mbin[SC_MAX_ATR_SIZE], tbin[SC_MAX_ATR_SIZE];
-		size_t mbin_len, tbin_len, s, matr_len;
-		size_t fix_hex_len = card_atr_hex_len;
-		size_t fix_bin_len = card_atr_bin_len;
+	if (table != NULL) {
+		for (j = 0; table[j].atr != NULL; j++)
+			count++;
+	} else {
+		for (i = 0; ctx->card_drivers[i] != NULL; i++)
+			count += ctx->card_drivers[i]->natrs;
+	}
 
-		sc_log(ctx, "ATR try : %s", tatr);
+	index = calloc(1, sizeof(struct sc_atr_index));
+	if (index == NULL)
+		return NULL;
+	index->table = table;
+	if (count > 0) {
+		index->entries = calloc(count, sizeof(struct sc_atr_index_entry));
+		if (index->entries == NULL) {
+			free(index);
+			return NULL;
+		}
+	}
 
-		if (tatr_len != fix_hex_len) {
-			sc_log(ctx, "ignored - wrong length");
-			continue;
+	if (table != NULL) {
+		for (j = 0; table[j].atr != NULL; j++)
+			atr_index_add(ctx, index, table, j, NULL);
+	} else {
+		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+			drv = ctx->card_drivers[i];
+			for (j = 0; drv->atr_map != NULL && drv->atr_map[j].atr != NULL; j++)
+				atr_index_add(ctx, index, drv->atr_map, j, drv);
 		}
-		if (matr != NULL) {
-			sc_log(ctx, "ATR mask: %s", matr);
+	}
+	if (index->count > 1)
+		qsort(index->entries, index->count, sizeof(struct sc_atr_index_entry),
+			atr_index_entry_cmp);
+	return index;
+}
 
-			matr_len = strlen(matr);
-			if (tatr_len != matr_len)
-				continue;
-			tbin_len = sizeof(tbin);
-			sc_hex_to_bin(tatr, tbin, &tbin_len);
-			mbin_len = sizeof(mbin);
-			sc_hex_to_bin(matr, mbin, &mbin_len);
-			if (mbin_len != fix_bin_len) {
-				sc_log(ctx, "length of atr and atr mask do not match - ignored: %s - %s", tatr, matr); 
-				continue;
-			}
-			for (s = 0; s < tbin_len; s++) {
-				/* reduce tatr with mask */
-				tbin[s] = (tbin[s] & mbin[s]);
-				/* create copy of card_atr_bin masked) */
-				mbin[s] = (card_atr_bin[s] & mbin[s]);
-			}
-			if (memcmp(tbin, mbin, tbin_len) != 0)
-				continue;
+/* Returns the compiled form of table, NULL for the configured ATRs */
+static const struct sc_atr_index *atr_index_get(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_index *index;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (index = ctx->atr_index; index != NULL; index = index->next)
+		if (index->table == table)
+			break;
+	if (index == NULL) {
+		index = atr_index_build(ctx, table);
+		if (index != NULL) {
+			index->next = ctx->atr_index;
+			ctx->atr_index = index;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+	return index;
+}
+
+/* Drops the compiled form of table and of the configured ATRs */
+static void atr_index_forget(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_index **p, *index;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (p = &ctx->atr_index; (index = *p) != NULL; ) {
+		if (index->table == table || index->table == NULL) {
+			*p = index->next;
+			free(index->entries);
+			free(index);
 		} else {
-			if (strncasecmp(tatr, card_atr_hex, tatr_len) != 0)
+			p = &index->next;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
+void _sc_free_atr_index(sc_context_t *ctx)
+{
+	struct sc_atr_index *index;
+
+	while ((index = ctx->atr_index) != NULL) {
+		ctx->atr_index = index->next;
+		free(index->entries);
+		free(index);
+	}
+}
+
+static const struct sc_atr_index_entry *atr_index_match(const struct sc_atr_index *index,
+		const struct sc_atr *atr, int skip_default)
+{
+	const struct sc_atr_index_entry *e;
+	size_t lo = 0, hi = index->count, mid, s;
+
+	if (atr->len == 0)
+		return NULL;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index->entries[mid].len < atr->len)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (e = index->entries + lo; e < index->entries + index->count && e->len == atr->len; e++) {
+		if (skip_default && e->driver != NULL && !strcmp(e->driver->short_name, "default"))
+			continue;
+		if (e->has_mask) {
+			for (s = 0; s < e->len; s++)
+				if ((atr->value[s] & e->mask[s]) != e->value[s])
+					break;
+			if (s < e->len)
 				continue;
+		} else if (memcmp(atr->value, e->value, e->len) != 0) {
+			continue;
 		}
-		return i;
+		return e;
+	}
+	return NULL;
+}
+
+static int match_atr_table(sc_context_t *ctx, struct sc_atr_table *table, struct sc_atr *atr)
+{
+	const struct sc_atr_index *index;
+	const struct sc_atr_index_entry *e;
+
+	if (ctx == NULL || table == NULL || atr == NULL)
+		return -1;
+	index = atr_index_get(ctx, table);
+	if (index == NULL) {
+		sc_log(ctx, "failed to compile ATR table");
+		return -1;
 	}
-	return -1;
+	e = atr_index_match(index, atr, 0);
+	if (e == NULL)
+		return -1;
+	sc_log(ctx, "ATR matched: %s", table[e->idx].atr);
+	return e->idx;
+}
+
+/* Returns the index into the atr_map of the driver in *driver_out */
+static int match_config_atr(sc_context_t *ctx, struct sc_atr *atr, int skip_default,
+		struct sc_card_driver **driver_out)
+{
+	const struct sc_atr_index *index;
+	const struct sc_atr_index_entry *e;
+
+	index = atr_index_get(ctx, NULL);
+	if (index == NULL)
+		return -1;
+	e = atr_index_match(index, atr, skip_default);
+	if (e == NULL)
+		return -1;
+	*driver_out = e->driver;
+	return e->idx;
 }
 
 int _sc_match_atr(sc_card_t *card, struct sc_atr_table *table, int *type_out)
@@ -891,37 +1286,29 @@ int _sc_match_atr(sc_card_t *card, struct sc_atr_table *table, int *type_out)
 scconf_block *_sc_match_atr_block(sc_context_t *ctx, struct sc_card_driver *driver, struct sc_atr *atr)
 {
 	struct sc_card_driver *drv;
-	struct sc_atr_table *table;
 	int res;
 
 	if (ctx == NULL)
 		return NULL;
 	if (driver) {
-		drv = driver;
-		table = drv->atr_map;
-		res = match_atr_table(ctx, table, atr);
+		res = match_atr_table(ctx, driver->atr_map, atr);
 		if (res < 0)
 			return NULL;
-		return table[res].card_atr;
-	} else {
-		unsigned int i;
-
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
-			drv = ctx->card_drivers[i];
-			table = drv->atr_map;
-			res = match_atr_table(ctx, table, atr);
-			if (res < 0)
-				continue;
-			return table[res].card_atr;
-		}
+		return driver->atr_map[res].card_atr;
 	}
-	return NULL;
+	if (atr == NULL)
+		return NULL;
+	res = match_config_atr(ctx, atr, 0, &drv);
+	if (res < 0)
+		return NULL;
+	return drv->atr_map[res].card_atr;
 }
 
 int _sc_add_atr(sc_context_t *ctx, struct sc_card_driver *driver, struct sc_atr_table *src)
 {
 	struct sc_atr_table *map, *dst;
 
+	atr_index_forget(ctx, driver->atr_map);
 	map = (struct sc_atr_table *) realloc(driver->atr_map,
 			(driver->natrs + 2) * sizeof(struct sc_atr_table));
 	if (!map)
@@ -957,6 +1344,7 @@ int _sc_free_atr(sc_context_t *ctx, struct sc_card_driver *driver)
 {
 	unsigned int i;
 
+	atr_index_forget(ctx, driver->atr_map);
 	for (i = 0; i < driver->natrs; i++) {
 		struct sc_atr_table *src = &driver->atr_map[i];
 
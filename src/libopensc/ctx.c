@@ -27,6 +27,9 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <limits.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #ifdef HAVE_LTDL_H
 #include <ltdl.h>
@@ -96,6 +99,7 @@ static const struct _sc_driver_entry internal_card_drivers[] = {
 	{ "rutoken_ecp",(void *(*)(void)) sc_get_rtecp_driver },
 	{ "westcos",	(void *(*)(void)) sc_get_westcos_driver },
 	{ "myeid",      (void *(*)(void)) sc_get_myeid_driver },
+	{ "virtual",	(void *(*)(void)) sc_get_virtual_driver },
 
 /* Here should be placed drivers that need some APDU transactions to
  * recognise its cards. */
@@ -116,6 +120,7 @@ struct _sc_ctx_options {
 	struct _sc_driver_entry cdrv[SC_MAX_CARD_DRIVERS];
 	int ccount;
 	char *forced_card_driver;
+	char *reader_driver;
 };
 
 
@@ -187,6 +192,7 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
 		ctx->debug_file = fopen("/tmp/opensc-tokend.log", "a");
 #endif
 	ctx->forced_driver = NULL;
+	ctx->skip_redundant_select = 1;
 	add_internal_drvs(opts);
 }
 
@@ -216,7 +222,7 @@ int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 static int load_parameters(sc_context_t *ctx, scconf_block *block,
 			   struct _sc_ctx_options *opts)
 {
-	int err = 0;
+	int err = 0, linger;
 	const scconf_list *list;
 	const char *val, *s_internal = "internal";
     const char *debug = NULL;
@@ -237,6 +243,18 @@ static int load_parameters(sc_context_t *ctx, scconf_block *block,
 		opts->forced_card_driver = strdup(val);
 	}
 
+	val = scconf_get_str(block, "reader_driver", NULL);
+	if (val) {
+		if (opts->reader_driver)
+			free(opts->reader_driver);
+		opts->reader_driver = strdup(val);
+	}
+
+	ctx->use_probe_cache = scconf_get_bool(block, "use_probe_caching", ctx->use_probe_cache);
+	ctx->skip_redundant_select = scconf_get_bool(block, "skip_redundant_select", ctx->skip_redundant_select);
+	linger = scconf_get_int(block, "transaction_linger", ctx->transaction_linger);
+	ctx->transaction_linger = linger > 0 ? linger : 0;
+
 	list = scconf_find_list(block, "card_drivers");
 	if (list != NULL)
 		del_drvs(opts);
@@ -258,12 +276,14 @@ static void load_reader_driver_options(sc_context_t *ctx)
 	
 	driver->max_send_size = 0;
 	driver->max_recv_size = 0;
+	driver->enable_ext_apdu = 1;
 
 	conf_block = sc_get_conf_block(ctx, "reader_driver", driver->short_name, 1);
 	
 	if (conf_block != NULL) {
 		driver->max_send_size = scconf_get_int(conf_block, "max_send_size", driver->max_send_size);
 		driver->max_recv_size = scconf_get_int(conf_block, "max_recv_size", driver->max_recv_size);
+		driver->enable_ext_apdu = scconf_get_bool(conf_block, "enable_extended_apdu", driver->enable_ext_apdu);
 	}
 }
 
@@ -490,11 +510,35 @@ static int load_card_atrs(sc_context_t *ctx)
 	return SC_SUCCESS;
 }
 
+static int config_cache_path(sc_context_t *ctx, const char *conf_path,
+		char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	const char *name;
+	int r;
+
+	r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+	name = strrchr(conf_path, '/');
+#ifdef _WIN32
+	if (strrchr(conf_path, '\\') > name)
+		name = strrchr(conf_path, '\\');
+#endif
+	name = name ? name + 1 : conf_path;
+	r = snprintf(buf, bufsize, "%s/config_%s", dir, name);
+	if (r < 0 || (size_t) r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
 static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 {
 	int i, r, count = 0;
+	int use_cache = 0, cached = 0;
 	scconf_block **blocks;
 	const char *conf_path = NULL;
+	char cache_path[PATH_MAX];
 #ifdef _WIN32
 	char temp_path[PATH_MAX];
 	DWORD temp_len;
@@ -540,7 +584,13 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	ctx->conf = scconf_new(conf_path);
 	if (ctx->conf == NULL)
 		return;
-	r = scconf_parse(ctx->conf);
+	/* A snapshot is only loaded while the config file is unchanged,
+	 * so its "use_config_cache" is the one of the config file */
+	if (config_cache_path(ctx, conf_path, cache_path, sizeof(cache_path)) != SC_SUCCESS)
+		cache_path[0] = '\0';
+	else if (scconf_parse_binary(ctx->conf, cache_path) > 0)
+		cached = 1;
+	r = cached ? 1 : scconf_parse(ctx->conf);
 #ifdef OPENSC_CONFIG_STRING
 	/* Parse the string if config file didn't exist */
 	if (r < 0)
@@ -570,8 +620,22 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	}
 	/* Above we add 2 blocks at most, but conf_blocks has 3 elements,
 	 * so at least one is NULL */
-	for (i = 0; ctx->conf_blocks[i]; i++)
+	for (i = 0; ctx->conf_blocks[i]; i++) {
 		load_parameters(ctx, ctx->conf_blocks[i], opts);
+		use_cache = scconf_get_bool(ctx->conf_blocks[i], "use_config_cache", use_cache);
+	}
+
+	if (cached) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "using config snapshot %s", cache_path);
+	} else if (use_cache && cache_path[0]) {
+		if (scconf_write_binary(ctx->conf, cache_path) < 0
+		 && (sc_make_cache_dir(ctx) < 0 || scconf_write_binary(ctx->conf, cache_path) < 0))
+			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "failed to write config snapshot %s", cache_path);
+	} else if (cache_path[0]) {
+		/* do not leave a stale snapshot behind for when the option
+		 * is set again */
+		unlink(cache_path);
+	}
 }
 
 int sc_ctx_detect_readers(sc_context_t *ctx)
@@ -681,6 +745,23 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 #elif defined(ENABLE_OPENCT)
 	ctx->reader_driver = sc_get_openct_driver();
 #endif
+	/* The virtual reader is built in everywhere and replaces the
+	 * hardware driver only when the configuration asks for it: its
+	 * cards have a well known PIN */
+	if (opts.reader_driver && strcmp(opts.reader_driver, "virtual") == 0)
+		ctx->reader_driver = sc_get_virtual_reader_driver();
+	if (opts.reader_driver) {
+		free(opts.reader_driver);
+		opts.reader_driver = NULL;
+	}
+	if (ctx->reader_driver == NULL) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "no reader driver");
+		if (opts.forced_card_driver)
+			free(opts.forced_card_driver);
+		del_drvs(&opts);
+		sc_release_context(ctx);
+		return SC_ERROR_NOT_SUPPORTED;
+	}
 
 	load_reader_driver_options(ctx);
 	ctx->reader_driver->ops->init(ctx);
@@ -740,9 +821,12 @@ int sc_release_context(sc_context_t *ctx)
 		_sc_delete_reader(ctx, rdr);
 	}
 
-	if (ctx->reader_driver->ops->finish != NULL)
+	if (ctx->reader_driver != NULL && ctx->reader_driver->ops->finish != NULL)
 		ctx->reader_driver->ops->finish(ctx);
 
+	_sc_free_atr_index(ctx);
+	if (ctx->free_profile_cache != NULL)
+		ctx->free_profile_cache(ctx->profile_cache);
 	for (i = 0; ctx->card_drivers[i]; i++) {
 		struct sc_card_driver *drv = ctx->card_drivers[i];
 
@@ -868,3 +952,36 @@ int sc_make_cache_dir(sc_context_t *ctx)
 failed:	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "failed to create cache directory");
 	return SC_ERROR_INTERNAL;
 }
+
+/* Opens a new temporary file next to fname, creating the cache
+ * directory if needed. Its name is unique where mkstemp() is there,
+ * so that concurrent writers never share it; the caller renames it
+ * over fname when done */
+FILE *_sc_open_cache_tmpfile(sc_context_t *ctx, const char *fname,
+			     char *tmpname, size_t tmpname_len)
+{
+	FILE *f;
+	int retry;
+
+	for (retry = 0; retry < 2; retry++) {
+#ifdef HAVE_MKSTEMP
+		int fd;
+
+		snprintf(tmpname, tmpname_len, "%s.XXXXXX", fname);
+		fd = mkstemp(tmpname);
+		if (fd < 0) {
+			f = NULL;
+		} else if ((f = fdopen(fd, "wb")) == NULL) {
+			close(fd);
+			unlink(tmpname);
+		}
+#else
+		snprintf(tmpname, tmpname_len, "%s.tmp", fname);
+		f = fopen(tmpname, "wb");
+#endif
+		if (f != NULL || errno != ENOENT || retry
+				|| sc_make_cache_dir(ctx) < 0)
+			break;
+	}
+	return f;
+}
@@ -81,6 +81,15 @@ int _sc_parse_atr(struct sc_reader *reader);
 /* Add an ATR to the card driver's struct sc_atr_table */
 int _sc_add_atr(struct sc_context *ctx, struct sc_card_driver *driver, struct sc_atr_table *src);
 int _sc_free_atr(struct sc_context *ctx, struct sc_card_driver *driver);
+/* Free the compiled ATR tables of the context */
+void _sc_free_atr_index(struct sc_context *ctx);
+void _sc_invalidate_select_cache(struct sc_card *card);
+/* The card lost all security state (reset, logout), see sc_pin_state() */
+void _sc_pin_states_lost(struct sc_card *card);
+/* Keeping the reader transaction open after sc_unlock(), see linger.c */
+int _sc_linger_begin(struct sc_card *card);
+int _sc_linger_resume(struct sc_card *card);
+void _sc_linger_free(struct sc_card *card);
 
 /**
  * Convert an unsigned long into 4 bytes in big endian order
@@ -118,6 +127,19 @@ scconf_block *_sc_match_atr_block(sc_context_t *ctx, struct sc_card_driver *driv
  * be null terminated. */
 int _sc_match_atr(struct sc_card *card, struct sc_atr_table *table, int *type_out);
 
+/* ATR -> card driver/emulator hints kept in the cache directory */
+int _sc_probe_cache_get(struct sc_context *ctx, const struct sc_atr *atr,
+			const char *key, char *value, size_t value_len);
+int _sc_probe_cache_set(struct sc_context *ctx, const struct sc_atr *atr,
+			const char *key, const char *value);
+
+/* Temporary file to write a cache file through, see ctx.c */
+FILE *_sc_open_cache_tmpfile(struct sc_context *ctx, const char *fname,
+			     char *tmpname, size_t tmpname_len);
+
+/* Returns the largest Le to use for a single READ BINARY */
+size_t _sc_get_max_read_size(struct sc_card *card);
+
 int _sc_card_add_algorithm(struct sc_card *card, const struct sc_algorithm_info *info);
 int _sc_card_add_rsa_alg(struct sc_card *card, unsigned int key_length,
 			 unsigned long flags, unsigned long exponent);
@@ -225,6 +247,19 @@ unsigned long sc_thread_id(const sc_context_t *ctx);
  */
 int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 	size_t *len, unsigned int proto);
+/**
+ * Encodes the APDU into a buffer owned by the caller.
+ * @param  ctx     sc_context_t object
+ * @param  apdu    sc_apdu_t object with the APDU to encode
+ * @param  proto   protocol to be used
+ * @param  buf     output buffer
+ * @param  buflen  size of the output buffer
+ * @param  len     length of the encoded APDU; also set if buf is too small
+ * @return SC_SUCCESS on success, SC_ERROR_BUFFER_TOO_SMALL if buflen is
+ *         less than len and an error code otherwise
+ */
+int sc_apdu_write_octets(sc_context_t *ctx, const sc_apdu_t *apdu,
+	unsigned int proto, u8 *buf, size_t buflen, size_t *len);
 /**
  * Sets the status bytes and return data in the APDU
  * @param  ctx     sc_context_t object
@@ -250,6 +285,7 @@ extern struct sc_reader_driver *sc_get_pcsc_driver(void);
 extern struct sc_reader_driver *sc_get_ctapi_driver(void);
 extern struct sc_reader_driver *sc_get_openct_driver(void);
 extern struct sc_reader_driver *sc_get_cardmod_driver(void);
+extern struct sc_reader_driver *sc_get_virtual_reader_driver(void);
 
 #ifdef __cplusplus
 }
@@ -121,17 +121,24 @@ static int iso7816_read_binary(sc_card_t *card,
 		return SC_ERROR_OFFSET_TOO_LARGE;
 	}
 
-	assert(count <= (card->max_recv_size > 0 ? card->max_recv_size : 256));
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0xB0, (idx >> 8) & 0x7F, idx & 0xFF);
+	assert(count <= _sc_get_max_read_size(card));
+	if (count > 256) {
+		/* extended Le, read straight into the caller's buffer */
+		sc_format_apdu(card, &apdu, SC_APDU_CASE_2, 0xB0, (idx >> 8) & 0x7F, idx & 0xFF);
+		apdu.resp = buf;
+	} else {
+		sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0xB0, (idx >> 8) & 0x7F, idx & 0xFF);
+		apdu.resp = recvbuf;
+	}
 	apdu.le = count;
 	apdu.resplen = count;
-	apdu.resp = recvbuf;
 
 	r = sc_transmit_apdu(card, &apdu);
 	SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, r, "APDU transmit failed");
 	if (apdu.resplen == 0)
 		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, sc_check_sw(card, apdu.sw1, apdu.sw2));
-	memcpy(buf, recvbuf, apdu.resplen);
+	if (apdu.resp != buf)
+		memcpy(buf, recvbuf, apdu.resplen);
 
 	r =  sc_check_sw(card, apdu.sw1, apdu.sw2);
 	if (r == SC_ERROR_FILE_END_REACHED)
@@ -632,7 +639,8 @@ static int iso7816_get_response(sc_card_t *card, size_t *count, u8 *buf)
 	else
 		rlen = *count;
 
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0xC0, 0x00, 0x00);
+	sc_format_apdu(card, &apdu, rlen > 256 ? SC_APDU_CASE_2 : SC_APDU_CASE_2_SHORT,
+		       0xC0, 0x00, 0x00);
 	apdu.le      = rlen;
 	apdu.resplen = rlen;
 	apdu.resp    = buf;
@@ -0,0 +1,201 @@
+/*
+ * linger.c: Keeping the reader transaction after sc_unlock()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "internal.h"
+
+/*
+ * Every sc_lock() of an unlocked card begins a reader transaction
+ * (SCardBeginTransaction with PC/SC) and the matching sc_unlock()
+ * ends it, each a round trip to the resource manager. Applications
+ * tend to use the card in bursts: a PKCS#11 C_FindObjects, a few
+ * C_GetAttributeValue and a C_Sign are as many transactions.
+ *
+ * With "transaction_linger" set, the last sc_unlock() leaves the
+ * transaction open, and a thread of the card ends it once the card
+ * was not locked again for that many milliseconds. An sc_lock()
+ * within the window takes over the open transaction. As PC/SC does
+ * not tell whether another process is waiting for the card, the
+ * window is all other processes have to wait for, so it should be
+ * short.
+ *
+ * The card's mutex may be a no-op, and the thread does not take it:
+ * the linger mutex orders the thread against sc_lock() and
+ * sc_unlock(), and the reader is unlocked with it held.
+ */
+
+#ifdef HAVE_PTHREAD
+
+struct sc_linger {
+	sc_card_t *card;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int lingering;		/* the reader is locked, lock_count is 0 */
+	int shutdown;
+	struct timespec deadline;
+};
+
+static void *linger_thread(void *arg)
+{
+	struct sc_linger *l = (struct sc_linger *) arg;
+	sc_reader_t *reader = l->card->reader;
+	struct timeval tv;
+	int r;
+
+	pthread_mutex_lock(&l->mutex);
+	while (!l->shutdown) {
+		if (!l->lingering) {
+			pthread_cond_wait(&l->cond, &l->mutex);
+			continue;
+		}
+		/* the deadline moves on when the card is unlocked again */
+		if (pthread_cond_timedwait(&l->cond, &l->mutex, &l->deadline) != ETIMEDOUT)
+			continue;
+		gettimeofday(&tv, NULL);
+		if (!l->lingering || tv.tv_sec < l->deadline.tv_sec
+		 || (tv.tv_sec == l->deadline.tv_sec
+		  && tv.tv_usec * 1000L < l->deadline.tv_nsec))
+			continue;
+		l->lingering = 0;
+		r = reader->ops->unlock(reader);
+		if (r != SC_SUCCESS)
+			sc_log(l->card->ctx, "releasing the lingering transaction failed: %s",
+				sc_strerror(r));
+	}
+	pthread_mutex_unlock(&l->mutex);
+	return NULL;
+}
+
+static int linger_new(sc_card_t *card)
+{
+	struct sc_linger *l;
+
+	l = calloc(1, sizeof(*l));
+	if (l == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	l->card = card;
+	pthread_mutex_init(&l->mutex, NULL);
+	pthread_cond_init(&l->cond, NULL);
+	if (pthread_create(&l->thread, NULL, linger_thread, l) != 0) {
+		pthread_cond_destroy(&l->cond);
+		pthread_mutex_destroy(&l->mutex);
+		free(l);
+		return SC_ERROR_INTERNAL;
+	}
+	card->linger = l;
+	return SC_SUCCESS;
+}
+
+/* Called by sc_unlock() instead of unlocking the reader. Returns
+ * SC_SUCCESS if the transaction is kept open */
+int _sc_linger_begin(sc_card_t *card)
+{
+	unsigned int ms = card->ctx->transaction_linger;
+	struct sc_linger *l;
+	struct timeval tv;
+
+	if (ms == 0)
+		return SC_ERROR_NOT_SUPPORTED;
+	if (card->linger == NULL && linger_new(card) != SC_SUCCESS)
+		return SC_ERROR_NOT_SUPPORTED;
+	l = card->linger;
+
+	gettimeofday(&tv, NULL);
+	tv.tv_sec += ms / 1000;
+	tv.tv_usec += (ms % 1000) * 1000;
+	if (tv.tv_usec >= 1000000) {
+		tv.tv_sec++;
+		tv.tv_usec -= 1000000;
+	}
+
+	pthread_mutex_lock(&l->mutex);
+	l->deadline.tv_sec = tv.tv_sec;
+	l->deadline.tv_nsec = tv.tv_usec * 1000L;
+	l->lingering = 1;
+	pthread_cond_signal(&l->cond);
+	pthread_mutex_unlock(&l->mutex);
+	return SC_SUCCESS;
+}
+
+/* Called by sc_lock() before locking the reader. Returns 1 if the
+ * transaction of the last sc_unlock() is still open */
+int _sc_linger_resume(sc_card_t *card)
+{
+	struct sc_linger *l = card->linger;
+	int held;
+
+	if (l == NULL)
+		return 0;
+	pthread_mutex_lock(&l->mutex);
+	held = l->lingering;
+	l->lingering = 0;
+	pthread_mutex_unlock(&l->mutex);
+	return held;
+}
+
+/* Ends a lingering transaction and stops the thread */
+void _sc_linger_free(sc_card_t *card)
+{
+	struct sc_linger *l = card->linger;
+
+	if (l == NULL)
+		return;
+	pthread_mutex_lock(&l->mutex);
+	if (l->lingering && card->reader->ops->unlock != NULL)
+		card->reader->ops->unlock(card->reader);
+	l->lingering = 0;
+	l->shutdown = 1;
+	pthread_cond_signal(&l->cond);
+	pthread_mutex_unlock(&l->mutex);
+
+	pthread_join(l->thread, NULL);
+	pthread_cond_destroy(&l->cond);
+	pthread_mutex_destroy(&l->mutex);
+	free(l);
+	card->linger = NULL;
+}
+
+#else	/* HAVE_PTHREAD */
+
+int _sc_linger_begin(sc_card_t *card)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+int _sc_linger_resume(sc_card_t *card)
+{
+	return 0;
+}
+
+void _sc_linger_free(sc_card_t *card)
+{
+}
+
+#endif	/* HAVE_PTHREAD */
@@ -257,6 +257,7 @@ struct sc_reader_driver {
 
 	size_t max_send_size; /* Max Lc supported by the reader layer */
 	size_t max_recv_size; /* Mac Le supported by the reader layer */
+	int enable_ext_apdu; /* Use extended APDUs where the card supports them */
 	void *dll;
 };
 
@@ -414,6 +415,49 @@ struct sc_reader_operations {
 #define SC_CARD_CAP_ONLY_RAW_HASH		0x00000040
 #define SC_CARD_CAP_ONLY_RAW_HASH_STRIPPED	0x00000080
 
+/* The driver keeps track of the current file itself (card->cache),
+ * sc_select_file() always calls its select_file */
+#define SC_CARD_CAP_NO_SELECT_CACHE	0x00000100
+
+/* APDU round trip counters of a card, see apdu.c */
+struct sc_apdu_stats {
+	unsigned long transmitted;	/* APDUs sent to the reader */
+	unsigned long get_response;	/* of which GET RESPONSE */
+	unsigned long saved;		/* round trips saved by extended Le */
+	unsigned long fallbacks;	/* extended Le failed, retried short */
+	unsigned long update_bytes;	/* data bytes written by UPDATE BINARY */
+	unsigned long selects;		/* SELECT FILE commands */
+	unsigned long selects_skipped;	/* SELECTs of the current file not sent */
+	unsigned long operations;	/* sc_lock() calls on the unlocked card */
+	unsigned long transactions;	/* reader transactions begun for them */
+};
+
+/* The file last selected with sc_select_file(), kept while the card
+ * stays locked and only commands known to leave the current file
+ * alone are sent; see card.c */
+struct sc_select_cache {
+	int valid;
+	unsigned long lock_serial;
+	struct sc_path path;
+	struct sc_file *file;		/* as returned by the card driver, or NULL */
+};
+
+/* PIN verification state as far as this process knows it. A PIN
+ * verified by someone else is UNKNOWN; one that another process
+ * logged out without resetting the card may still show LOGGED_IN,
+ * so the card has the last word. See sc_pin_state() */
+#define SC_PIN_STATE_UNKNOWN	0
+#define SC_PIN_STATE_LOGGED_OUT	1
+#define SC_PIN_STATE_LOGGED_IN	2
+
+#define SC_MAX_PIN_STATES	8
+
+struct sc_pin_state {
+	unsigned int type;		/* SC_AC_CHV etc. */
+	int reference;
+	int state;			/* SC_PIN_STATE_* */
+};
+
 typedef struct sc_card {
 	struct sc_context *ctx;
 	struct sc_reader *reader;
@@ -425,6 +469,8 @@ typedef struct sc_card {
 	int cla;
 	size_t max_send_size; /* Max Lc supported by the card */
 	size_t max_recv_size; /* Max Le supported by the card */
+	int use_ext_le; /* Read with extended Le beyond max_recv_size, see card.c */
+	struct sc_apdu_stats apdu_stats;
 
 	struct sc_app_info *app[SC_MAX_CARD_APPS];
 	int app_count;
@@ -436,6 +482,11 @@ typedef struct sc_card {
 	int algorithm_count;
 
 	int lock_count;
+	/* Times the reader lock was taken; while it stays the same,
+	 * no one else has used the card */
+	unsigned long lock_serial;
+	/* Reader transaction kept open after sc_unlock(), see linger.c */
+	struct sc_linger *linger;
 
 	struct sc_card_driver *driver;
 	struct sc_card_operations *ops;
@@ -444,6 +495,8 @@ typedef struct sc_card {
 	int max_pin_len;
 
 	struct sc_card_cache cache;
+	struct sc_select_cache select_cache;
+	struct sc_pin_state pin_state[SC_MAX_PIN_STATES];
 
 	sc_serial_number_t serialnr;
 
@@ -614,6 +667,14 @@ typedef struct sc_context {
 
 	struct sc_card_driver *card_drivers[SC_MAX_CARD_DRIVERS];
 	struct sc_card_driver *forced_driver;
+	int use_probe_cache;
+	int skip_redundant_select;
+	unsigned int transaction_linger;	/* milliseconds, see linger.c */
+	/* ATR tables compiled for matching, see card.c */
+	struct sc_atr_index *atr_index;
+	/* parsed pkcs15init profile files, see pkcs15init/profile.c */
+	void *profile_cache;
+	void (*free_profile_cache)(void *);
 
 	sc_thread_context_t	*thread_ctx;
 	void *mutex;
@@ -792,7 +853,7 @@ int sc_detect_card_presence(sc_reader_t *reader);
 /**
  * Waits for an event on readers. Note: only the event is detected,
  * there is no update of any card or other info.
- * NOTE: Only PC/SC backend implements this.
+ * NOTE: Only the PC/SC and virtual backends implement this.
  * @param ctx  pointer to a Context structure
  * @param event_mask The types of events to wait for; this should
  *   be ORed from one of the following
@@ -989,6 +1050,76 @@ int sc_compute_signature(sc_card_t *card, const u8 * data,
 			 size_t data_len, u8 * out, size_t outlen);
 int sc_verify(sc_card_t *card, unsigned int type, int ref, const u8 *buf,
 	      size_t buflen, int *tries_left);
+
+/********************************************************************/
+/*              Asynchronous signing                                */
+/********************************************************************/
+
+typedef struct sc_job_queue sc_job_queue_t;
+typedef struct sc_job sc_job_t;
+
+/**
+ * Called in a worker thread when a job has finished. The job is
+ * freed when the callback returns.
+ */
+typedef void (*sc_job_callback_t)(sc_job_t *job, void *arg);
+
+/**
+ * Creates a queue of jobs that run in worker threads. Each card runs
+ * one job at a time, in submission order; different cards run in
+ * parallel. The context must have been created with a thread
+ * context, which sc_lock() needs to keep the workers and other users
+ * of a card apart.
+ * @param  ctx      OpenSC context
+ * @param  threads  number of worker threads
+ * @param  queue_out  the new queue
+ * @return SC_SUCCESS on success, SC_ERROR_NOT_SUPPORTED without threads
+ *         or without a thread context
+ */
+int sc_job_queue_create(sc_context_t *ctx, unsigned int threads,
+			sc_job_queue_t **queue_out);
+/**
+ * Waits for all submitted jobs to finish and frees the queue and the
+ * worker threads. Jobs returned to the caller stay valid and must
+ * still be released with sc_job_free().
+ */
+void sc_job_queue_destroy(sc_job_queue_t *queue);
+/**
+ * Returns a file descriptor that is readable while completed jobs
+ * are waiting for sc_job_queue_get_completed(). Do not read from it.
+ */
+int sc_job_queue_get_fd(sc_job_queue_t *queue);
+/**
+ * Returns the next completed job without a callback, or NULL
+ */
+sc_job_t *sc_job_queue_get_completed(sc_job_queue_t *queue);
+
+/**
+ * Submits sc_set_security_env() and sc_compute_signature() as one
+ * job. The data is copied. With a callback, the job belongs to the
+ * queue and *job_out is set to NULL; otherwise the job is returned
+ * in *job_out and must be released with sc_job_free().
+ * @return SC_SUCCESS if the job was queued, or an error code
+ */
+int sc_compute_signature_async(sc_job_queue_t *queue, sc_card_t *card,
+		const sc_security_env_t *env, const u8 *data, size_t datalen,
+		size_t outlen, sc_job_callback_t callback, void *callback_arg,
+		sc_job_t **job_out);
+/**
+ * Waits for the job to finish and returns its result
+ */
+int sc_job_wait(sc_job_t *job);
+/**
+ * Returns the result of a finished job: the length of the signature,
+ * which is returned in *out and *outlen, or an error code.
+ * SC_ERROR_NOT_ALLOWED if the job has not finished yet.
+ */
+int sc_job_get_result(sc_job_t *job, const u8 **out, size_t *outlen);
+/**
+ * Releases a job. A job that has not finished yet is released when
+ * it finishes.
+ */
+void sc_job_free(sc_job_t *job);
 /**
  * Resets the security status of the card (i.e. withdraw all granted
  * access rights). Note: not all card operating systems support a logout
@@ -999,6 +1130,18 @@ int sc_verify(sc_card_t *card, unsigned int type, int ref, const u8 *buf,
  */
 int sc_logout(sc_card_t *card);
 int sc_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *, int *tries_left);
+/**
+ * Returns what is known about the verification state of a PIN: it is
+ * SC_PIN_STATE_LOGGED_IN after a successful VERIFY, and
+ * SC_PIN_STATE_LOGGED_OUT after a failed one, sc_logout() or a card
+ * reset. The state is tracked by sc_pin_cmd(), no APDU is sent.
+ * @param  card  sc_card_t object
+ * @param  type  PIN type (SC_AC_CHV etc.)
+ * @param  reference  PIN reference
+ * @return SC_PIN_STATE_UNKNOWN, SC_PIN_STATE_LOGGED_OUT or
+ *         SC_PIN_STATE_LOGGED_IN
+ */
+int sc_pin_state(sc_card_t *card, unsigned int type, int reference);
 int sc_change_reference_data(sc_card_t *card, unsigned int type,
 			     int ref, const u8 *old, size_t oldlen,
 			     const u8 *newref, size_t newlen,
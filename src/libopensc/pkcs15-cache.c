@@ -30,6 +30,7 @@
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#include <ctype.h>
 
 #include "internal.h"
 #include "pkcs15.h"
@@ -163,3 +164,406 @@ int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 	}
         return 0;
 }
+
+/*
+ * Structure snapshot
+ *
+ * The snapshot keeps the contents of EF(ODF), EF(TokenInfo) and of
+ * every DF, certificate and public key file read while the card was
+ * bound in a single file per card and application.  On the next bind it
+ * is loaded with one read and used as long as EF(ODF) and EF(TokenInfo)
+ * on the card are still identical to the copies stored in the snapshot;
+ * any update made through pkcs15init changes lastUpdate and so
+ * invalidates it.
+ *
+ * Only cards whose EF(TokenInfo) carries a lastUpdate get a snapshot:
+ * without it nothing tells that another host or tool changed a
+ * certificate or key file behind the DFs.
+ *
+ * File layout (all integers big endian):
+ *   "P15S" version(1) tokeninfo_len(4) tokeninfo odf_len(4) odf
+ *   { type(1) path_len(1) path index(4) count(4) data_len(4) data }*
+ */
+#define SC_PKCS15_SNAPSHOT_MAGIC	"P15S"
+#define SC_PKCS15_SNAPSHOT_VERSION	2
+
+struct sc_pkcs15_snapshot_file {
+	struct sc_path path;
+	u8 *data;
+	size_t len;
+	struct sc_pkcs15_snapshot_file *next;
+};
+
+struct sc_pkcs15_snapshot {
+	u8 *tokeninfo;
+	size_t tokeninfo_len;
+	u8 *odf;
+	size_t odf_len;
+	struct sc_pkcs15_snapshot_file *files;
+	int dirty;
+};
+
+static int generate_snapshot_filename(struct sc_pkcs15_card *p15card,
+				      char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	char name[SC_MAX_SERIALNR*2 + SC_MAX_PATH_SIZE*2 + 2];
+	const char *serial;
+	const sc_path_t *app_path;
+	size_t i, n = 0;
+	int r;
+
+	if (p15card->tokeninfo == NULL || p15card->file_app == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	serial = p15card->tokeninfo->serial_number;
+	app_path = &p15card->file_app->path;
+	if (serial == NULL || *serial == '\0')
+		return SC_ERROR_INVALID_ARGUMENTS;
+	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+
+	/* The serial number comes from the card; keep only characters
+	 * that are safe in a file name */
+	for (i = 0; serial[i] && n < SC_MAX_SERIALNR*2; i++)
+		name[n++] = isalnum((unsigned char) serial[i]) ? serial[i] : '_';
+	name[n++] = '_';
+	for (i = 0; i < app_path->len; i++, n += 2)
+		sprintf(name + n, "%02X", app_path->value[i]);
+	name[n] = '\0';
+
+	r = snprintf(buf, bufsize, "%s/%s.snapshot", dir, name);
+	if (r < 0 || (size_t) r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static void put_u32(u8 *p, size_t v)
+{
+	p[0] = (v >> 24) & 0xFF;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+static size_t get_u32(const u8 *p)
+{
+	return ((size_t) p[0] << 24) | ((size_t) p[1] << 16) | ((size_t) p[2] << 8) | p[3];
+}
+
+static int snapshot_path_equal(const sc_path_t *a, const sc_path_t *b)
+{
+	return a->type == b->type && a->len == b->len
+		&& a->index == b->index && a->count == b->count
+		&& a->aid.len == b->aid.len
+		&& memcmp(a->value, b->value, a->len) == 0;
+}
+
+static struct sc_pkcs15_snapshot_file *
+snapshot_find_file(struct sc_pkcs15_snapshot *snap, const sc_path_t *path)
+{
+	struct sc_pkcs15_snapshot_file *f;
+
+	for (f = snap->files; f != NULL; f = f->next)
+		if (snapshot_path_equal(&f->path, path))
+			return f;
+	return NULL;
+}
+
+static int snapshot_append_file(struct sc_pkcs15_snapshot *snap,
+				const sc_path_t *path, const u8 *data, size_t len)
+{
+	struct sc_pkcs15_snapshot_file *f, **tail;
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	f->data = malloc(len ? len : 1);
+	if (f->data == NULL) {
+		free(f);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	memcpy(f->data, data, len);
+	f->len = len;
+	f->path = *path;
+
+	for (tail = &snap->files; *tail != NULL; tail = &(*tail)->next)
+		;
+	*tail = f;
+	return SC_SUCCESS;
+}
+
+static void snapshot_free(struct sc_pkcs15_snapshot *snap)
+{
+	while (snap->files) {
+		struct sc_pkcs15_snapshot_file *f = snap->files;
+
+		snap->files = f->next;
+		free(f->data);
+		free(f);
+	}
+	if (snap->tokeninfo)
+		free(snap->tokeninfo);
+	if (snap->odf)
+		free(snap->odf);
+	free(snap);
+}
+
+/* Parse the snapshot image; returns 0 if it is usable for this card */
+static int snapshot_parse(struct sc_pkcs15_snapshot *snap,
+			  const u8 *p, size_t size)
+{
+	const u8 *end = p + size;
+	sc_path_t path;
+	size_t len;
+	int r;
+
+	if (size < 9 || memcmp(p, SC_PKCS15_SNAPSHOT_MAGIC, 4) != 0
+			|| p[4] != SC_PKCS15_SNAPSHOT_VERSION)
+		return SC_ERROR_INVALID_DATA;
+	len = get_u32(p + 5);
+	p += 9;
+	if ((size_t) (end - p) < len)
+		return SC_ERROR_INVALID_DATA;
+	if (len != snap->tokeninfo_len || memcmp(p, snap->tokeninfo, len) != 0)
+		return SC_ERROR_OBJECT_NOT_VALID;
+	p += len;
+	if (end - p < 4)
+		return SC_ERROR_INVALID_DATA;
+	len = get_u32(p);
+	p += 4;
+	if ((size_t) (end - p) < len)
+		return SC_ERROR_INVALID_DATA;
+	if (len != snap->odf_len || memcmp(p, snap->odf, len) != 0)
+		return SC_ERROR_OBJECT_NOT_VALID;
+	p += len;
+
+	while (p < end) {
+		if (end - p < 2 || p[1] > SC_MAX_PATH_SIZE
+				|| (size_t) (end - p) < 2 + (size_t) p[1] + 12)
+			return SC_ERROR_INVALID_DATA;
+		memset(&path, 0, sizeof(path));
+		path.type = p[0];
+		path.len = p[1];
+		p += 2;
+		memcpy(path.value, p, path.len);
+		p += path.len;
+		path.index = (int) get_u32(p);
+		path.count = (int) (unsigned int) get_u32(p + 4);
+		len = get_u32(p + 8);
+		p += 12;
+		if ((size_t) (end - p) < len)
+			return SC_ERROR_INVALID_DATA;
+		r = snapshot_append_file(snap, &path, p, len);
+		if (r)
+			return r;
+		p += len;
+	}
+	return SC_SUCCESS;
+}
+
+/*
+ * Attach a snapshot to a freshly bound card.  The EF(ODF) and
+ * EF(TokenInfo) bytes just read from the card serve as the freshness
+ * check: a snapshot written for another state of the card is discarded
+ * and a new one is collected instead.
+ */
+int sc_pkcs15_snapshot_load(struct sc_pkcs15_card *p15card,
+			    const u8 *odf, size_t odf_len,
+			    const u8 *tokeninfo, size_t tokeninfo_len)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_snapshot *snap;
+	char fname[PATH_MAX];
+	struct stat stbuf;
+	u8 *data = NULL;
+	FILE *f;
+	int r;
+
+	sc_pkcs15_snapshot_free(p15card);
+
+	if (odf == NULL || p15card->tokeninfo == NULL
+			|| p15card->tokeninfo->last_update == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+	r = generate_snapshot_filename(p15card, fname, sizeof(fname));
+	if (r)
+		return r;
+
+	snap = calloc(1, sizeof(*snap));
+	if (snap == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	snap->tokeninfo = malloc(tokeninfo_len);
+	snap->odf = malloc(odf_len ? odf_len : 1);
+	if (snap->tokeninfo == NULL || snap->odf == NULL) {
+		snapshot_free(snap);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	memcpy(snap->tokeninfo, tokeninfo, tokeninfo_len);
+	snap->tokeninfo_len = tokeninfo_len;
+	memcpy(snap->odf, odf, odf_len);
+	snap->odf_len = odf_len;
+	p15card->snapshot = snap;
+
+	if (stat(fname, &stbuf) != 0 || stbuf.st_size <= 0)
+		return SC_SUCCESS;
+
+	data = malloc((size_t) stbuf.st_size);
+	if (data == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	f = fopen(fname, "rb");
+	if (f == NULL) {
+		free(data);
+		return SC_SUCCESS;
+	}
+	r = fread(data, 1, (size_t) stbuf.st_size, f) == (size_t) stbuf.st_size
+		? SC_SUCCESS : SC_ERROR_FILE_NOT_FOUND;
+	fclose(f);
+
+	if (r == SC_SUCCESS)
+		r = snapshot_parse(snap, data, (size_t) stbuf.st_size);
+	free(data);
+
+	if (r != SC_SUCCESS) {
+		sc_log(ctx, "structure snapshot '%s' not used: %s", fname, sc_strerror(r));
+		while (snap->files) {
+			struct sc_pkcs15_snapshot_file *file = snap->files;
+
+			snap->files = file->next;
+			free(file->data);
+			free(file);
+		}
+		snap->dirty = 1;
+	}
+	else {
+		sc_log(ctx, "structure snapshot '%s' loaded", fname);
+	}
+	return SC_SUCCESS;
+}
+
+int sc_pkcs15_snapshot_read_file(struct sc_pkcs15_card *p15card,
+				 const sc_path_t *path,
+				 u8 **buf, size_t *bufsize)
+{
+	struct sc_pkcs15_snapshot_file *f;
+	u8 *data;
+
+	if (p15card->snapshot == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	f = snapshot_find_file(p15card->snapshot, path);
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	data = malloc(f->len ? f->len : 1);
+	if (data == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(data, f->data, f->len);
+	*buf = data;
+	*bufsize = f->len;
+	return SC_SUCCESS;
+}
+
+/*
+ * Record the contents of a public structure file (DF, certificate,
+ * public key).  Never call this for data that requires authentication
+ * to be read.
+ */
+int sc_pkcs15_snapshot_add_file(struct sc_pkcs15_card *p15card,
+				const sc_path_t *path,
+				const u8 *buf, size_t bufsize)
+{
+	struct sc_pkcs15_snapshot *snap = p15card->snapshot;
+	int r;
+
+	/* Paths qualified by an AID are not stored */
+	if (snap == NULL || path->len == 0 || path->len > SC_MAX_PATH_SIZE
+			|| path->aid.len)
+		return SC_SUCCESS;
+	if (snapshot_find_file(snap, path) != NULL)
+		return SC_SUCCESS;
+
+	r = snapshot_append_file(snap, path, buf, bufsize);
+	if (r == SC_SUCCESS)
+		snap->dirty = 1;
+	return r;
+}
+
+int sc_pkcs15_snapshot_save(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_snapshot *snap = p15card->snapshot;
+	struct sc_pkcs15_snapshot_file *f;
+	char fname[PATH_MAX], tmpname[PATH_MAX + 8];
+	u8 hdr[9], rec[2 + SC_MAX_PATH_SIZE + 12];
+	FILE *fp;
+	int r, ok;
+
+	if (snap == NULL || !snap->dirty)
+		return SC_SUCCESS;
+
+	r = generate_snapshot_filename(p15card, fname, sizeof(fname));
+	if (r)
+		return r;
+
+	fp = _sc_open_cache_tmpfile(p15card->card->ctx, fname, tmpname, sizeof(tmpname));
+	if (fp == NULL)
+		return SC_SUCCESS;
+
+	memcpy(hdr, SC_PKCS15_SNAPSHOT_MAGIC, 4);
+	hdr[4] = SC_PKCS15_SNAPSHOT_VERSION;
+	put_u32(hdr + 5, snap->tokeninfo_len);
+	ok = fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr)
+		&& fwrite(snap->tokeninfo, 1, snap->tokeninfo_len, fp) == snap->tokeninfo_len;
+	put_u32(hdr, snap->odf_len);
+	ok = ok && fwrite(hdr, 1, 4, fp) == 4
+		&& fwrite(snap->odf, 1, snap->odf_len, fp) == snap->odf_len;
+
+	for (f = snap->files; ok && f != NULL; f = f->next) {
+		size_t n = 0;
+
+		rec[n++] = (u8) f->path.type;
+		rec[n++] = (u8) f->path.len;
+		memcpy(rec + n, f->path.value, f->path.len);
+		n += f->path.len;
+		put_u32(rec + n, (size_t) f->path.index);
+		put_u32(rec + n + 4, (size_t) (unsigned int) f->path.count);
+		put_u32(rec + n + 8, f->len);
+		n += 12;
+		ok = fwrite(rec, 1, n, fp) == n
+			&& fwrite(f->data, 1, f->len, fp) == f->len;
+	}
+	if (fclose(fp) != 0)
+		ok = 0;
+
+	/* Replace the old snapshot in one step, so a concurrent reader
+	 * never sees a half written file */
+#ifdef _WIN32
+	if (ok)
+		unlink(fname);
+#endif
+	if (!ok || rename(tmpname, fname) != 0) {
+		sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, "failed to write structure snapshot '%s'", fname);
+		unlink(tmpname);
+		return SC_ERROR_INTERNAL;
+	}
+	snap->dirty = 0;
+	return SC_SUCCESS;
+}
+
+/* Drop the snapshot of a card whose structure is being modified. The
+ * file goes even if this process did not load it, so that no later
+ * bind serves the old structure */
+void sc_pkcs15_snapshot_invalidate(struct sc_pkcs15_card *p15card)
+{
+	char fname[PATH_MAX];
+
+	if (generate_snapshot_filename(p15card, fname, sizeof(fname)) == SC_SUCCESS)
+		unlink(fname);
+	sc_pkcs15_snapshot_free(p15card);
+}
+
+void sc_pkcs15_snapshot_free(struct sc_pkcs15_card *p15card)
+{
+	if (p15card->snapshot == NULL)
+		return;
+	snapshot_free(p15card->snapshot);
+	p15card->snapshot = NULL;
+}
@@ -134,6 +134,19 @@ sc_pkcs15_pubkey_from_cert(struct sc_context *ctx,
 	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, rv);
 }
 
+/* Only certificates of a public object of the card go to the structure
+ * snapshot; a private one is read after login */
+static int cert_is_public(struct sc_pkcs15_card *p15card,
+			  const struct sc_pkcs15_cert_info *info)
+{
+	struct sc_pkcs15_object *obj;
+
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		if (obj->data == info)
+			return !(obj->flags & SC_PKCS15_CO_FLAG_PRIVATE);
+	return 0;
+}
+
 int sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card,
 			       const struct sc_pkcs15_cert_info *info,
 			       struct sc_pkcs15_cert **cert_out)
@@ -150,6 +163,8 @@ int sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card,
 		r = sc_pkcs15_read_file(p15card, &info->path, &data, &len);
 		if (r)
 			return r;
+		if (cert_is_public(p15card, info))
+			sc_pkcs15_snapshot_add_file(p15card, &info->path, data, len);
 	} else {
 		sc_pkcs15_der_t copy;
 
@@ -649,6 +649,8 @@ sc_pkcs15_read_pubkey(struct sc_pkcs15_card *p15card,
         else   {
 		r = sc_pkcs15_read_file(p15card, &info->path, &data, &len);
 		SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, r, "Failed to read public key file.");
+		if (!(obj->flags & SC_PKCS15_CO_FLAG_PRIVATE))
+			sc_pkcs15_snapshot_add_file(p15card, &info->path, data, len);
 	}
 
 	pubkey = calloc(1, sizeof(struct sc_pkcs15_pubkey));
@@ -67,7 +67,30 @@ static int select_key_file(struct sc_pkcs15_card *p15card,
 
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
- 
+
+/* If the card is known to have dropped the verification of the key's
+ * PIN (reset by another application, logout), verify the cached PIN
+ * before using the key instead of after the operation has failed */
+static void revalidate_lost_pin(struct sc_pkcs15_card *p15card,
+				const struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_object *pin_obj;
+	struct sc_pkcs15_auth_info *auth_info;
+
+	if (!p15card->opts.use_pin_cache || obj->auth_id.len == 0)
+		return;
+	if (sc_pkcs15_find_pin_by_auth_id(p15card, &obj->auth_id, &pin_obj) != SC_SUCCESS)
+		return;
+	auth_info = (struct sc_pkcs15_auth_info *) pin_obj->data;
+	if (sc_pin_state(p15card->card, auth_info->auth_method,
+			auth_info->attrs.pin.reference) != SC_PIN_STATE_LOGGED_OUT)
+		return;
+
+	sc_log(p15card->card->ctx, "PIN %s is not verified, revalidating it first",
+		sc_pkcs15_print_id(&obj->auth_id));
+	sc_pkcs15_pincache_revalidate(p15card, obj);
+}
+
 int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
 		       const struct sc_pkcs15_object *obj,
 		       unsigned long flags,
@@ -134,6 +157,7 @@ int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
 
 	r = sc_lock(p15card->card);
 	LOG_TEST_RET(ctx, r, "sc_lock() failed");
+	revalidate_lost_pin(p15card, obj);
 
 	if (prkey->path.len != 0)
 	{
@@ -173,14 +197,26 @@ int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
 #define USAGE_ANY_DECIPHER      (SC_PKCS15_PRKEY_USAGE_DECRYPT|\
                                  SC_PKCS15_PRKEY_USAGE_UNWRAP)
 
+int sc_pkcs15_sign_env_current(struct sc_pkcs15_card *p15card,
+				const struct sc_pkcs15_object *key)
+{
+	sc_card_t *card = p15card->card;
+
+	return p15card->opts.reuse_security_env
+		&& key != NULL && p15card->last_sign.key == key
+		&& card->lock_count > 0
+		&& card->lock_serial == p15card->last_sign.lock_serial
+		&& card->apdu_stats.transmitted == p15card->last_sign.transmitted;
+}
+
 int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 				const struct sc_pkcs15_object *obj,
 				unsigned long flags, const u8 *in, size_t inlen,
 				u8 *out, size_t outlen)
 {
 	sc_context_t *ctx = p15card->card->ctx;
-	int r;
-	sc_security_env_t senv;
+	int r, reuse;
+	sc_security_env_t senv, saved_senv;
 	sc_algorithm_info_t *alg_info;
 	const struct sc_pkcs15_prkey_info *prkey = (const struct sc_pkcs15_prkey_info *) obj->data;
 	u8 buf[512], *tmp;
@@ -355,26 +391,48 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 
 	r = sc_lock(p15card->card);
 	LOG_TEST_RET(ctx, r, "sc_lock() failed");
+	revalidate_lost_pin(p15card, obj);
+
+	/* select_key_file() adds the file reference */
+	saved_senv = senv;
+	reuse = sc_pkcs15_sign_env_current(p15card, obj)
+		&& !memcmp(&p15card->last_sign.env, &saved_senv, sizeof(saved_senv));
+	p15card->last_sign.key = NULL;
+	if (reuse) {
+		sc_log(ctx, "security environment of the last signature still set");
+		r = sc_compute_signature(p15card->card, tmp, inlen, out, outlen);
+		if (r < 0) {
+			sc_log(ctx, "signature failed, setting up the security environment again");
+			reuse = 0;
+		}
+	}
+	if (!reuse) {
+		if (prkey->path.len != 0) {
+			r = select_key_file(p15card, prkey, &senv);
+			if (r < 0) {
+				sc_unlock(p15card->card);
+				LOG_TEST_RET(ctx, r,"Unable to select private key file");
+			}
+		}
 
-	if (prkey->path.len != 0) {
-		r = select_key_file(p15card, prkey, &senv);
+		r = sc_set_security_env(p15card->card, &senv, 0);
 		if (r < 0) {
 			sc_unlock(p15card->card);
-			LOG_TEST_RET(ctx, r,"Unable to select private key file");
+			LOG_TEST_RET(ctx, r, "sc_set_security_env() failed");
 		}
-	}
 
-	r = sc_set_security_env(p15card->card, &senv, 0);
-	if (r < 0) {
-		sc_unlock(p15card->card);
-		LOG_TEST_RET(ctx, r, "sc_set_security_env() failed");
+		r = sc_compute_signature(p15card->card, tmp, inlen, out, outlen);
 	}
-
-	r = sc_compute_signature(p15card->card, tmp, inlen, out, outlen);
 	if (r == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED) {
 		if (sc_pkcs15_pincache_revalidate(p15card, obj) == SC_SUCCESS)
 			r = sc_compute_signature(p15card->card, tmp, inlen, out, outlen);
 	}
+	if (r > 0) {
+		p15card->last_sign.key = obj;
+		p15card->last_sign.env = saved_senv;
+		p15card->last_sign.lock_serial = p15card->card->lock_serial;
+		p15card->last_sign.transmitted = p15card->card->apdu_stats.transmitted;
+	}
 	sc_mem_clear(buf, sizeof(buf));
 	sc_unlock(p15card->card);
 	LOG_TEST_RET(ctx, r, "sc_compute_signature() failed");
@@ -114,13 +114,43 @@ int sc_pkcs15_is_emulation_only(sc_card_t *card)
 	}
 }
 
+/* Index of the builtin emulator remembered for this ATR, if it is
+ * enabled by the configuration */
+static int
+cached_builtin_emulator(sc_pkcs15_card_t *p15card, scconf_block *conf_block)
+{
+	sc_context_t	*ctx = p15card->card->ctx;
+	const scconf_list *item;
+	char		name[64];
+	int		i;
+
+	if (_sc_probe_cache_get(ctx, &p15card->card->atr, "emulator", name, sizeof(name)) != SC_SUCCESS)
+		return -1;
+	if (conf_block) {
+		if (!scconf_get_bool(conf_block, "enable_builtin_emulation", 1))
+			return -1;
+		item = scconf_find_list(conf_block, "builtin_emulators");
+		if (item) {
+			while (item && strcmp(item->data, name))
+				item = item->next;
+			if (!item)
+				return -1;
+		}
+	}
+	for (i = 0; builtin_emulators[i].name; i++)
+		if (!strcmp(builtin_emulators[i].name, name))
+			return i;
+	return -1;
+}
+
 int
 sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 {
 	sc_context_t		*ctx = p15card->card->ctx;
 	scconf_block		*conf_block, **blocks, *blk;
 	sc_pkcs15emu_opt_t	opts;
-	int			i, r = SC_ERROR_WRONG_CARD;
+	const char		*hit = NULL;
+	int			i, cached = -1, r = SC_ERROR_WRONG_CARD;
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
 	memset(&opts, 0, sizeof(opts));
@@ -128,15 +158,32 @@ sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 
 	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
 
+	if (ctx->use_probe_cache) {
+		cached = cached_builtin_emulator(p15card, conf_block);
+		if (cached >= 0) {
+			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying cached emulator %s\n",
+					builtin_emulators[cached].name);
+			r = builtin_emulators[cached].handler(p15card, &opts);
+			if (r == SC_SUCCESS) {
+				hit = builtin_emulators[cached].name;
+				goto out;
+			}
+		}
+	}
+
 	if (!conf_block) {
 		/* no conf file found => try bultin drivers  */
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "no conf file (or section), trying all builtin emulators\n");
 		for (i = 0; builtin_emulators[i].name; i++) {
 			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying %s\n", builtin_emulators[i].name);
+			if (i == cached)
+				continue;
 			r = builtin_emulators[i].handler(p15card, &opts);
-			if (r == SC_SUCCESS)
+			if (r == SC_SUCCESS) {
 				/* we got a hit */
+				hit = builtin_emulators[i].name;
 				goto out;
+			}
 		}
 	} else {
 		/* we have a conf file => let's use it */
@@ -154,11 +201,13 @@ sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 
 				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying %s\n", name);
 				for (i = 0; builtin_emulators[i].name; i++)
-					if (!strcmp(builtin_emulators[i].name, name)) {
+					if (!strcmp(builtin_emulators[i].name, name) && i != cached) {
 						r = builtin_emulators[i].handler(p15card, &opts);
-						if (r == SC_SUCCESS)
+						if (r == SC_SUCCESS) {
 							/* we got a hit */
+							hit = name;
 							goto out;
+						}
 					}
 			}	
 		}
@@ -190,9 +239,14 @@ sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 	}
 		
 	/* Total failure */
+	if (cached >= 0)
+		_sc_probe_cache_set(ctx, &p15card->card->atr, "emulator", NULL);
 	return SC_ERROR_WRONG_CARD;
 
-out:	if (r == SC_SUCCESS) {
+out:	if (r == SC_SUCCESS && ctx->use_probe_cache
+	 && (cached < 0 || hit != builtin_emulators[cached].name))
+		_sc_probe_cache_set(ctx, &p15card->card->atr, "emulator", hit);
+	if (r == SC_SUCCESS) {
 		p15card->magic  = SC_PKCS15_CARD_MAGIC;
 		p15card->flags |= SC_PKCS15_CARD_FLAG_EMULATED;
 	} else if (r != SC_ERROR_WRONG_CARD) {
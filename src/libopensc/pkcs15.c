@@ -553,6 +553,7 @@ void sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 	if (p15card->ops.clear)
 		p15card->ops.clear(p15card);
 
+	sc_pkcs15_snapshot_free(p15card);
 	while (p15card->obj_list)   {
 		struct sc_pkcs15_object *obj = p15card->obj_list;
 
@@ -607,6 +608,7 @@ void sc_pkcs15_card_clear(sc_pkcs15_card_t *p15card)
 	if (p15card->ops.clear)
 		p15card->ops.clear(p15card);
 
+	sc_pkcs15_snapshot_free(p15card);
 	p15card->flags = 0;
 	p15card->tokeninfo->version = 0;
 	p15card->tokeninfo->flags   = 0;
@@ -718,8 +720,8 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 	sc_pkcs15_tokeninfo_t tokeninfo;
 	sc_pkcs15_df_t *df;
 	const sc_app_info_t *info = NULL;
-	unsigned char *buf = NULL;
-	size_t len;
+	unsigned char *buf = NULL, *odf = NULL;
+	size_t len, odf_len = 0;
 	int    err, ok = 0;
 
 	LOG_FUNC_CALLED(ctx);
@@ -819,7 +821,9 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		sc_log(ctx, "Unable to parse ODF");
 		goto end;
 	}
-	free(buf);
+	/* kept to validate the structure snapshot */
+	odf = buf;
+	odf_len = len;
 	buf = NULL;
 
 	sc_log(ctx, "The following DFs were found:");
@@ -850,8 +854,10 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		goto end;
 	}
 	buf = malloc(len);
-	if(buf == NULL)
-		return SC_ERROR_OUT_OF_MEMORY;
+	if(buf == NULL) {
+		err = SC_ERROR_OUT_OF_MEMORY;
+		goto end;
+	}
 
 	err = sc_read_binary(card, 0, buf, len, 0);
 	if (err < 0)
@@ -861,8 +867,9 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		goto end;
 	}
 
+	len = err;
 	memset(&tokeninfo, 0, sizeof(tokeninfo));
-	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, (size_t)err);
+	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, len);
 	if (err != SC_SUCCESS)
 		goto end;
 
@@ -879,10 +886,20 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		sc_log(ctx, "p15card->tokeninfo->serial_number %s", p15card->tokeninfo->serial_number);
 	}
 
+	/* EF(ODF) and EF(TokenInfo) as just read from the card validate
+	 * the snapshot */
+	if (p15card->opts.use_structure_cache) {
+		err = sc_pkcs15_snapshot_load(p15card, odf, odf_len, buf, len);
+		if (err != SC_SUCCESS)
+			sc_log(ctx, "structure snapshot disabled: %s", sc_strerror(err));
+	}
+
 	ok = 1;
 end:
 	if(buf != NULL)
 		free(buf);
+	if (odf != NULL)
+		free(odf);
 	if (!ok) {
 		sc_pkcs15_card_clear(p15card);
 		return err;
@@ -910,6 +927,8 @@ int sc_pkcs15_bind(sc_card_t *card, struct sc_aid *aid, struct sc_pkcs15_card **
 	p15card->opts.use_file_cache = 0;
 	p15card->opts.use_pin_cache = 1;
 	p15card->opts.pin_cache_counter = 10;
+	p15card->opts.use_structure_cache = 0;
+	p15card->opts.reuse_security_env = 0;
 
 	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
 
@@ -917,9 +936,13 @@ int sc_pkcs15_bind(sc_card_t *card, struct sc_aid *aid, struct sc_pkcs15_card **
 		p15card->opts.use_file_cache = scconf_get_bool(conf_block, "use_file_caching", p15card->opts.use_file_cache);
 		p15card->opts.use_pin_cache = scconf_get_bool(conf_block, "use_pin_caching", p15card->opts.use_pin_cache);
 		p15card->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", p15card->opts.pin_cache_counter);
+		p15card->opts.use_structure_cache = scconf_get_bool(conf_block, "use_structure_caching", p15card->opts.use_structure_cache);
+		p15card->opts.reuse_security_env = scconf_get_bool(conf_block, "reuse_security_env", p15card->opts.reuse_security_env);
 	}
-	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d",
-	         p15card->opts.use_file_cache, p15card->opts.use_pin_cache, p15card->opts.pin_cache_counter);
+	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d use_structure_cache=%d "
+		 "reuse_security_env=%d",
+	         p15card->opts.use_file_cache, p15card->opts.use_pin_cache, p15card->opts.pin_cache_counter,
+	         p15card->opts.use_structure_cache, p15card->opts.reuse_security_env);
 
 	r = sc_lock(card);
 	if (r) {
@@ -970,6 +993,7 @@ int sc_pkcs15_unbind(struct sc_pkcs15_card *p15card)
 	if (p15card->dll_handle)
 		sc_dlclose(p15card->dll_handle);
 	sc_pkcs15_pincache_clear(p15card);
+	sc_pkcs15_snapshot_save(p15card);
 	sc_pkcs15_card_free(p15card);
 	return 0;
 }
@@ -1525,6 +1549,8 @@ void sc_pkcs15_remove_df(struct sc_pkcs15_card *p15card,
 		obj->prev->next = obj->next;
 	if (obj->next != NULL)
 		obj->next->prev = obj->prev;
+	if (obj->image != NULL)
+		free(obj->image);
 	free(obj);
 }
 
@@ -1587,14 +1613,17 @@ int sc_pkcs15_encode_df(sc_context_t *ctx,
 	return 0;	
 }
 
+static int read_file(struct sc_pkcs15_card *, const sc_path_t *,
+			u8 **, size_t *, int *);
+
 int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 		       struct sc_pkcs15_df *df)
 {
 	sc_context_t *ctx = p15card->card->ctx;
 	u8 *buf;
 	const u8 *p;
-	size_t bufsize;
-	int r;
+	size_t bufsize, filesize;
+	int r, from_card = 0;
 	struct sc_pkcs15_object *obj = NULL;
 	int (* func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
 		     const u8 **nbuf, size_t *nbufsize) = NULL;
@@ -1633,8 +1662,10 @@ int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 		sc_log(ctx, "unknown DF type: %d", df->type);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 	}
-	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
+	r = read_file(p15card, &df->path, &buf, &bufsize, &from_card);
 	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
+	sc_pkcs15_snapshot_add_file(p15card, &df->path, buf, bufsize);
+	filesize = bufsize;
 
 	p = buf;
 	sc_log(ctx, "bufsize %i; first tag 0x%X", bufsize, *p);
@@ -1672,7 +1703,19 @@ int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 		r = 0;
 ret:
 	df->enumerated = 1;
-	free(buf);
+	/* Keep what was read for sc_pkcs15init_update_any_df(); a copy from
+	 * the snapshot or file cache may be stale and is no base for a
+	 * delta update */
+	if (df->image != NULL)
+		free(df->image);
+	df->image = NULL;
+	df->image_len = 0;
+	if (r == 0 && from_card && (df->path.count < 0 || df->path.index == 0)) {
+		df->image = buf;
+		df->image_len = filesize;
+	} else {
+		free(buf);
+	}
 	LOG_FUNC_RETURN(ctx, r);
 }
 
@@ -1849,9 +1892,14 @@ int sc_pkcs15_parse_unusedspace(const u8 * buf, size_t buflen, struct sc_pkcs15_
 	return 0;
 }
 
-int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
+/*
+ * Reads a file from the structure snapshot, the file cache or the card.
+ * *from_card is set if the content was read from the card with
+ * READ BINARY just now, and so is a byte image of the file.
+ */
+static int read_file(struct sc_pkcs15_card *p15card,
 			const sc_path_t *in_path,
-			u8 **buf, size_t *buflen)
+			u8 **buf, size_t *buflen, int *from_card)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	sc_file_t *file = NULL;
@@ -1864,8 +1912,9 @@ int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 	sc_log(ctx, "called; path=%s, index=%u, count=%d", sc_print_path(in_path), 
 			in_path->index, in_path->count);
 
-	r = -1; /* file state: not in cache */
-	if (p15card->opts.use_file_cache) {
+	*from_card = 0;
+	r = sc_pkcs15_snapshot_read_file(p15card, in_path, &data, &len);
+	if (r && p15card->opts.use_file_cache) {
 		r = sc_pkcs15_read_cached_file(p15card, in_path, &data, &len);
 	}
 	if (r) {
@@ -1934,6 +1983,7 @@ int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 			}
 			/* sc_read_binary may return less than requested */
 			len = r;
+			*from_card = 1;
 		}
 		sc_unlock(p15card->card);
 
@@ -1950,6 +2000,15 @@ fail_unlock:
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
+			const sc_path_t *in_path,
+			u8 **buf, size_t *buflen)
+{
+	int from_card;
+
+	return read_file(p15card, in_path, buf, buflen, &from_card);
+}
+
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
 			 const struct sc_pkcs15_id *id2)
 {
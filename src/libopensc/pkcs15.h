@@ -466,6 +466,13 @@ struct sc_pkcs15_df {
 	unsigned int type;
 	int enumerated;
 
+	/* File content from offset 0 as last read or written, used
+	 * to write back only what changed; NULL if not known */
+	u8 *image;
+	size_t image_len;
+	/* Changed, written by sc_pkcs15init_flush() */
+	int pending;
+
 	struct sc_pkcs15_df *next, *prev;
 };
 typedef struct sc_pkcs15_df sc_pkcs15_df_t;
@@ -526,8 +533,18 @@ typedef struct sc_pkcs15_card {
 		int use_file_cache;
 		int use_pin_cache;
 		int pin_cache_counter;
+		int use_structure_cache;
+		int reuse_security_env;
 	} opts;
 
+	/* Set up by the last signature, see sc_pkcs15_sign_env_current() */
+	struct sc_pkcs15_sign_env {
+		const struct sc_pkcs15_object *key;
+		sc_security_env_t env;
+		unsigned long lock_serial;
+		unsigned long transmitted;
+	} last_sign;
+
 
 	unsigned int magic;
 
@@ -535,6 +552,7 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_operations ops;
 
+	struct sc_pkcs15_snapshot *snapshot;	/* on-disk structure cache */
 } sc_pkcs15_card_t;
 
 /* flags suitable for sc_pkcs15_tokeninfo_t */
@@ -579,6 +597,22 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 				const struct sc_pkcs15_object *prkey_obj,
 				unsigned long alg_flags, const u8 *in,
 				size_t inlen, u8 *out, size_t outlen);
+/* Returns 1 if the card still has the security environment of the
+ * last signature, made with key: the card has stayed locked and
+ * nothing was sent to it since. Always 0 unless the
+ * reuse_security_env option is set. */
+int sc_pkcs15_sign_env_current(struct sc_pkcs15_card *p15card,
+				const struct sc_pkcs15_object *key);
+/* Queue sc_pkcs15_compute_signature() as a job, see
+ * sc_compute_signature_async(). p15card and prkey_obj must stay
+ * valid until the job has finished. */
+int sc_pkcs15_compute_signature_async(sc_job_queue_t *queue,
+				struct sc_pkcs15_card *p15card,
+				const struct sc_pkcs15_object *prkey_obj,
+				unsigned long alg_flags, const u8 *in,
+				size_t inlen, size_t outlen,
+				sc_job_callback_t callback, void *callback_arg,
+				sc_job_t **job_out);
 
 int sc_pkcs15_read_pubkey(struct sc_pkcs15_card *,
 			const struct sc_pkcs15_object *,
@@ -792,6 +826,20 @@ int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
 
+/* Structure snapshot functions */
+int sc_pkcs15_snapshot_load(struct sc_pkcs15_card *p15card,
+			    const u8 *odf, size_t odf_len,
+			    const u8 *tokeninfo, size_t tokeninfo_len);
+int sc_pkcs15_snapshot_read_file(struct sc_pkcs15_card *p15card,
+				 const struct sc_path *path,
+				 u8 **buf, size_t *bufsize);
+int sc_pkcs15_snapshot_add_file(struct sc_pkcs15_card *p15card,
+				const struct sc_path *path,
+				const u8 *buf, size_t bufsize);
+int sc_pkcs15_snapshot_save(struct sc_pkcs15_card *p15card);
+void sc_pkcs15_snapshot_invalidate(struct sc_pkcs15_card *p15card);
+void sc_pkcs15_snapshot_free(struct sc_pkcs15_card *p15card);
+
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
 			 const struct sc_pkcs15_id *id2);
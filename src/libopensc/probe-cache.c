@@ -0,0 +1,200 @@
+/*
+ * probe-cache.c: Remember which card driver and PKCS #15 emulator
+ * were found for an ATR
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <limits.h>
+#include <errno.h>
+
+#include "internal.h"
+
+/*
+ * One small text file per ATR is kept in the cache directory, e.g.
+ *
+ *   driver PIV-II
+ *   emulator PIV-II
+ *
+ * The entries are only hints: the caller still runs the driver's
+ * match_card()/init() (or the emulator) and probes everything else
+ * if that fails.
+ */
+#define PROBE_CACHE_MAX_ENTRIES	4
+#define PROBE_CACHE_MAX_LINE	128
+
+struct probe_cache_entry {
+	char key[PROBE_CACHE_MAX_LINE];
+	char value[PROBE_CACHE_MAX_LINE];
+};
+
+static int probe_cache_filename(sc_context_t *ctx, const struct sc_atr *atr,
+				char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	char hex[SC_MAX_ATR_SIZE*2 + 1];
+	size_t i;
+	int r;
+
+	if (atr->len == 0 || atr->len > SC_MAX_ATR_SIZE)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+	for (i = 0; i < atr->len; i++)
+		sprintf(hex + 2*i, "%02X", atr->value[i]);
+	r = snprintf(buf, bufsize, "%s/probe_%s", dir, hex);
+	if (r < 0 || (size_t) r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int probe_cache_read(const char *fname,
+			    struct probe_cache_entry *entries, int max)
+{
+	char line[2 * PROBE_CACHE_MAX_LINE];
+	FILE *f;
+	int n = 0;
+
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return 0;
+	while (n < max && fgets(line, sizeof(line), f) != NULL) {
+		char *sp, *end;
+
+		line[strcspn(line, "\r\n")] = '\0';
+		sp = strchr(line, ' ');
+		if (sp == NULL || sp == line)
+			continue;
+		*sp++ = '\0';
+		end = sp + strlen(sp);
+		if (strlen(line) >= PROBE_CACHE_MAX_LINE || end == sp
+				|| (size_t) (end - sp) >= PROBE_CACHE_MAX_LINE)
+			continue;
+		strcpy(entries[n].key, line);
+		strcpy(entries[n].value, sp);
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+int _sc_probe_cache_get(sc_context_t *ctx, const struct sc_atr *atr,
+			const char *key, char *value, size_t value_len)
+{
+	struct probe_cache_entry entries[PROBE_CACHE_MAX_ENTRIES];
+	char fname[PATH_MAX];
+	int i, n, r;
+
+	r = probe_cache_filename(ctx, atr, fname, sizeof(fname));
+	if (r)
+		return r;
+	n = probe_cache_read(fname, entries, PROBE_CACHE_MAX_ENTRIES);
+	for (i = 0; i < n; i++) {
+		if (strcmp(entries[i].key, key))
+			continue;
+		if (strlen(entries[i].value) >= value_len)
+			return SC_ERROR_BUFFER_TOO_SMALL;
+		strcpy(value, entries[i].value);
+		return SC_SUCCESS;
+	}
+	return SC_ERROR_OBJECT_NOT_FOUND;
+}
+
+static int probe_cache_update(sc_context_t *ctx, const struct sc_atr *atr,
+			const char *key, const char *value)
+{
+	struct probe_cache_entry entries[PROBE_CACHE_MAX_ENTRIES];
+	char fname[PATH_MAX], tmpname[PATH_MAX + 8];
+	FILE *f;
+	int i, n, r, found = 0, ok = 1;
+
+	if (strlen(key) >= PROBE_CACHE_MAX_LINE || strchr(key, ' ') != NULL
+			|| (value != NULL && (strlen(value) >= PROBE_CACHE_MAX_LINE
+				|| strpbrk(value, "\r\n") != NULL)))
+		return SC_ERROR_INVALID_ARGUMENTS;
+	r = probe_cache_filename(ctx, atr, fname, sizeof(fname));
+	if (r)
+		return r;
+
+	n = probe_cache_read(fname, entries, PROBE_CACHE_MAX_ENTRIES);
+	for (i = 0; i < n; i++) {
+		if (strcmp(entries[i].key, key))
+			continue;
+		if (value != NULL && !strcmp(entries[i].value, value))
+			return SC_SUCCESS;	/* nothing changed */
+		found = 1;
+		if (value != NULL) {
+			strcpy(entries[i].value, value);
+		} else {
+			entries[i] = entries[--n];
+		}
+		break;
+	}
+	if (!found) {
+		if (value == NULL)
+			return SC_SUCCESS;
+		if (n == PROBE_CACHE_MAX_ENTRIES)
+			return SC_ERROR_TOO_MANY_OBJECTS;
+		strcpy(entries[n].key, key);
+		strcpy(entries[n].value, value);
+		n++;
+	}
+
+	f = _sc_open_cache_tmpfile(ctx, fname, tmpname, sizeof(tmpname));
+	if (f == NULL)
+		return SC_SUCCESS;
+	for (i = 0; i < n; i++)
+		if (fprintf(f, "%s %s\n", entries[i].key, entries[i].value) < 0)
+			ok = 0;
+	if (fclose(f) != 0)
+		ok = 0;
+#ifdef _WIN32
+	if (ok)
+		unlink(fname);
+#endif
+	if (!ok || rename(tmpname, fname) != 0) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "failed to update probe cache '%s'", fname);
+		unlink(tmpname);
+		return SC_ERROR_INTERNAL;
+	}
+	return SC_SUCCESS;
+}
+
+/* Store (or with value == NULL, forget) the hint for key. Cards with
+ * the same ATR may be connected in several threads at once, and the
+ * file is read, changed and rewritten, so updates are serialized on the
+ * context mutex. Other processes are not kept out: each writes its own
+ * temporary file and renames it in place, so the file is always whole
+ * and the last writer wins. A hint lost that way is found again by the
+ * next full probe. */
+int _sc_probe_cache_set(sc_context_t *ctx, const struct sc_atr *atr,
+			const char *key, const char *value)
+{
+	int r;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	r = probe_cache_update(ctx, atr, key, value);
+	sc_mutex_unlock(ctx, ctx->mutex);
+	return r;
+}
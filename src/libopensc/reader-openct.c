@@ -44,7 +44,7 @@ static struct sc_reader_driver openct_reader_driver = {
 	"OpenCT reader",
 	"openct",
 	&openct_ops,
-	0, 0, NULL
+	0, 0, 0, NULL
 };
 
 /* private data structures */
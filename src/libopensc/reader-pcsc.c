@@ -89,6 +89,10 @@ struct pcsc_private_data {
 	DWORD get_tlv_properties;
 
 	int locked;
+
+	/* APDU buffers reused by every transmit, wiped after use */
+	u8 *sbuf, *rbuf;
+	size_t sbuf_len, rbuf_len;
 };
 
 static int pcsc_detect_card_presence(sc_reader_t *reader);
@@ -218,10 +222,49 @@ static int pcsc_internal_transmit(sc_reader_t *reader,
 	return SC_SUCCESS;
 }
 
+/* Make sure the reader's buffer can hold need bytes. Short APDUs fit
+ * in the first allocation; the first extended one grows it to the
+ * maximum extended APDU size, so it is not reallocated again. */
+static int pcsc_reserve_buffer(u8 **buf, size_t *buflen, size_t need)
+{
+	size_t	size;
+	u8	*p;
+
+	if (*buflen >= need)
+		return SC_SUCCESS;
+	size = SC_MAX_APDU_BUFFER_SIZE;
+	if (need > size)
+		size = need > SC_MAX_EXT_APDU_BUFFER_SIZE + 3 ? need : SC_MAX_EXT_APDU_BUFFER_SIZE + 3;
+	p = malloc(size);
+	if (p == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (*buf != NULL) {
+		sc_mem_clear(*buf, *buflen);
+		free(*buf);
+	}
+	*buf = p;
+	*buflen = size;
+	return SC_SUCCESS;
+}
+
+static void pcsc_free_buffers(struct pcsc_private_data *priv)
+{
+	if (priv->sbuf != NULL) {
+		sc_mem_clear(priv->sbuf, priv->sbuf_len);
+		free(priv->sbuf);
+	}
+	if (priv->rbuf != NULL) {
+		sc_mem_clear(priv->rbuf, priv->rbuf_len);
+		free(priv->rbuf);
+	}
+	priv->sbuf = priv->rbuf = NULL;
+	priv->sbuf_len = priv->rbuf_len = 0;
+}
+
 static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 {
-	size_t       ssize, rsize, rbuflen = 0;
-	u8           *sbuf = NULL, *rbuf = NULL;
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	size_t       ssize = 0, rsize;
 	int          r;
 
 	/* we always use a at least 258 byte size big return buffer
@@ -229,39 +272,42 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 	 * seems to require a larger than necessary return buffer).
 	 * The buffer for the returned data needs to be at least 2 bytes
 	 * larger than the expected data length to store SW1 and SW2. */
-	rsize = rbuflen = apdu->resplen <= 256 ? 258 : apdu->resplen + 2;
-	rbuf     = malloc(rbuflen);
-	if (rbuf == NULL) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto out;
-	}
+	rsize = apdu->resplen <= 256 ? 258 : apdu->resplen + 2;
+	r = pcsc_reserve_buffer(&priv->rbuf, &priv->rbuf_len, rsize);
+	if (r != SC_SUCCESS)
+		return r;
 	/* encode and log the APDU */
-	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, reader->active_protocol);
+	r = sc_apdu_write_octets(reader->ctx, apdu, reader->active_protocol,
+			priv->sbuf, priv->sbuf_len, &ssize);
+	if (r == SC_ERROR_BUFFER_TOO_SMALL) {
+		r = pcsc_reserve_buffer(&priv->sbuf, &priv->sbuf_len, ssize);
+		if (r != SC_SUCCESS)
+			return r;
+		r = sc_apdu_write_octets(reader->ctx, apdu, reader->active_protocol,
+				priv->sbuf, priv->sbuf_len, &ssize);
+	}
 	if (r != SC_SUCCESS)
 		goto out;
 	if (reader->name)
 		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "reader '%s'", reader->name);
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, priv->sbuf, ssize, 1);
 
-	r = pcsc_internal_transmit(reader, sbuf, ssize,
-				rbuf, &rsize, apdu->control);
+	r = pcsc_internal_transmit(reader, priv->sbuf, ssize,
+				priv->rbuf, &rsize, apdu->control);
 	if (r < 0) {
 		/* unable to transmit ... most likely a reader problem */
 		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "unable to transmit");
 		goto out;
 	}
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, priv->rbuf, rsize, 0);
 	/* set response */
-	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
+	r = sc_apdu_set_resp(reader->ctx, apdu, priv->rbuf, rsize);
 out:
-	if (sbuf != NULL) {
-		sc_mem_clear(sbuf, ssize);
-		free(sbuf);
-	}
-	if (rbuf != NULL) {
-		sc_mem_clear(rbuf, rbuflen);
-		free(rbuf);
-	}
+	/* only the part that was used can hold anything sensitive */
+	if (ssize != 0 && ssize <= priv->sbuf_len)
+		sc_mem_clear(priv->sbuf, ssize);
+	if (priv->rbuf != NULL)
+		sc_mem_clear(priv->rbuf, rsize <= priv->rbuf_len ? rsize : priv->rbuf_len);
 
 	return r;
 }
@@ -561,6 +607,7 @@ static int pcsc_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
+	pcsc_free_buffers(priv);
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -592,9 +639,11 @@ static int pcsc_cancel(sc_context_t *ctx)
 #ifndef _WIN32
 	if (gpriv->pcsc_wait_ctx != -1) {
 		rv = gpriv->SCardCancel(gpriv->pcsc_wait_ctx);
-		if (rv == SCARD_S_SUCCESS)
+		if (rv == SCARD_S_SUCCESS) {
 			 /* Also close and clear the waiting context */
 			 rv = gpriv->SCardReleaseContext(gpriv->pcsc_wait_ctx);
+			 gpriv->pcsc_wait_ctx = -1;
+		}
 	}
 #else
 	rv = gpriv->SCardCancel(gpriv->pcsc_ctx);
@@ -612,7 +661,7 @@ static struct sc_reader_driver pcsc_drv = {
 	"PC/SC reader",
 	"pcsc",
 	&pcsc_ops,
-	0, 0, NULL
+	0, 0, 0, NULL
 };
 
 static int pcsc_init(sc_context_t *ctx)
@@ -1047,9 +1096,13 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 	}
 
 	if (reader_states == NULL || *reader_states == NULL) {
+		/* The reader list may be extended by another thread */
+		sc_mutex_lock(ctx, ctx->mutex);
 		rgReaderStates = calloc(sc_ctx_get_reader_count(ctx) + 2, sizeof(SCARD_READERSTATE));
-		if (!rgReaderStates)
+		if (!rgReaderStates) {
+			sc_mutex_unlock(ctx, ctx->mutex);
 			SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY);
+		}
 
 		/* Find out the current status */
 		num_watch = sc_ctx_get_reader_count(ctx);
@@ -1067,6 +1120,7 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 			num_watch++;
 		}
 #endif
+		sc_mutex_unlock(ctx, ctx->mutex);
 	}
 	else {
 		rgReaderStates = (SCARD_READERSTATE *)(*reader_states);
@@ -1155,7 +1209,9 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 					
 				if (*event & event_mask) {
 					sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Matching event 0x%02X in reader %s", *event, rsp->szReader);
+					sc_mutex_lock(ctx, ctx->mutex);
 					*event_reader = sc_ctx_get_reader_by_name(ctx, rsp->szReader);
+					sc_mutex_unlock(ctx, ctx->mutex);
 					r = SC_SUCCESS;
 					goto out;
 				}
@@ -1685,7 +1741,7 @@ static struct sc_reader_driver cardmod_drv = {
 	"PC/SC cardmod reader",
 	"cardmod",
 	&cardmod_ops,
-	0, 0, NULL
+	0, 0, 0, NULL
 };
 
 static int cardmod_init(sc_context_t *ctx)
@@ -1996,6 +2052,7 @@ static int cardmod_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
+	pcsc_free_buffers(priv);
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -0,0 +1,1143 @@
+/*
+ * reader-virtual.c: Reader driver for an in-process software card
+ *
+ * The virtual reader needs neither hardware nor a reader daemon. Each
+ * reader holds a card that answers ISO 7816-4/-8 APDUs from a file
+ * system image in memory: MF, a PKCS #15 application DF with ODF,
+ * TokenInfo, AODF, PrKDF and CDF, and (with OpenSSL) a software RSA
+ * key and its self-signed certificate. The card is handled by the
+ * "virtual" card driver. A configurable delay per APDU models the
+ * round trip time of a real reader.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "internal.h"
+#include "pkcs15.h"
+
+#ifdef ENABLE_OPENSSL
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#endif
+
+#define GET_PRIV_DATA(r) ((struct virtual_private_data *) (r)->drv_data)
+
+#define VIRTUAL_MAX_READERS	16
+#define VIRTUAL_PIN_REF		0x01
+#define VIRTUAL_KEY_REF		0x01
+#define VIRTUAL_PIN_LEN		8	/* stored length, padded with 0xFF */
+#define VIRTUAL_PIN_TRIES	3
+
+/* T=1, historical bytes "OpenSCVirt"; matched by card-virtual.c */
+static const u8 virtual_atr[] = {
+	0x3B, 0x8A, 0x80, 0x01, 0x4F, 0x70, 0x65, 0x6E,
+	0x53, 0x43, 0x56, 0x69, 0x72, 0x74, 0x16
+};
+
+struct virtual_file {
+	u8 path[SC_MAX_PATH_SIZE];	/* absolute, starting with 3F00 */
+	size_t pathlen;
+	int is_df;
+	u8 *data;
+	size_t size;
+	struct virtual_file *next;
+};
+
+struct virtual_card {
+	struct virtual_file *files;
+	struct virtual_file *current_df, *current_ef;
+
+	u8 pin[VIRTUAL_PIN_LEN];
+	int pin_tries;
+	int pin_verified;
+
+	int se_op;		/* 0xB6 sign, 0xB8 decipher, 0 none */
+	int se_key_ref;
+#ifdef ENABLE_OPENSSL
+	RSA *rsa;
+#endif
+};
+
+struct virtual_global_private_data {
+	int readers;
+	unsigned long latency;	/* microseconds per APDU */
+	unsigned long transaction_latency;	/* microseconds per lock/unlock */
+	char pin[VIRTUAL_PIN_LEN + 1];
+	int key_length;
+	char *key_file;
+	volatile unsigned int cancels;	/* counts virtual_cancel() calls */
+};
+
+struct virtual_private_data {
+	struct virtual_global_private_data *gpriv;
+	unsigned int num;
+	int seen;
+	struct virtual_card *card;	/* stays in the reader across connects */
+
+	/* APDU buffers reused by every transmit, wiped after use */
+	u8 *sbuf, *rbuf;
+	size_t sbuf_len, rbuf_len;
+};
+
+struct virtual_apdu {
+	u8 cla, ins, p1, p2;
+	const u8 *data;
+	size_t lc;
+	size_t le;		/* 0: no response data expected */
+};
+
+static struct sc_reader_operations virtual_ops;
+
+static struct sc_reader_driver virtual_reader_driver = {
+	"Virtual software card reader",
+	"virtual",
+	&virtual_ops,
+	0, 0, 0, NULL
+};
+
+/*
+ * File system
+ */
+static const u8 virtual_mf_path[] = { 0x3F, 0x00 };
+
+static struct virtual_file *
+virtual_find_file(struct virtual_card *vc, const u8 *path, size_t pathlen)
+{
+	struct virtual_file *f;
+
+	for (f = vc->files; f != NULL; f = f->next)
+		if (f->pathlen == pathlen && memcmp(f->path, path, pathlen) == 0)
+			return f;
+	return NULL;
+}
+
+static int virtual_add_file(struct virtual_card *vc, const char *path, int is_df,
+		const u8 *data, size_t size)
+{
+	struct virtual_file *f, **tail;
+	sc_path_t p;
+
+	sc_format_path(path, &p);
+	f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(f->path, p.value, p.len);
+	f->pathlen = p.len;
+	f->is_df = is_df;
+	if (size) {
+		f->data = malloc(size);
+		if (f->data == NULL) {
+			free(f);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		memcpy(f->data, data, size);
+		f->size = size;
+	}
+	for (tail = &vc->files; *tail != NULL; tail = &(*tail)->next)
+		;
+	*tail = f;
+	return SC_SUCCESS;
+}
+
+static void virtual_free_card(struct virtual_card *vc)
+{
+	if (vc == NULL)
+		return;
+	while (vc->files) {
+		struct virtual_file *f = vc->files;
+
+		vc->files = f->next;
+		if (f->data) {
+			sc_mem_clear(f->data, f->size);
+			free(f->data);
+		}
+		free(f);
+	}
+#ifdef ENABLE_OPENSSL
+	if (vc->rsa)
+		RSA_free(vc->rsa);
+#endif
+	sc_mem_clear(vc, sizeof(*vc));
+	free(vc);
+}
+
+/*
+ * Card personalization
+ */
+#ifdef ENABLE_OPENSSL
+static RSA *virtual_load_key(sc_context_t *ctx, struct virtual_global_private_data *gpriv)
+{
+	RSA *rsa = NULL;
+	BIGNUM *e;
+
+	if (gpriv->key_file != NULL) {
+		FILE *f = fopen(gpriv->key_file, "r");
+
+		if (f == NULL) {
+			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "cannot open key file '%s'", gpriv->key_file);
+			return NULL;
+		}
+		rsa = PEM_read_RSAPrivateKey(f, NULL, NULL, NULL);
+		fclose(f);
+		if (rsa == NULL)
+			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "no RSA private key in '%s'", gpriv->key_file);
+		return rsa;
+	}
+
+	e = BN_new();
+	rsa = RSA_new();
+	if (e == NULL || rsa == NULL || !BN_set_word(e, RSA_F4)
+			|| !RSA_generate_key_ex(rsa, gpriv->key_length, e, NULL)) {
+		if (rsa)
+			RSA_free(rsa);
+		rsa = NULL;
+	}
+	if (e)
+		BN_free(e);
+	return rsa;
+}
+
+/* Self-signed certificate for the card key, DER encoded */
+static int virtual_make_cert(RSA *rsa, const char *cn, u8 **der, size_t *der_len)
+{
+	EVP_PKEY *pkey = NULL;
+	X509 *x509 = NULL;
+	X509_NAME *name;
+	u8 *p;
+	int len, r = SC_ERROR_INTERNAL;
+
+	pkey = EVP_PKEY_new();
+	x509 = X509_new();
+	if (pkey == NULL || x509 == NULL || !RSA_up_ref(rsa))
+		goto out;
+	EVP_PKEY_assign_RSA(pkey, rsa);
+
+	X509_set_version(x509, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+	X509_gmtime_adj(X509_get_notBefore(x509), 0);
+	X509_gmtime_adj(X509_get_notAfter(x509), 10L * 365 * 24 * 3600);
+	name = X509_get_subject_name(x509);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) cn, -1, -1, 0);
+	X509_set_issuer_name(x509, name);
+	if (!X509_set_pubkey(x509, pkey) || !X509_sign(x509, pkey, EVP_sha256()))
+		goto out;
+
+	len = i2d_X509(x509, NULL);
+	if (len <= 0)
+		goto out;
+	*der = p = malloc(len);
+	if (p == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	i2d_X509(x509, &p);
+	*der_len = len;
+	r = SC_SUCCESS;
+out:
+	if (x509)
+		X509_free(x509);
+	if (pkey)
+		EVP_PKEY_free(pkey);
+	return r;
+}
+#endif
+
+static struct sc_pkcs15_object *
+virtual_new_object(unsigned int type, const char *label, void *data)
+{
+	struct sc_pkcs15_object *obj = calloc(1, sizeof(*obj));
+
+	if (obj == NULL) {
+		free(data);
+		return NULL;
+	}
+	obj->type = type;
+	strncpy(obj->label, label, sizeof(obj->label) - 1);
+	obj->data = data;
+	return obj;
+}
+
+/* Encode one PKCS #15 file and store it in the card */
+static int virtual_store_df(sc_context_t *ctx, struct virtual_card *vc,
+		struct sc_pkcs15_card *p15card, unsigned int type, const char *path)
+{
+	struct sc_pkcs15_df *df;
+	u8 *buf = NULL;
+	size_t len = 0;
+	int r;
+
+	for (df = p15card->df_list; df != NULL; df = df->next)
+		if (df->type == type)
+			break;
+	if (df == NULL)
+		return SC_ERROR_INTERNAL;
+	r = sc_pkcs15_encode_df(ctx, p15card, df, &buf, &len);
+	if (r == SC_SUCCESS)
+		r = virtual_add_file(vc, path, 0, buf, len);
+	if (buf)
+		free(buf);
+	return r;
+}
+
+static int virtual_build_card(sc_reader_t *reader, struct virtual_card **out)
+{
+	sc_context_t *ctx = reader->ctx;
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+	struct virtual_global_private_data *gpriv = priv->gpriv;
+	struct sc_pkcs15_card *p15card = NULL;
+	struct sc_pkcs15_auth_info *pin_info;
+	struct sc_pkcs15_object *obj;
+	struct virtual_card *vc;
+	sc_path_t path;
+	u8 *buf = NULL;
+	size_t len;
+	char serial[17];
+	int r;
+
+	vc = calloc(1, sizeof(*vc));
+	p15card = sc_pkcs15_card_new();
+	if (vc == NULL || p15card == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	memset(vc->pin, 0xFF, sizeof(vc->pin));
+	memcpy(vc->pin, gpriv->pin, strlen(gpriv->pin));
+	vc->pin_tries = VIRTUAL_PIN_TRIES;
+
+	/* The MF and the application DF come first, files are
+	 * created in their parent */
+	r = virtual_add_file(vc, "3F00", 1, NULL, 0);
+	if (r == SC_SUCCESS)
+		r = virtual_add_file(vc, "3F005015", 1, NULL, 0);
+	if (r != SC_SUCCESS)
+		goto out;
+
+	sprintf(serial, "%016X", priv->num + 1);
+	p15card->tokeninfo->serial_number = strdup(serial);
+	p15card->tokeninfo->manufacturer_id = strdup("OpenSC Project");
+	p15card->tokeninfo->label = strdup("Virtual card");
+	p15card->tokeninfo->flags = SC_PKCS15_TOKEN_PRN_GENERATION;
+	if (!p15card->tokeninfo->serial_number || !p15card->tokeninfo->manufacturer_id
+			|| !p15card->tokeninfo->label) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+
+	sc_format_path("3F0050154401", &path);
+	sc_pkcs15_add_df(p15card, SC_PKCS15_AODF, &path);
+	sc_format_path("3F0050154402", &path);
+	sc_pkcs15_add_df(p15card, SC_PKCS15_PRKDF, &path);
+	sc_format_path("3F0050154403", &path);
+	sc_pkcs15_add_df(p15card, SC_PKCS15_CDF, &path);
+
+	/* User PIN */
+	pin_info = calloc(1, sizeof(*pin_info));
+	obj = virtual_new_object(SC_PKCS15_TYPE_AUTH_PIN, "User PIN", pin_info);
+	if (obj == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	sc_pkcs15_format_id("01", &pin_info->auth_id);
+	pin_info->auth_type = SC_PKCS15_PIN_AUTH_TYPE_PIN;
+	pin_info->auth_method = SC_AC_CHV;
+	pin_info->attrs.pin.flags = SC_PKCS15_PIN_FLAG_LOCAL | SC_PKCS15_PIN_FLAG_INITIALIZED
+		| SC_PKCS15_PIN_FLAG_NEEDS_PADDING;
+	pin_info->attrs.pin.type = SC_PKCS15_PIN_TYPE_ASCII_NUMERIC;
+	pin_info->attrs.pin.min_length = 4;
+	pin_info->attrs.pin.stored_length = VIRTUAL_PIN_LEN;
+	pin_info->attrs.pin.max_length = VIRTUAL_PIN_LEN;
+	pin_info->attrs.pin.reference = VIRTUAL_PIN_REF;
+	pin_info->attrs.pin.pad_char = 0xFF;
+	pin_info->tries_left = pin_info->max_tries = VIRTUAL_PIN_TRIES;
+	obj->flags = SC_PKCS15_CO_FLAG_PRIVATE;
+	obj->df = p15card->df_list;
+	sc_pkcs15_add_object(p15card, obj);
+
+#ifdef ENABLE_OPENSSL
+	vc->rsa = virtual_load_key(ctx, gpriv);
+	if (vc->rsa == NULL) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "no key for the virtual card, PIN only");
+	} else {
+		struct sc_pkcs15_prkey_info *prkey_info;
+		struct sc_pkcs15_cert_info *cert_info;
+		u8 *der = NULL;
+		size_t der_len = 0;
+
+		prkey_info = calloc(1, sizeof(*prkey_info));
+		obj = virtual_new_object(SC_PKCS15_TYPE_PRKEY_RSA, "Private key", prkey_info);
+		if (obj == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
+		}
+		sc_pkcs15_format_id("45", &prkey_info->id);
+		prkey_info->usage = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_SIGNRECOVER
+			| SC_PKCS15_PRKEY_USAGE_DECRYPT | SC_PKCS15_PRKEY_USAGE_UNWRAP;
+		prkey_info->access_flags = SC_PKCS15_PRKEY_ACCESS_SENSITIVE
+			| SC_PKCS15_PRKEY_ACCESS_ALWAYSSENSITIVE
+			| SC_PKCS15_PRKEY_ACCESS_NEVEREXTRACTABLE | SC_PKCS15_PRKEY_ACCESS_LOCAL;
+		prkey_info->native = 1;
+		prkey_info->key_reference = VIRTUAL_KEY_REF;
+		prkey_info->modulus_length = RSA_size(vc->rsa) * 8;
+		sc_format_path("3F005015", &prkey_info->path);
+		sc_pkcs15_format_id("01", &obj->auth_id);
+		obj->flags = SC_PKCS15_CO_FLAG_PRIVATE;
+		obj->df = p15card->df_list->next;
+		sc_pkcs15_add_object(p15card, obj);
+
+		r = virtual_make_cert(vc->rsa, "Virtual card", &der, &der_len);
+		if (r != SC_SUCCESS)
+			goto out;
+		r = virtual_add_file(vc, "3F0050154301", 0, der, der_len);
+		free(der);
+		if (r != SC_SUCCESS)
+			goto out;
+
+		cert_info = calloc(1, sizeof(*cert_info));
+		obj = virtual_new_object(SC_PKCS15_TYPE_CERT_X509, "Certificate", cert_info);
+		if (obj == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
+		}
+		sc_pkcs15_format_id("45", &cert_info->id);
+		sc_format_path("3F0050154301", &cert_info->path);
+		obj->df = p15card->df_list->next->next;
+		sc_pkcs15_add_object(p15card, obj);
+	}
+#endif
+
+	r = sc_pkcs15_encode_odf(ctx, p15card, &buf, &len);
+	if (r == SC_SUCCESS) {
+		r = virtual_add_file(vc, "3F0050155031", 0, buf, len);
+		free(buf);
+		buf = NULL;
+	}
+	if (r == SC_SUCCESS)
+		r = sc_pkcs15_encode_tokeninfo(ctx, p15card->tokeninfo, &buf, &len);
+	if (r == SC_SUCCESS)
+		r = virtual_add_file(vc, "3F0050155032", 0, buf, len);
+	if (r == SC_SUCCESS)
+		r = virtual_store_df(ctx, vc, p15card, SC_PKCS15_AODF, "3F0050154401");
+	if (r == SC_SUCCESS)
+		r = virtual_store_df(ctx, vc, p15card, SC_PKCS15_PRKDF, "3F0050154402");
+	if (r == SC_SUCCESS)
+		r = virtual_store_df(ctx, vc, p15card, SC_PKCS15_CDF, "3F0050154403");
+out:
+	if (buf)
+		free(buf);
+	if (p15card)
+		sc_pkcs15_card_free(p15card);
+	if (r != SC_SUCCESS) {
+		virtual_free_card(vc);
+		return r;
+	}
+	*out = vc;
+	return SC_SUCCESS;
+}
+
+/*
+ * APDU processing
+ */
+#define SW_OK			0x9000
+#define SW_WRONG_LENGTH		0x6700
+#define SW_SEC_STATUS		0x6982
+#define SW_AUTH_BLOCKED		0x6983
+#define SW_CONDITIONS		0x6985
+#define SW_NO_EF		0x6986
+#define SW_WRONG_DATA		0x6A80
+#define SW_FUNC_NOT_SUPPORTED	0x6A81
+#define SW_FILE_NOT_FOUND	0x6A82
+#define SW_OUT_OF_FILE		0x6A84
+#define SW_INCORRECT_P1P2	0x6A86
+#define SW_REF_NOT_FOUND	0x6A88
+#define SW_WRONG_OFFSET		0x6B00
+#define SW_INS_NOT_SUPPORTED	0x6D00
+#define SW_CLA_NOT_SUPPORTED	0x6E00
+
+/* Split a command APDU into its parts, short and extended forms */
+static int virtual_parse_apdu(const u8 *cmd, size_t len, struct virtual_apdu *a)
+{
+	memset(a, 0, sizeof(*a));
+	if (len < 4)
+		return -1;
+	a->cla = cmd[0];
+	a->ins = cmd[1];
+	a->p1 = cmd[2];
+	a->p2 = cmd[3];
+	if (len == 4)
+		return 0;
+	if (len == 5) {
+		a->le = cmd[4] ? cmd[4] : 256;
+		return 0;
+	}
+	if (cmd[4] != 0) {
+		a->lc = cmd[4];
+		a->data = cmd + 5;
+		if (len == 5 + a->lc)
+			return 0;
+		if (len == 6 + a->lc) {
+			a->le = cmd[5 + a->lc] ? cmd[5 + a->lc] : 256;
+			return 0;
+		}
+		return -1;
+	}
+	if (len < 7)
+		return -1;
+	if (len == 7) {
+		a->le = (cmd[5] << 8) | cmd[6];
+		if (a->le == 0)
+			a->le = 65536;
+		return 0;
+	}
+	a->lc = (cmd[5] << 8) | cmd[6];
+	a->data = cmd + 7;
+	if (len == 7 + a->lc)
+		return 0;
+	if (len == 9 + a->lc) {
+		a->le = (cmd[7 + a->lc] << 8) | cmd[8 + a->lc];
+		if (a->le == 0)
+			a->le = 65536;
+		return 0;
+	}
+	return -1;
+}
+
+static size_t virtual_fci(const struct virtual_file *f, u8 *out)
+{
+	u8 *p = out + 2;
+
+	*p++ = 0x83;
+	*p++ = 2;
+	*p++ = f->path[f->pathlen - 2];
+	*p++ = f->path[f->pathlen - 1];
+	if (f->is_df) {
+		*p++ = 0x82;
+		*p++ = 1;
+		*p++ = 0x38;
+	} else {
+		*p++ = 0x80;
+		*p++ = 2;
+		*p++ = (f->size >> 8) & 0xFF;
+		*p++ = f->size & 0xFF;
+		*p++ = 0x82;
+		*p++ = 1;
+		*p++ = 0x01;
+	}
+	out[0] = 0x6F;
+	out[1] = (u8) (p - out - 2);
+	return p - out;
+}
+
+static unsigned int virtual_select(struct virtual_card *vc, const struct virtual_apdu *a,
+		u8 *resp, size_t *resplen)
+{
+	u8 path[SC_MAX_PATH_SIZE + 2];
+	size_t pathlen = 0;
+	struct virtual_file *f = NULL;
+
+	if (a->lc % 2 || a->lc > SC_MAX_PATH_SIZE - 2)
+		return SW_WRONG_DATA;
+
+	switch (a->p1) {
+	case 0:
+		if (a->lc == 0 || (a->lc == 2 && a->data[0] == 0x3F && a->data[1] == 0x00)) {
+			path[0] = 0x3F;
+			path[1] = 0x00;
+			pathlen = 2;
+			break;
+		}
+		if (a->lc != 2)
+			return SW_WRONG_DATA;
+		/* a child of the current DF, or the current DF itself */
+		memcpy(path, vc->current_df->path, vc->current_df->pathlen);
+		memcpy(path + vc->current_df->pathlen, a->data, 2);
+		pathlen = vc->current_df->pathlen + 2;
+		if (!virtual_find_file(vc, path, pathlen)
+				&& memcmp(vc->current_df->path + vc->current_df->pathlen - 2, a->data, 2) == 0)
+			pathlen -= 2;
+		break;
+	case 3:
+		if (vc->current_df->pathlen <= 2)
+			return SW_FILE_NOT_FOUND;
+		memcpy(path, vc->current_df->path, vc->current_df->pathlen - 2);
+		pathlen = vc->current_df->pathlen - 2;
+		break;
+	case 8:
+		path[0] = 0x3F;
+		path[1] = 0x00;
+		memcpy(path + 2, a->data, a->lc);
+		pathlen = a->lc + 2;
+		break;
+	case 9:
+		if (vc->current_df->pathlen + a->lc > SC_MAX_PATH_SIZE)
+			return SW_FILE_NOT_FOUND;
+		memcpy(path, vc->current_df->path, vc->current_df->pathlen);
+		memcpy(path + vc->current_df->pathlen, a->data, a->lc);
+		pathlen = vc->current_df->pathlen + a->lc;
+		break;
+	case 4:
+		return SW_FILE_NOT_FOUND;	/* no applications selectable by AID */
+	default:
+		return SW_INCORRECT_P1P2;
+	}
+
+	if (pathlen > SC_MAX_PATH_SIZE || (f = virtual_find_file(vc, path, pathlen)) == NULL)
+		return SW_FILE_NOT_FOUND;
+
+	if (f->is_df) {
+		vc->current_df = f;
+		vc->current_ef = NULL;
+	} else {
+		vc->current_df = virtual_find_file(vc, f->path, f->pathlen - 2);
+		vc->current_ef = f;
+	}
+	if (a->le && (a->p2 & 0x0C) == 0) {
+		size_t n = virtual_fci(f, resp);
+
+		*resplen = n < a->le ? n : a->le;
+	}
+	return SW_OK;
+}
+
+static unsigned int virtual_read_binary(struct virtual_card *vc, const struct virtual_apdu *a,
+		u8 *resp, size_t *resplen)
+{
+	struct virtual_file *f = vc->current_ef;
+	size_t offset = ((a->p1 & 0x7F) << 8) | a->p2;
+	size_t n;
+
+	if (a->p1 & 0x80)
+		return SW_FUNC_NOT_SUPPORTED;	/* no short EF identifiers */
+	if (f == NULL)
+		return SW_NO_EF;
+	if (offset > f->size)
+		return SW_WRONG_OFFSET;
+	n = f->size - offset;
+	if (n > a->le)
+		n = a->le;
+	memcpy(resp, f->data + offset, n);
+	*resplen = n;
+	return SW_OK;
+}
+
+static unsigned int virtual_update_binary(struct virtual_card *vc, const struct virtual_apdu *a)
+{
+	struct virtual_file *f = vc->current_ef;
+	size_t offset = ((a->p1 & 0x7F) << 8) | a->p2;
+
+	if (a->p1 & 0x80)
+		return SW_FUNC_NOT_SUPPORTED;
+	if (f == NULL)
+		return SW_NO_EF;
+	if (!vc->pin_verified)
+		return SW_SEC_STATUS;
+	if (offset + a->lc > f->size)
+		return SW_OUT_OF_FILE;
+	memcpy(f->data + offset, a->data, a->lc);
+	return SW_OK;
+}
+
+static unsigned int virtual_check_pin(struct virtual_card *vc, const u8 *pin, size_t len)
+{
+	if (vc->pin_tries == 0)
+		return SW_AUTH_BLOCKED;
+	if (len != VIRTUAL_PIN_LEN || memcmp(pin, vc->pin, VIRTUAL_PIN_LEN) != 0) {
+		vc->pin_verified = 0;
+		vc->pin_tries--;
+		return vc->pin_tries ? 0x63C0 | vc->pin_tries : SW_AUTH_BLOCKED;
+	}
+	vc->pin_tries = VIRTUAL_PIN_TRIES;
+	return SW_OK;
+}
+
+static unsigned int virtual_verify(struct virtual_card *vc, const struct virtual_apdu *a)
+{
+	unsigned int sw;
+
+	if (a->p1 != 0 || (a->p2 & 0x7F) != VIRTUAL_PIN_REF)
+		return SW_REF_NOT_FOUND;
+	if (a->lc == 0) {
+		/* status query */
+		if (vc->pin_tries == 0)
+			return SW_AUTH_BLOCKED;
+		return vc->pin_verified ? SW_OK : 0x63C0 | vc->pin_tries;
+	}
+	sw = virtual_check_pin(vc, a->data, a->lc);
+	vc->pin_verified = sw == SW_OK;
+	return sw;
+}
+
+static unsigned int virtual_change_pin(struct virtual_card *vc, const struct virtual_apdu *a)
+{
+	unsigned int sw;
+
+	if (a->p1 != 0 || (a->p2 & 0x7F) != VIRTUAL_PIN_REF)
+		return SW_REF_NOT_FOUND;
+	if (a->lc != 2 * VIRTUAL_PIN_LEN)
+		return SW_WRONG_LENGTH;
+	sw = virtual_check_pin(vc, a->data, VIRTUAL_PIN_LEN);
+	if (sw != SW_OK)
+		return sw;
+	memcpy(vc->pin, a->data + VIRTUAL_PIN_LEN, VIRTUAL_PIN_LEN);
+	vc->pin_verified = 1;
+	return SW_OK;
+}
+
+static unsigned int virtual_mse(struct virtual_card *vc, const struct virtual_apdu *a)
+{
+	size_t i;
+
+	if (a->p1 == 0xF3)	/* RESTORE */
+		return SW_OK;
+	if (a->p1 != 0x41 || (a->p2 != 0xB6 && a->p2 != 0xB8))
+		return SW_INCORRECT_P1P2;
+
+	vc->se_op = a->p2;
+	vc->se_key_ref = -1;
+	for (i = 0; i + 2 <= a->lc; i += 2 + a->data[i + 1]) {
+		if (i + 2 + a->data[i + 1] > a->lc)
+			return SW_WRONG_DATA;
+		if ((a->data[i] == 0x83 || a->data[i] == 0x84) && a->data[i + 1] == 1)
+			vc->se_key_ref = a->data[i + 2];
+	}
+	return SW_OK;
+}
+
+static unsigned int virtual_pso(struct virtual_card *vc, const struct virtual_apdu *a,
+		u8 *resp, size_t *resplen)
+{
+	int sign;
+
+	if (a->p1 == 0x9E && a->p2 == 0x9A)
+		sign = 1;
+	else if (a->p1 == 0x80 && a->p2 == 0x86)
+		sign = 0;
+	else
+		return SW_INCORRECT_P1P2;
+
+	if (!vc->pin_verified)
+		return SW_SEC_STATUS;
+	if (vc->se_op != (sign ? 0xB6 : 0xB8) || vc->se_key_ref != VIRTUAL_KEY_REF)
+		return SW_CONDITIONS;
+#ifdef ENABLE_OPENSSL
+	if (vc->rsa != NULL) {
+		size_t klen = RSA_size(vc->rsa);
+		const u8 *in = a->data;
+		size_t inlen = a->lc;
+		int r;
+
+		if (!sign) {
+			/* padding indicator byte */
+			if (inlen < 1 || in[0] != 0x00)
+				return SW_WRONG_DATA;
+			in++;
+			inlen--;
+		}
+		if (inlen != klen)
+			return SW_WRONG_LENGTH;
+		if (sign)
+			r = RSA_private_encrypt(inlen, in, resp, vc->rsa, RSA_NO_PADDING);
+		else
+			r = RSA_private_decrypt(inlen, in, resp, vc->rsa, RSA_NO_PADDING);
+		if (r <= 0)
+			return SW_WRONG_DATA;
+		*resplen = (size_t) r < a->le ? (size_t) r : a->le;
+		return SW_OK;
+	}
+#endif
+	return SW_FUNC_NOT_SUPPORTED;
+}
+
+static unsigned int virtual_get_challenge(const struct virtual_apdu *a, u8 *resp, size_t *resplen)
+{
+	size_t i;
+
+#ifdef ENABLE_OPENSSL
+	if (RAND_bytes(resp, a->le) == 1) {
+		*resplen = a->le;
+		return SW_OK;
+	}
+#endif
+	for (i = 0; i < a->le; i++)
+		resp[i] = rand() & 0xFF;
+	*resplen = a->le;
+	return SW_OK;
+}
+
+/* Process one command; resp must hold the largest Le plus SW1 SW2 */
+static size_t virtual_process_apdu(struct virtual_card *vc, const u8 *cmd, size_t cmdlen,
+		u8 *resp, size_t resp_size)
+{
+	struct virtual_apdu a;
+	size_t resplen = 0;
+	unsigned int sw;
+
+	if (virtual_parse_apdu(cmd, cmdlen, &a) < 0)
+		sw = SW_WRONG_LENGTH;
+	else if (a.le + 2 > resp_size)
+		sw = SW_WRONG_LENGTH;
+	else if (a.cla != 0x00)
+		sw = SW_CLA_NOT_SUPPORTED;
+	else {
+		switch (a.ins) {
+		case 0xA4:
+			sw = virtual_select(vc, &a, resp, &resplen);
+			break;
+		case 0xB0:
+			sw = virtual_read_binary(vc, &a, resp, &resplen);
+			break;
+		case 0xD6:
+			sw = virtual_update_binary(vc, &a);
+			break;
+		case 0x20:
+			sw = virtual_verify(vc, &a);
+			break;
+		case 0x24:
+			sw = virtual_change_pin(vc, &a);
+			break;
+		case 0x22:
+			sw = virtual_mse(vc, &a);
+			break;
+		case 0x2A:
+			sw = virtual_pso(vc, &a, resp, &resplen);
+			break;
+		case 0x84:
+			sw = virtual_get_challenge(&a, resp, &resplen);
+			break;
+		default:
+			sw = SW_INS_NOT_SUPPORTED;
+		}
+	}
+	if (sw != SW_OK)
+		resplen = 0;
+	resp[resplen++] = sw >> 8;
+	resp[resplen++] = sw & 0xFF;
+	return resplen;
+}
+
+/*
+ * Reader driver
+ */
+static int virtual_reserve_buffer(u8 **buf, size_t *buflen, size_t need)
+{
+	u8 *p;
+
+	if (*buflen >= need)
+		return SC_SUCCESS;
+	p = malloc(need);
+	if (p == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (*buf != NULL) {
+		sc_mem_clear(*buf, *buflen);
+		free(*buf);
+	}
+	*buf = p;
+	*buflen = need;
+	return SC_SUCCESS;
+}
+
+static void virtual_delay(unsigned long usec)
+{
+	if (usec == 0)
+		return;
+#ifdef _WIN32
+	Sleep((usec + 999) / 1000);
+#else
+	usleep(usec);
+#endif
+}
+
+static int virtual_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+	size_t ssize = 0, rsize = 0;
+	int r;
+
+	if (priv->card == NULL)
+		return SC_ERROR_CARD_NOT_PRESENT;
+	if (apdu->control)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	r = sc_apdu_write_octets(reader->ctx, apdu, reader->active_protocol,
+			priv->sbuf, priv->sbuf_len, &ssize);
+	if (r == SC_ERROR_BUFFER_TOO_SMALL) {
+		r = virtual_reserve_buffer(&priv->sbuf, &priv->sbuf_len, ssize);
+		if (r != SC_SUCCESS)
+			return r;
+		r = sc_apdu_write_octets(reader->ctx, apdu, reader->active_protocol,
+				priv->sbuf, priv->sbuf_len, &ssize);
+	}
+	if (r != SC_SUCCESS)
+		goto out;
+	r = virtual_reserve_buffer(&priv->rbuf, &priv->rbuf_len, SC_MAX_EXT_APDU_BUFFER_SIZE + 2);
+	if (r != SC_SUCCESS)
+		goto out;
+
+	sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "reader '%s'", reader->name);
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, priv->sbuf, ssize, 1);
+	rsize = virtual_process_apdu(priv->card, priv->sbuf, ssize, priv->rbuf, priv->rbuf_len);
+	virtual_delay(priv->gpriv->latency);
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, priv->rbuf, rsize, 0);
+
+	r = sc_apdu_set_resp(reader->ctx, apdu, priv->rbuf, rsize);
+out:
+	if (ssize != 0 && ssize <= priv->sbuf_len)
+		sc_mem_clear(priv->sbuf, ssize);
+	if (rsize != 0)
+		sc_mem_clear(priv->rbuf, rsize);
+	return r;
+}
+
+static int virtual_detect_card_presence(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+
+	reader->flags = SC_READER_CARD_PRESENT;
+	if (!priv->seen) {
+		reader->flags |= SC_READER_CARD_CHANGED;
+		priv->seen = 1;
+	}
+	return reader->flags;
+}
+
+/* The cards never leave their readers, so there are no events to
+ * report: wait until the timeout or until cancelled */
+static int virtual_wait_for_event(sc_context_t *ctx, unsigned int event_mask,
+		sc_reader_t **event_reader, unsigned int *event,
+		int timeout, void **reader_states)
+{
+	struct virtual_global_private_data *gpriv = ctx->reader_drv_data;
+	unsigned int cancels = gpriv->cancels;
+	int waited = 0;
+
+	/* No reader states are kept, so freeing them is a no-op */
+	if (event_reader == NULL || event == NULL)
+		return SC_SUCCESS;
+	*event_reader = NULL;
+	*event = 0;
+	while (timeout < 0 || waited < timeout) {
+		if (gpriv->cancels != cancels)
+			break;
+		virtual_delay(10000);
+		waited += 10;
+	}
+	return SC_ERROR_EVENT_TIMEOUT;
+}
+
+static int virtual_cancel(sc_context_t *ctx)
+{
+	struct virtual_global_private_data *gpriv = ctx->reader_drv_data;
+
+	gpriv->cancels++;
+	return SC_SUCCESS;
+}
+
+static int virtual_connect(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+	struct virtual_card *vc;
+	int r;
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	if (priv->card == NULL) {
+		r = virtual_build_card(reader, &priv->card);
+		SC_TEST_RET(reader->ctx, SC_LOG_DEBUG_NORMAL, r, "cannot create virtual card");
+	}
+	vc = priv->card;
+
+	/* power on: security state and current file are lost */
+	vc->pin_verified = 0;
+	vc->se_op = 0;
+	vc->se_key_ref = -1;
+	vc->current_ef = NULL;
+	vc->current_df = virtual_find_file(vc, virtual_mf_path, sizeof(virtual_mf_path));
+
+	memcpy(reader->atr.value, virtual_atr, sizeof(virtual_atr));
+	reader->atr.len = sizeof(virtual_atr);
+	reader->active_protocol = SC_PROTO_T1;
+	reader->flags |= SC_READER_CARD_PRESENT;
+	return SC_SUCCESS;
+}
+
+static int virtual_disconnect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_reset(sc_reader_t *reader, int do_cold_reset)
+{
+	return virtual_connect(reader);
+}
+
+/* There is no one to share the card with, locking only costs the
+ * time a resource manager would take */
+static int virtual_lock(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+
+	virtual_delay(priv->gpriv->transaction_latency);
+	return SC_SUCCESS;
+}
+
+static int virtual_unlock(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+
+	virtual_delay(priv->gpriv->transaction_latency);
+	return SC_SUCCESS;
+}
+
+static int virtual_release(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+
+	if (priv) {
+		virtual_free_card(priv->card);
+		if (priv->sbuf) {
+			sc_mem_clear(priv->sbuf, priv->sbuf_len);
+			free(priv->sbuf);
+		}
+		if (priv->rbuf) {
+			sc_mem_clear(priv->rbuf, priv->rbuf_len);
+			free(priv->rbuf);
+		}
+		free(priv);
+		reader->drv_data = NULL;
+	}
+	return SC_SUCCESS;
+}
+
+static int virtual_add_reader(sc_context_t *ctx, struct virtual_global_private_data *gpriv,
+		unsigned int num)
+{
+	sc_reader_t *reader;
+	struct virtual_private_data *priv;
+	char name[64];
+
+	reader = calloc(1, sizeof(*reader));
+	priv = calloc(1, sizeof(*priv));
+	if (reader == NULL || priv == NULL) {
+		free(reader);
+		free(priv);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	snprintf(name, sizeof(name), "Virtual reader %u", num);
+	reader->name = strdup(name);
+	if (reader->name == NULL) {
+		free(reader);
+		free(priv);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	priv->gpriv = gpriv;
+	priv->num = num;
+	reader->driver = &virtual_reader_driver;
+	reader->ops = &virtual_ops;
+	reader->drv_data = priv;
+	reader->supported_protocols = SC_PROTO_T1;
+	return _sc_add_reader(ctx, reader);
+}
+
+static int virtual_init(sc_context_t *ctx)
+{
+	struct virtual_global_private_data *gpriv;
+	scconf_block *conf_block;
+	const char *pin = "123456", *key_file = NULL;
+	int i, r;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+	gpriv = calloc(1, sizeof(*gpriv));
+	if (gpriv == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	gpriv->readers = 1;
+	gpriv->key_length = 2048;
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	if (conf_block) {
+		gpriv->readers = scconf_get_int(conf_block, "readers", gpriv->readers);
+		gpriv->latency = scconf_get_int(conf_block, "latency", 0);
+		gpriv->transaction_latency = scconf_get_int(conf_block, "transaction_latency", 0);
+		gpriv->key_length = scconf_get_int(conf_block, "rsa_key_length", gpriv->key_length);
+		pin = scconf_get_str(conf_block, "pin", pin);
+		key_file = scconf_get_str(conf_block, "key_file", NULL);
+	}
+	if (gpriv->readers < 1 || gpriv->readers > VIRTUAL_MAX_READERS)
+		gpriv->readers = 1;
+	if (strlen(pin) < 4 || strlen(pin) > VIRTUAL_PIN_LEN) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "invalid virtual card PIN length, using default");
+		pin = "123456";
+	}
+	strcpy(gpriv->pin, pin);
+	if (key_file != NULL && (gpriv->key_file = strdup(key_file)) == NULL) {
+		free(gpriv);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	ctx->reader_drv_data = gpriv;
+
+	for (i = 0; i < gpriv->readers; i++) {
+		r = virtual_add_reader(ctx, gpriv, i);
+		if (r != SC_SUCCESS)
+			return r;
+	}
+	return SC_SUCCESS;
+}
+
+static int virtual_finish(sc_context_t *ctx)
+{
+	struct virtual_global_private_data *gpriv = ctx->reader_drv_data;
+
+	if (gpriv) {
+		if (gpriv->key_file)
+			free(gpriv->key_file);
+		sc_mem_clear(gpriv, sizeof(*gpriv));
+		free(gpriv);
+		ctx->reader_drv_data = NULL;
+	}
+	return SC_SUCCESS;
+}
+
+struct sc_reader_driver * sc_get_virtual_reader_driver(void)
+{
+	virtual_ops.init = virtual_init;
+	virtual_ops.finish = virtual_finish;
+	virtual_ops.detect_readers = NULL;
+	virtual_ops.release = virtual_release;
+	virtual_ops.detect_card_presence = virtual_detect_card_presence;
+	virtual_ops.connect = virtual_connect;
+	virtual_ops.disconnect = virtual_disconnect;
+	virtual_ops.transmit = virtual_transmit;
+	virtual_ops.lock = virtual_lock;
+	virtual_ops.unlock = virtual_unlock;
+	virtual_ops.perform_verify = NULL;
+	virtual_ops.wait_for_event = virtual_wait_for_event;
+	virtual_ops.cancel = virtual_cancel;
+	virtual_ops.reset = virtual_reset;
+
+	return &virtual_reader_driver;
+}
@@ -99,9 +99,14 @@ int sc_verify(sc_card_t *card, unsigned int type, int ref,
 
 int sc_logout(sc_card_t *card)
 {
+	int r;
+
 	if (card->ops->logout == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
-	return card->ops->logout(card);
+	r = card->ops->logout(card);
+	if (r == SC_SUCCESS)
+		_sc_pin_states_lost(card);
+	return r;
 }
 
 int sc_change_reference_data(sc_card_t *card, unsigned int type,
@@ -141,6 +146,63 @@ int sc_reset_retry_counter(sc_card_t *card, unsigned int type, int ref,
 	return sc_pin_cmd(card, &data, NULL);
 }
 
+static struct sc_pin_state *find_pin_state(sc_card_t *card,
+		unsigned int type, int reference, int create)
+{
+	struct sc_pin_state *unused = NULL;
+	int i;
+
+	for (i = 0; i < SC_MAX_PIN_STATES; i++) {
+		struct sc_pin_state *ps = &card->pin_state[i];
+
+		if (ps->state == SC_PIN_STATE_UNKNOWN) {
+			if (unused == NULL)
+				unused = ps;
+			continue;
+		}
+		if (ps->type == type && ps->reference == reference)
+			return ps;
+	}
+	if (!create || unused == NULL)
+		return NULL;
+	unused->type = type;
+	unused->reference = reference;
+	return unused;
+}
+
+/* Remember what the result of a PIN command tells about the
+ * verification state of the PIN */
+static void update_pin_state(sc_card_t *card, int cmd,
+		unsigned int type, int reference, int r)
+{
+	struct sc_pin_state *ps;
+	int state;
+
+	switch (cmd) {
+	case SC_PIN_CMD_VERIFY:
+		if (r == SC_SUCCESS)
+			state = SC_PIN_STATE_LOGGED_IN;
+		else if (r == SC_ERROR_PIN_CODE_INCORRECT
+				|| r == SC_ERROR_AUTH_METHOD_BLOCKED)
+			state = SC_PIN_STATE_LOGGED_OUT;
+		else
+			state = SC_PIN_STATE_UNKNOWN;
+		break;
+	case SC_PIN_CMD_CHANGE:
+	case SC_PIN_CMD_UNBLOCK:
+		/* cards differ in whether this verifies the PIN */
+		state = SC_PIN_STATE_UNKNOWN;
+		break;
+	default:
+		return;
+	}
+
+	ps = find_pin_state(card, type, reference,
+			state != SC_PIN_STATE_UNKNOWN);
+	if (ps != NULL)
+		ps->state = state;
+}
+
 /*
  * This is the new style pin command, which takes care of all PIN
  * operations.
@@ -151,6 +213,8 @@ int sc_reset_retry_counter(sc_card_t *card, unsigned int type, int ref,
 int sc_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data,
 		int *tries_left)
 {
+	unsigned int type = data->pin_type;
+	int reference = data->pin_reference;
 	int r;
 
 	assert(card != NULL);
@@ -201,9 +265,29 @@ int sc_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data,
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "Use of pin pad not supported by card driver");
 		r = SC_ERROR_NOT_SUPPORTED;
 	}
+	update_pin_state(card, data->cmd, type, reference, r);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
+int sc_pin_state(sc_card_t *card, unsigned int type, int reference)
+{
+	struct sc_pin_state *ps;
+
+	if (card == NULL)
+		return SC_PIN_STATE_UNKNOWN;
+	ps = find_pin_state(card, type, reference, 0);
+	return ps != NULL ? ps->state : SC_PIN_STATE_UNKNOWN;
+}
+
+void _sc_pin_states_lost(sc_card_t *card)
+{
+	int i;
+
+	for (i = 0; i < SC_MAX_PIN_STATES; i++)
+		if (card->pin_state[i].state == SC_PIN_STATE_LOGGED_IN)
+			card->pin_state[i].state = SC_PIN_STATE_LOGGED_OUT;
+}
+
 /*
  * This function will copy a PIN, convert and pad it as required
  *
@@ -286,7 +286,10 @@ __pkcs15_release_object(struct pkcs15_any_object *obj)
 {
 	if (--(obj->refcount) != 0)
 		return obj->refcount;
-	
+
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_free_verify_key(obj->base.verify_key);
+#endif
 	sc_mem_clear(obj, obj->size);
 	free(obj);
 
@@ -315,7 +318,7 @@ __pkcs15_delete_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object
 
 CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 {
-	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_slot *slot = NULL;
 	struct sc_pkcs15_object *auth;
 	struct sc_pkcs15_auth_info *pin_info;
 	struct sc_pin_cmd_data data;
@@ -325,13 +328,12 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
+	if (context == NULL)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetTokenInfo(%lx)", slotID);
 
-	rv = slot_get_token(slotID, &slot);
+	rv = slot_lock_token(slotID, &slot);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -371,7 +373,7 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	}
 	memcpy(pInfo, &slot->token_info, sizeof(CK_TOKEN_INFO));
 out:
-	sc_pkcs11_unlock();
+	slot_unlock(slot);
 	return rv;
 }
 
@@ -417,20 +419,15 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data,
 	struct sc_pkcs15_object *cert, struct pkcs15_any_object **cert_object)
 {
 	struct sc_pkcs15_cert_info *p15_info;
-	struct sc_pkcs15_cert *p15_cert;
 	struct pkcs15_cert_object *object;
 	struct pkcs15_pubkey_object *obj2;
 	int rv;
 
 	p15_info = (struct sc_pkcs15_cert_info *) cert->data;
 
-	if (cert->flags & SC_PKCS15_CO_FLAG_PRIVATE)   	/* is the cert private? */
-		p15_cert = NULL; 		/* will read cert when needed */
-	else
-	if ((rv = sc_pkcs15_read_certificate(fw_data->p15_card, p15_info, &p15_cert) < 0))
-		return rv;
-
-	/* Certificate object */
+	/* Certificate object. Only the CDF entry is used here, the
+	 * certificate itself is read on first use by check_cert_data_read()
+	 */
 	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &object,
 					cert, &pkcs15_cert_ops,
 					sizeof(struct pkcs15_cert_object));
@@ -438,7 +435,7 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data,
 		return rv;
 
 	object->cert_info = p15_info;
-	object->cert_data = p15_cert;
+	object->cert_data = NULL;
 
 	/* Corresponding public key */
 	rv = public_key_created(fw_data, fw_data->num_objects, p15_info->id.value, p15_info->id.len, (struct pkcs15_any_object **) &obj2);
@@ -450,18 +447,8 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data,
 	if (rv < 0)
 	  return rv;	
 	
-	if (p15_cert) {
-		 /* we take the pubkey from the cert, as it in not needed */
-		obj2->pub_data = p15_cert->key;
-		/* invalidate public data of the cert object so that sc_pkcs15_cert_free
-		 * does not free the public key data as well (something like
-		 * sc_pkcs15_pubkey_dup would have been nice here) -- Nils
-		 */
-		p15_cert->key = NULL;
-		
-	} else
-		obj2->pub_data = NULL; /* will copy from cert when cert is read */
-
+	/* A key read from the PuKDF is kept, otherwise the key is
+	 * taken from the cert when the cert is read */
 	obj2->pub_genfrom = object;
 	object->cert_pubkey = obj2;
 
@@ -692,8 +679,9 @@ pkcs15_bind_related_objects(struct pkcs15_fw_data *fw_data)
 	}
 }
 
-/* We deferred reading of the cert until needed, as it may be
- * a private object, so we must wait till login to read
+/* We defer reading of the cert until one of the attributes taken
+ * from its contents is asked for. Private certs cannot be read before
+ * login anyway, and tokens with many certs are much faster to list.
  */
 
 static int 
@@ -701,6 +689,7 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data,
 				 struct pkcs15_cert_object *cert)
 {
 	int rv;
+	unsigned int i;
 	struct pkcs15_pubkey_object *obj2;
 
 	if (!cert)
@@ -709,23 +698,30 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data,
 	if (cert->cert_data) 
 		return 0;
 	if ((rv = sc_pkcs15_read_certificate(fw_data->p15_card, 
-				cert->cert_info, &cert->cert_data) < 0))
+				cert->cert_info, &cert->cert_data)) < 0)
 		return rv;
 
 	/* update the related public key object */
 	obj2 = cert->cert_pubkey;
 
-	obj2->pub_data = cert->cert_data->key;
-	/* We take the pub key from the cert that we will discard below */
-	/* invalidate public data of the cert object so that sc_pkcs15_cert_free
-	 * does not free the public key data as well (something like
-	 * sc_pkcs15_pubkey_dup would have been nice here) -- Nils
-	 */
-	cert->cert_data->key = NULL;
+	if (obj2 && obj2->pub_data == NULL) {
+		obj2->pub_data = cert->cert_data->key;
+		/* We take the pub key from the cert that we will discard below */
+		/* invalidate public data of the cert object so that sc_pkcs15_cert_free
+		 * does not free the public key data as well (something like
+		 * sc_pkcs15_pubkey_dup would have been nice here) -- Nils
+		 */
+		cert->cert_data->key = NULL;
+	}
 
-	/* now that we have the cert and pub key, lets see if we can bind anything else */
-	
-	pkcs15_bind_related_objects(fw_data);
+	/* now that we have the subject and issuer, look for the issuer
+	 * of this cert and of the certs read before */
+	for (i = 0; i < fw_data->num_objects; i++) {
+		struct pkcs15_cert_object *other = (struct pkcs15_cert_object *) fw_data->objects[i];
+
+		if (is_cert(fw_data->objects[i]) && other->cert_data && !other->cert_issuer)
+			__pkcs15_cert_bind_related(fw_data, other);
+	}
 
 	return 0;
 }
@@ -737,6 +733,7 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot,
 {
 	unsigned int i;
 	struct pkcs15_fw_data *card_fw_data;
+	CK_OBJECT_HANDLE handle;
 
 	if (obj == NULL
 	 || (obj->base.flags & (SC_PKCS11_OBJECT_HIDDEN | SC_PKCS11_OBJECT_RECURS)))
@@ -746,12 +743,22 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot,
 	if (list_contains(&slot->objects, obj))
 		return;
 
+	if (sc_pkcs11_handle_add(&slot->object_handles, obj, &handle) != CKR_OK)
+		return;
+	/* The key type of a public key is only known once its data is read */
+	if (obj->base.ops == &pkcs15_pubkey_ops
+	 && ((struct pkcs15_pubkey_object *) obj)->pub_data == NULL)
+		obj->base.flags |= SC_PKCS11_OBJECT_PARTIAL;
+	else
+		obj->base.flags &= ~SC_PKCS11_OBJECT_PARTIAL;
+	slot_index_add(slot, &obj->base, handle);
+
 	if (pHandle != NULL)
-		*pHandle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
+		*pHandle = handle;
 
 	list_append(&slot->objects, obj);
-	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Setting object handle of 0x%lx to 0x%lx", obj->base.handle, (CK_OBJECT_HANDLE)obj);
-	obj->base.handle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Setting object handle of 0x%lx to 0x%lx", obj->base.handle, handle);
+	obj->base.handle = handle;
 	obj->base.flags |= SC_PKCS11_OBJECT_SEEN;
 	obj->refcount++;
 
@@ -791,6 +798,31 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot,
 	obj->base.flags &= ~SC_PKCS11_OBJECT_RECURS;
 }
 
+/* Whether a PIN gets its own slot */
+static int pkcs15_is_user_pin(struct sc_pkcs15_object *auth)
+{
+	struct sc_pkcs15_auth_info *pin_info = (struct sc_pkcs15_auth_info*) auth->data;
+
+	/* Ignore all but PIN authentication objects */
+	if (pin_info->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN)
+		return 0;
+
+	/* Ignore any non-authentication PINs */
+	if ((pin_info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_SO_PIN) != 0)
+		return 0;
+
+	/* Ignore unblocking pins for hacked module */
+	if (hack_enabled && (pin_info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_UNBLOCKING_PIN) != 0)
+		return 0;
+
+	/* Ignore unblocking pins */
+	if (!sc_pkcs11_conf.create_puk_slot)
+		if (pin_info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_UNBLOCKING_PIN)
+			return 0;
+
+	return 1;
+}
+
 static void pkcs15_init_slot(struct sc_pkcs15_card *p15card,
 		struct sc_pkcs11_slot *slot,
 		struct sc_pkcs15_object *auth)
@@ -873,7 +905,7 @@ static CK_RV pkcs15_create_tokens(struct sc_pkcs11_card *p11card)
 	struct sc_pkcs11_slot *slot = NULL;
 	int i, rv;
 	int auth_count;
-	int found_auth_count = 0;
+	int found_auth_count = 0, user_pins = 0;
 	unsigned int j;
 
 	rv = sc_pkcs15_get_objects(fw_data->p15_card,
@@ -949,27 +981,31 @@ static CK_RV pkcs15_create_tokens(struct sc_pkcs11_card *p11card)
 		auth_count = 1;
 
 	for (i = 0; i < auth_count; i++) {
-		struct sc_pkcs15_auth_info *pin_info = NULL;
+		if (pkcs15_is_user_pin(auths[i]))
+			user_pins++;
+	}
 
-		pin_info = (struct sc_pkcs15_auth_info*) auths[i]->data;
+	/* A certificate brings the certificate of its issuer into its slot.
+	 * The issuers are only known once the certificates are read, so read
+	 * the public ones now if the objects go to more than one slot, or if
+	 * only the public objects related to a PIN are added at all */
+	if (hack_enabled || user_pins > 1 || (user_pins == 1
+	 && !(sc_pkcs11_conf.hide_empty_tokens || (fw_data->p15_card->flags & SC_PKCS15_CARD_FLAG_EMULATED)))) {
+		for (j = 0; j < fw_data->num_objects; j++) {
+			struct pkcs15_any_object *obj = fw_data->objects[j];
 
-		/* Ignore all but PIN authentication objects */
-		if (pin_info->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN)
-			continue;
+			if (is_cert(obj) && !(obj->p15_object->flags & SC_PKCS15_CO_FLAG_PRIVATE))
+				check_cert_data_read(fw_data, (struct pkcs15_cert_object *) obj);
+		}
+	}
 
-		/* Ignore any non-authentication PINs */
-		if ((pin_info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_SO_PIN) != 0)
-			continue;
+	for (i = 0; i < auth_count; i++) {
+		struct sc_pkcs15_auth_info *pin_info = NULL;
 
-		/* Ignore unblocking pins for hacked module */
-		if (hack_enabled && (pin_info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_UNBLOCKING_PIN) != 0)
+		if (!pkcs15_is_user_pin(auths[i]))
 			continue;
 
-		/* Ignore unblocking pins */
-		if (!sc_pkcs11_conf.create_puk_slot)
-			if (pin_info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_UNBLOCKING_PIN)
-				continue;
-
+		pin_info = (struct sc_pkcs15_auth_info*) auths[i]->data;
 		found_auth_count++;
 
 		rv = pkcs15_create_slot(p11card, auths[i], &slot);
@@ -2699,7 +2735,9 @@ static CK_RV pkcs15_prkey_sign(struct sc_pkcs11_session *ses, void *obj,
 	if (rv < 0)
 		return sc_to_cryptoki_error(rv, "C_Sign");
 
-	if (!sc_pkcs11_conf.lock_login) {
+	/* Nothing was selected since the last signature with this key */
+	if (!sc_pkcs11_conf.lock_login
+			&& !sc_pkcs15_sign_env_current(fw_data->p15_card, prkey->prv_p15obj)) {
 		rv = reselect_app_df(fw_data->p15_card);
 		if (rv < 0) {
 			sc_unlock(ses->slot->card->card);
@@ -2842,6 +2880,7 @@ static CK_RV pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session,
 
 	/* We may need to get these from cert */
 	switch (attr->type) {
+		case CKA_KEY_TYPE:
 		case CKA_MODULUS:
 		case CKA_MODULUS_BITS:
 		case CKA_VALUE:
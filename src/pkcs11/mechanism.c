@@ -174,6 +174,33 @@ sc_pkcs11_md_init(struct sc_pkcs11_session *session,
 	return rv;
 }
 
+/*
+ * Feed data to a digest, sign or verify operation. The data is only
+ * hashed or buffered on the host, so this can run without the slot
+ * lock on an operation taken out of its session, see
+ * session_take_operation().
+ */
+CK_RV
+sc_pkcs11_operation_update(sc_pkcs11_operation_t *op, int type,
+			CK_BYTE_PTR pData, CK_ULONG ulDataLen)
+{
+	switch (type) {
+	case SC_PKCS11_OPERATION_DIGEST:
+		return op->type->md_update(op, pData, ulDataLen);
+	case SC_PKCS11_OPERATION_SIGN:
+		if (op->type->sign_update == NULL)
+			return CKR_KEY_TYPE_INCONSISTENT;
+		return op->type->sign_update(op, pData, ulDataLen);
+#ifdef ENABLE_OPENSSL
+	case SC_PKCS11_OPERATION_VERIFY:
+		if (op->type->verif_update == NULL)
+			return CKR_KEY_TYPE_INCONSISTENT;
+		return op->type->verif_update(op, pData, ulDataLen);
+#endif
+	}
+	return CKR_ARGUMENTS_BAD;
+}
+
 CK_RV
 sc_pkcs11_md_update(struct sc_pkcs11_session *session,
 			CK_BYTE_PTR pData, CK_ULONG ulDataLen)
@@ -185,7 +212,7 @@ sc_pkcs11_md_update(struct sc_pkcs11_session *session,
 	if (rv != CKR_OK)
 		goto done;
 
-	rv = op->type->md_update(op, pData, ulDataLen);
+	rv = sc_pkcs11_operation_update(op, SC_PKCS11_OPERATION_DIGEST, pData, ulDataLen);
 
 done:
 	if (rv != CKR_OK)
@@ -270,14 +297,7 @@ sc_pkcs11_sign_update(struct sc_pkcs11_session *session,
 	if (rv != CKR_OK)
 		return rv;
 
-	if (op->type->sign_update == NULL) {
-		rv = CKR_KEY_TYPE_INCONSISTENT;
-		goto done;
-	}
-
-	rv = op->type->sign_update(op, pData, ulDataLen);
-
-done:
+	rv = sc_pkcs11_operation_update(op, SC_PKCS11_OPERATION_SIGN, pData, ulDataLen);
 	if (rv != CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
 
@@ -533,14 +553,7 @@ sc_pkcs11_verif_update(struct sc_pkcs11_session *session,
 	if (rv != CKR_OK)
 		return rv;
 
-	if (op->type->verif_update == NULL) {
-		rv = CKR_KEY_TYPE_INCONSISTENT;
-		goto done;
-	}
-
-	rv = op->type->verif_update(op, pData, ulDataLen);
-
-done:
+	rv = sc_pkcs11_operation_update(op, SC_PKCS11_OPERATION_VERIFY, pData, ulDataLen);
 	if (rv != CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_VERIFY);
 
@@ -651,6 +664,12 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 		return CKR_ARGUMENTS_BAD;
 
 	key = data->key;
+	/* Reuse the key parsed by an earlier verification */
+	if (key->verify_key != NULL)
+		return sc_pkcs11_verify_data_key(key->verify_key,
+			operation->mechanism.mechanism, data->md,
+			data->buffer, data->buffer_len, pSignature, ulSignatureLen);
+
 	rv = key->ops->get_attribute(operation->session, key, &attr);
 	if (rv != CKR_OK)
 		return rv;
@@ -670,7 +689,8 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 	rv = sc_pkcs11_verify_data(pubkey_value, attr.ulValueLen,
 		params, sizeof(params),
 		operation->mechanism.mechanism, data->md,
-		data->buffer, data->buffer_len, pSignature, ulSignatureLen);
+		data->buffer, data->buffer_len, pSignature, ulSignatureLen,
+		&key->verify_key);
 
 done:
 	free(pubkey_value);
@@ -138,7 +138,7 @@ CK_RV session_start_operation(struct sc_pkcs11_session * session,
 	if (type < 0 || type >= SC_PKCS11_OPERATION_MAX)
 		return CKR_ARGUMENTS_BAD;
 
-	if (session->operation[type] != NULL)
+	if (session->operation[type] != NULL || (session->taken & (1 << type)))
 		return CKR_OPERATION_ACTIVE;
 
 	if (!(op = sc_pkcs11_new_operation(session, mech)))
@@ -160,6 +160,10 @@ CK_RV session_get_operation(struct sc_pkcs11_session * session, int type, sc_pkc
 	if (type < 0 || type >= SC_PKCS11_OPERATION_MAX)
 		return CKR_ARGUMENTS_BAD;
 
+	/* Another thread is working on it */
+	if (session->taken & (1 << type))
+		return CKR_OPERATION_ACTIVE;
+
 	if (!(op = session->operation[type]))
 		return CKR_OPERATION_NOT_INITIALIZED;
 
@@ -279,6 +283,131 @@ CK_RV attr_find_var(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_ULONG type,
 	return attr_extract(pTemplate, ptr, sizep);
 }
 
+/*
+ * Handle tables.
+ *
+ * A handle is the index of its entry (plus one, so that 0 is never a
+ * valid handle) in the low bits, and the generation of that entry in
+ * the high bits. Entries are reused once freed, but their generation
+ * is bumped so stale handles are rejected instead of resolving to a
+ * different object.
+ */
+#define HANDLE_INDEX_BITS	16
+#define HANDLE_INDEX_MASK	((1UL << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GEN_MASK		0x7FFFUL
+#define HANDLE_MAX_ENTRIES	HANDLE_INDEX_MASK
+
+void sc_pkcs11_handle_table_init(struct sc_pkcs11_handle_table *table)
+{
+	memset(table, 0, sizeof(*table));
+}
+
+void sc_pkcs11_handle_table_free(struct sc_pkcs11_handle_table *table)
+{
+	if (table->entries)
+		free(table->entries);
+	if (table->generations)
+		free(table->generations);
+	if (table->free_list)
+		free(table->free_list);
+	memset(table, 0, sizeof(*table));
+}
+
+CK_RV sc_pkcs11_handle_add(struct sc_pkcs11_handle_table *table, void *ptr, CK_ULONG *handle)
+{
+	unsigned int idx;
+
+	if (ptr == NULL || handle == NULL)
+		return CKR_ARGUMENTS_BAD;
+
+	if (table->nfree > 0) {
+		idx = table->free_list[--table->nfree];
+	} else {
+		if (table->count == table->size) {
+			unsigned int size = table->size ? 2 * table->size : 16;
+			void **entries;
+			unsigned int *generations, *free_list;
+
+			if (table->size >= HANDLE_MAX_ENTRIES)
+				return CKR_HOST_MEMORY;
+			if (size > HANDLE_MAX_ENTRIES)
+				size = HANDLE_MAX_ENTRIES;
+
+			entries = realloc(table->entries, size * sizeof(void *));
+			if (entries == NULL)
+				return CKR_HOST_MEMORY;
+			table->entries = entries;
+			generations = realloc(table->generations, size * sizeof(unsigned int));
+			if (generations == NULL)
+				return CKR_HOST_MEMORY;
+			table->generations = generations;
+			free_list = realloc(table->free_list, size * sizeof(unsigned int));
+			if (free_list == NULL)
+				return CKR_HOST_MEMORY;
+			table->free_list = free_list;
+			table->size = size;
+		}
+		idx = table->count++;
+		table->generations[idx] = 1;
+	}
+
+	table->entries[idx] = ptr;
+	*handle = ((CK_ULONG) table->generations[idx] << HANDLE_INDEX_BITS) | (idx + 1);
+	return CKR_OK;
+}
+
+void *sc_pkcs11_handle_get(struct sc_pkcs11_handle_table *table, CK_ULONG handle)
+{
+	CK_ULONG idx = handle & HANDLE_INDEX_MASK;
+
+	if (idx == 0 || idx > table->count)
+		return NULL;
+	idx--;
+	if ((CK_ULONG) table->generations[idx] != (handle >> HANDLE_INDEX_BITS))
+		return NULL;
+	return table->entries[idx];
+}
+
+/* Release all entries; handles handed out so far stay invalid */
+void sc_pkcs11_handle_table_clear(struct sc_pkcs11_handle_table *table)
+{
+	CK_ULONG handle;
+	unsigned int i;
+
+	for (i = 0; i < table->count; i++) {
+		if (sc_pkcs11_handle_at(table, i, &handle) != NULL)
+			sc_pkcs11_handle_remove(table, handle);
+	}
+}
+
+/* Return the idx'th entry, for walking a table in insertion order.
+ * Released entries are returned as NULL. */
+void *sc_pkcs11_handle_at(struct sc_pkcs11_handle_table *table, unsigned int idx, CK_ULONG *handle)
+{
+	if (idx >= table->count)
+		return NULL;
+	if (handle != NULL)
+		*handle = ((CK_ULONG) table->generations[idx] << HANDLE_INDEX_BITS) | (idx + 1);
+	return table->entries[idx];
+}
+
+void *sc_pkcs11_handle_remove(struct sc_pkcs11_handle_table *table, CK_ULONG handle)
+{
+	void *ptr = sc_pkcs11_handle_get(table, handle);
+	unsigned int idx;
+
+	if (ptr == NULL)
+		return NULL;
+
+	idx = (unsigned int) (handle & HANDLE_INDEX_MASK) - 1;
+	table->entries[idx] = NULL;
+	table->generations[idx] = (table->generations[idx] + 1) & HANDLE_GEN_MASK;
+	if (table->generations[idx] == 0)
+		table->generations[idx] = 1;
+	table->free_list[table->nfree++] = idx;
+	return ptr;
+}
+
 void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 {
 	scconf_block *conf_block = NULL;
@@ -293,6 +422,9 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	conf->pin_unblock_style = SC_PKCS11_PIN_UNBLOCK_NOT_ALLOWED;
 	conf->create_puk_slot = 0;
 	conf->zero_ckaid_for_ca_certs = 0;
+	conf->parallel_card_detection = 1;
+	conf->slot_monitor = 1;
+	conf->sign_queue = 1;
 
 	conf_block = sc_get_conf_block(ctx, "pkcs11", NULL, 1);
 	if (!conf_block)
@@ -315,10 +447,15 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	
 	conf->create_puk_slot = scconf_get_bool(conf_block, "create_puk_slot", conf->create_puk_slot);
 	conf->zero_ckaid_for_ca_certs = scconf_get_bool(conf_block, "zero_ckaid_for_ca_certs", conf->zero_ckaid_for_ca_certs);
+	conf->parallel_card_detection = scconf_get_bool(conf_block, "parallel_card_detection", conf->parallel_card_detection);
+	conf->slot_monitor = scconf_get_bool(conf_block, "slot_monitor", conf->slot_monitor);
+	conf->sign_queue = scconf_get_bool(conf_block, "sign_queue", conf->sign_queue);
 
 	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "PKCS#11 options: plug_and_play=%d max_virtual_slots=%d slots_per_card=%d "
-		 "hide_empty_tokens=%d lock_login=%d pin_unblock_style=%d zero_ckaid_for_ca_certs=%d",
+		 "hide_empty_tokens=%d lock_login=%d pin_unblock_style=%d zero_ckaid_for_ca_certs=%d "
+		 "parallel_card_detection=%d slot_monitor=%d sign_queue=%d",
 		 conf->plug_and_play, conf->max_virtual_slots, conf->slots_per_card,
 		 conf->hide_empty_tokens, conf->lock_login, conf->pin_unblock_style,
-		 conf->zero_ckaid_for_ca_certs);
+		 conf->zero_ckaid_for_ca_certs, conf->parallel_card_detection,
+		 conf->slot_monitor, conf->sign_queue);
 }
@@ -190,9 +190,17 @@ void
 sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *card)
 {
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_ENGINE)
+	static int engine_loaded = 0;
 	void (*locking_cb)(int, int, const char *, int);
 	ENGINE *e;
 
+	/* The engine is set up once; cards in several readers may be
+	 * bound at the same time (see card_detect_all()) */
+	sc_pkcs11_lock_tables();
+	if (engine_loaded)
+		goto engine_done;
+	engine_loaded = 1;
+
 	locking_cb = CRYPTO_get_locking_callback();
 	if (locking_cb)
 		CRYPTO_set_locking_callback(NULL);
@@ -224,6 +232,8 @@ sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *card)
 
 	if (locking_cb)
 		CRYPTO_set_locking_callback(locking_cb);
+engine_done:
+	sc_pkcs11_unlock_tables();
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_ENGINE) */
 
 	openssl_sha1_mech.mech_data = EVP_sha1();
@@ -393,37 +403,23 @@ static CK_RV gostr3410_verify_data(const unsigned char *pubkey, int pubkey_len,
  * If a hash function was used, we can make a big shortcut by
  *   finishing with EVP_VerifyFinal().
  */
-CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
-			const unsigned char *pubkey_params, int pubkey_params_len,
+/*
+ * Verify a signature with an already parsed RSA public key
+ * (see sc_pkcs11_verify_data). The key is not modified.
+ */
+CK_RV sc_pkcs11_verify_data_key(void *key,
 			CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 			unsigned char *data, int data_len,
 			unsigned char *signat, int signat_len)
 {
 	int res;
 	CK_RV rv = CKR_GENERAL_ERROR;
-	EVP_PKEY *pkey;
-
-	if (mech == CKM_GOSTR3410)
-	{
-#if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
-		return gostr3410_verify_data(pubkey, pubkey_len,
-				pubkey_params, pubkey_params_len,
-				data, data_len, signat, signat_len);
-#else
-		(void)pubkey_params, (void)pubkey_params_len; /* no warning */
-		return CKR_FUNCTION_NOT_SUPPORTED;
-#endif
-	}
-
-	pkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &pubkey, pubkey_len);
-	if (pkey == NULL)
-		return CKR_GENERAL_ERROR;
+	EVP_PKEY *pkey = (EVP_PKEY *) key;
 
 	if (md != NULL) {
 		EVP_MD_CTX *md_ctx = DIGEST_CTX(md);
 
 		res = EVP_VerifyFinal(md_ctx, signat, signat_len, pkey);
-		EVP_PKEY_free(pkey);
 		if (res == 1)
 			return CKR_OK;
 		else if (res == 0)
@@ -446,12 +442,10 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 		 	pad = RSA_NO_PADDING;
 		 	break;
 		 default:
-			EVP_PKEY_free(pkey);
 		 	return CKR_ARGUMENTS_BAD;
 		 }
 
 		rsa = EVP_PKEY_get1_RSA(pkey);
-		EVP_PKEY_free(pkey);
 		if (rsa == NULL)
 			return CKR_DEVICE_MEMORY;
 
@@ -479,4 +473,52 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 
 	return rv;
 }
+
+/*
+ * Parse the DER encoded public key and verify the signature with it.
+ * If pkey_cache is not NULL, the parsed RSA key is stored there instead
+ * of being freed, so that later calls can use sc_pkcs11_verify_data_key()
+ * directly. Release it with sc_pkcs11_free_verify_key().
+ */
+CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
+			const unsigned char *pubkey_params, int pubkey_params_len,
+			CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
+			unsigned char *data, int data_len,
+			unsigned char *signat, int signat_len,
+			void **pkey_cache)
+{
+	CK_RV rv;
+	EVP_PKEY *pkey;
+
+	if (mech == CKM_GOSTR3410)
+	{
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
+		return gostr3410_verify_data(pubkey, pubkey_len,
+				pubkey_params, pubkey_params_len,
+				data, data_len, signat, signat_len);
+#else
+		(void)pubkey_params, (void)pubkey_params_len; /* no warning */
+		return CKR_FUNCTION_NOT_SUPPORTED;
+#endif
+	}
+
+	pkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &pubkey, pubkey_len);
+	if (pkey == NULL)
+		return CKR_GENERAL_ERROR;
+
+	rv = sc_pkcs11_verify_data_key(pkey, mech, md,
+			data, data_len, signat, signat_len);
+
+	if (pkey_cache != NULL && *pkey_cache == NULL)
+		*pkey_cache = pkey;
+	else
+		EVP_PKEY_free(pkey);
+	return rv;
+}
+
+void sc_pkcs11_free_verify_key(void *key)
+{
+	if (key != NULL)
+		EVP_PKEY_free((EVP_PKEY *) key);
+}
 #endif
@@ -25,13 +25,19 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
 
 #include "sc-pkcs11.h"
 
 sc_context_t *context = NULL;
 struct sc_pkcs11_config sc_pkcs11_conf;
-list_t sessions;
+struct sc_pkcs11_handle_table sessions;
 list_t virtual_slots;
+struct sc_pkcs11_handle_table slot_table; /* Slots indexed by list position */
 #if !defined(_WIN32)
 pid_t initialized_pid = (pid_t)-1;
 #endif
@@ -39,7 +45,6 @@ static int in_finalize = 0;
 extern CK_FUNCTION_LIST pkcs11_function_list;
 
 #if defined(HAVE_PTHREAD) && defined(PKCS11_THREAD_LOCKING)
-#include <pthread.h>
 CK_RV mutex_create(void **mutex)
 {
 	pthread_mutex_t *m = malloc(sizeof(*mutex));
@@ -114,6 +119,8 @@ static CK_C_INITIALIZE_ARGS _def_locks = {
 
 static CK_C_INITIALIZE_ARGS_PTR	global_locking;
 static void *			global_lock = NULL;
+static void *			table_lock = NULL;
+static int			no_os_threads = 0;
 #if (defined(HAVE_PTHREAD) || defined(_WIN32)) && defined(PKCS11_THREAD_LOCKING)
 #define HAVE_OS_LOCKING
 static CK_C_INITIALIZE_ARGS_PTR default_mutex_funcs = &_def_locks;
@@ -168,23 +175,6 @@ static sc_thread_context_t sc_thread_ctx = {
 	sc_unlock_mutex, sc_destroy_mutex, NULL
 };
 
-/* simclist helpers to locate interesting objects by ID */
-static int session_list_seeker(const void *el, const void *key) {
-	const struct sc_pkcs11_session *session = (struct sc_pkcs11_session *)el;
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (session->handle == *(CK_SESSION_HANDLE*)key)
-		return 1;
-	return 0;
-}
-static int slot_list_seeker(const void *el, const void *key) {
-	const struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *)el;
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (slot->id == *(CK_SLOT_ID *)key)
-		return 1;
-	return 0;
-}
 
 
 
@@ -231,13 +221,12 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	/* Load configuration */
 	load_pkcs11_parameters(&sc_pkcs11_conf, context);
 
-	/* List of sessions */
-	list_init(&sessions);
-	list_attributes_seeker(&sessions, session_list_seeker);
+	/* Table of sessions */
+	sc_pkcs11_handle_table_init(&sessions);
 	
 	/* List of slots */
 	list_init(&virtual_slots);
-	list_attributes_seeker(&virtual_slots, slot_list_seeker);
+	sc_pkcs11_handle_table_init(&slot_table);
 	
 	/* Create a slot for a future "PnP" stuff. */
 	if (sc_pkcs11_conf.plug_and_play) {
@@ -247,13 +236,16 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	for (i=0; i<sc_ctx_get_reader_count(context); i++) {
 		initialize_reader(sc_ctx_get_reader(context, i));
 	}
+	card_detect_all();
 
 	/* Set initial event state on slots */
 	for (i=0; i<list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) sc_pkcs11_handle_at(&slot_table, i, NULL);
 		slot->events = 0; /* Initially there are no events */
 	}
 
+	slot_monitor_start();
+
 out:	
 	if (context != NULL)
 		sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Initialize() = %s", lookup_enum ( RV_T, rv ));
@@ -291,20 +283,31 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	
 	/* cancel pending calls */
 	in_finalize = 1;
+	slot_monitor_stop();
 	sc_cancel(context);
 	/* remove all cards from readers */
 	for (i=0; i < (int)sc_ctx_get_reader_count(context); i++)
 		card_removed(sc_ctx_get_reader(context, i));
 
-	while ((p = list_fetch(&sessions)))
-		free(p);
-	list_destroy(&sessions);
+	for (i = 0; i < (int)sessions.count; i++) {
+		p = sc_pkcs11_handle_at(&sessions, i, NULL);
+		if (p != NULL)
+			free(p);
+	}
+	sc_pkcs11_handle_table_free(&sessions);
 
 	while ((slot = list_fetch(&virtual_slots))) {
 		list_destroy(&slot->objects);
+		slot_index_clear(slot);
+		sc_pkcs11_handle_table_free(&slot->object_handles);
+		if (slot->lock_owner) {
+			sign_queue_free(slot->sign_queue);
+			sc_pkcs11_mutex_destroy(slot->lock);
+		}
 		free(slot);
 	}
 	list_destroy(&virtual_slots);
+	sc_pkcs11_handle_table_free(&slot_table);
 
 	sc_release_context(context);
 	context = NULL;
@@ -322,9 +325,8 @@ CK_RV C_GetInfo(CK_INFO_PTR pInfo)
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
+	if (context == NULL)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetInfo()");
 
@@ -340,7 +342,6 @@ CK_RV C_GetInfo(CK_INFO_PTR pInfo)
 	pInfo->libraryVersion.major = 0;
 	pInfo->libraryVersion.minor = 0; /* FIXME: use 0.116 for 0.11.6 from autoconf */
 
-	sc_pkcs11_unlock();
 	return rv;
 }	
 
@@ -377,16 +378,22 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 	/* Slot list can only change in v2.20 */
 	if (pSlotList == NULL_PTR && sc_pkcs11_conf.plug_and_play) {
 		/* Trick NSS into updating the slot list by changing the hotplug slot ID */
-		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
+		sc_pkcs11_slot_t *hotplug_slot;
+
+		sc_pkcs11_lock_tables();
+		hotplug_slot = sc_pkcs11_handle_at(&slot_table, 0, NULL);
 		hotplug_slot->id--;
+		sc_pkcs11_unlock_tables();
 		sc_ctx_detect_readers(context); 
 	}
 
-	card_detect_all();
+	slot_update_all();
 
+	sc_pkcs11_lock_tables();
 	found = malloc(list_size(&virtual_slots) * sizeof(CK_SLOT_ID));
 
 	if (found == NULL) {
+		sc_pkcs11_unlock_tables();
 		rv = CKR_HOST_MEMORY;
 		goto out;
 	}
@@ -394,7 +401,7 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 	prev_reader = NULL;
 	numMatches = 0;
 	for (i=0; i<list_size(&virtual_slots); i++) {
-	        slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+	        slot = (sc_pkcs11_slot_t *) sc_pkcs11_handle_at(&slot_table, i, NULL);
 		/* the list of available slots contains:
 		 * - if present, virtual hotplug slot;
 		 * - any slot with token;
@@ -406,6 +413,7 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 			found[numMatches++] = slot->id;
 		prev_reader = slot->reader;
 	}
+	sc_pkcs11_unlock_tables();
 
 	if (pSlotList == NULL_PTR) {
 		sc_debug(context, SC_LOG_DEBUG_NORMAL, "was only a size inquiry (%d)\n", numMatches);
@@ -436,7 +444,7 @@ out:
 	return rv;
 }
 
-static sc_timestamp_t get_current_time(void)
+sc_timestamp_t get_current_time(void)
 {
 #if HAVE_GETTIMEOFDAY
 	struct timeval tv;
@@ -465,24 +473,23 @@ static sc_timestamp_t get_current_time(void)
 
 CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 {
-	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_slot *slot = NULL;
 	sc_timestamp_t now;
 	CK_RV rv;
 
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
+	if (context == NULL)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetSlotInfo(0x%lx)", slotID);
 
-	rv = slot_get_slot(slotID, &slot);
+	rv = slot_lock(slotID, &slot);
 	if (rv == CKR_OK){
 		if (slot->reader == NULL)
 			rv = CKR_TOKEN_NOT_PRESENT;
-		else {
+		else if (!slot_monitor_running()) {
 			now = get_current_time();
 			if (now >= slot->slot_state_expires || now == 0) {
 				/* Update slot status */
@@ -491,6 +498,8 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 				slot->slot_state_expires = now + 1000;
 			}
 		}
+		else
+			rv = slot_redetect(slot);
 	}
 	if (rv == CKR_TOKEN_NOT_PRESENT || rv == CKR_TOKEN_NOT_RECOGNIZED)
 		rv = CKR_OK;
@@ -499,7 +508,7 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 		memcpy(pInfo, &slot->slot_info, sizeof(CK_SLOT_INFO));
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetSlotInfo(0x%lx) = %s", slotID, lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	slot_unlock(slot);
 	return rv;
 }
 
@@ -507,21 +516,17 @@ CK_RV C_GetMechanismList(CK_SLOT_ID slotID,
 			 CK_MECHANISM_TYPE_PTR pMechanismList,
                          CK_ULONG_PTR pulCount)
 {
-	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_slot *slot = NULL;
 	CK_RV rv;
 
 	if (pulCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = slot_get_token(slotID, &slot);
+	rv = slot_lock_token(slotID, &slot);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_get_mechanism_list(slot->card, pMechanismList, pulCount);
 
-	sc_pkcs11_unlock();
+	slot_unlock(slot);
 	return rv;
 }
 
@@ -529,21 +534,17 @@ CK_RV C_GetMechanismInfo(CK_SLOT_ID slotID,
 			 CK_MECHANISM_TYPE type,
 			 CK_MECHANISM_INFO_PTR pInfo)
 {
-	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_slot *slot = NULL;
 	CK_RV rv;
 
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = slot_get_token(slotID, &slot);
+	rv = slot_lock_token(slotID, &slot);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_get_mechanism_info(slot->card, type, pInfo);
 
-	sc_pkcs11_unlock();
+	slot_unlock(slot);
 	return rv;
 }
 
@@ -553,26 +554,26 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 		  CK_CHAR_PTR pLabel)
 {
 	struct sc_pkcs11_session *session;
-	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_slot *slot = NULL;
 	CK_RV rv;
 	unsigned int i;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = slot_get_token(slotID, &slot);
+	rv = slot_lock_token(slotID, &slot);
 	if (rv != CKR_OK)
 		goto out;
 	
 	/* Make sure there's no open session for this token */
-	for (i=0; i<list_size(&sessions); i++) {
-		session = (struct sc_pkcs11_session*)list_get_at(&sessions, i);
-		if (session->slot == slot) {
+	sc_pkcs11_lock_tables();
+	for (i=0; i<sessions.count; i++) {
+		session = (struct sc_pkcs11_session*)sc_pkcs11_handle_at(&sessions, i, NULL);
+		if (session != NULL && session->slot == slot) {
 			rv = CKR_SESSION_EXISTS;
-			goto out;
+			break;
 		}
 	}
+	sc_pkcs11_unlock_tables();
+	if (rv != CKR_OK)
+		goto out;
 
 	if (slot->card->framework->init_token == NULL) {
 		rv = CKR_FUNCTION_NOT_SUPPORTED;
@@ -586,7 +587,7 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 		 * corresponding function vector and flags */
 	}
 
-out:	sc_pkcs11_unlock();
+out:	slot_unlock(slot);
 	return rv;
 }
 
@@ -594,20 +595,19 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 			 CK_SLOT_ID_PTR pSlot,  /* location that receives the slot ID */
 			 CK_VOID_PTR pReserved) /* reserved.  Should be NULL_PTR */
 {
-	sc_reader_t *found;
-	unsigned int mask, events;
-	void *reader_states = NULL;
+	struct sc_pkcs11_slot *slot;
+	unsigned int mask;
+	unsigned long count;
 	CK_SLOT_ID slot_id;
 	CK_RV rv;
-	int r;
-	
+
 	if (pReserved != NULL_PTR)
 		return  CKR_ARGUMENTS_BAD;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_WaitForSlotEvent(block=%d)", !(flags & CKF_DONT_BLOCK));
-	/* Not all pcsc-lite versions implement consistently used functions as they are */
-	/* FIXME: add proper checking into build to check correct pcsc-lite version for SCardStatusChange/SCardCancel */
-	if (!(flags & CKF_DONT_BLOCK))
+	/* Blocking calls wait for the slot monitor, which only runs if
+	 * the reader driver can wait for events and we may create threads */
+	if (!(flags & CKF_DONT_BLOCK) && !slot_monitor_running())
 		return CKR_FUNCTION_NOT_SUPPORTED;
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
@@ -620,56 +620,35 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 		mask |= SC_EVENT_READER_EVENTS;
 	}
 
+	/* Read the counter first, so no change is missed while we look */
+	count = slot_monitor_count();
 	rv = slot_find_changed(&slot_id, mask);
-	if ((rv == CKR_OK) || (flags & CKF_DONT_BLOCK))
-		goto out;
-
-again:
-	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_WaitForSlotEvent() reader_states:%p", reader_states);
-	sc_pkcs11_unlock();
-	r = sc_wait_for_event(context, mask, &found, &events, -1, &reader_states);
-	if (sc_pkcs11_conf.plug_and_play && events & SC_EVENT_READER_ATTACHED) {
-		/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
-		   Change the first hotplug slot id on every call to make this happen. */
-		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
-		*pSlot= hotplug_slot->id -1;
-	
-		rv = sc_pkcs11_lock();
-		if (rv != CKR_OK)
+	while (rv == CKR_NO_EVENT && !(flags & CKF_DONT_BLOCK)) {
+		sc_pkcs11_unlock();
+		slot_monitor_wait(count);
+
+		/* Was C_Finalize called ? */
+		if (in_finalize == 1)
+			return CKR_CRYPTOKI_NOT_INITIALIZED;
+		if ((rv = sc_pkcs11_lock()) != CKR_OK)
 			return rv;
-
-		goto out;
-	}
-	/* Was C_Finalize called ? */
-	if (in_finalize == 1)
-		return CKR_CRYPTOKI_NOT_INITIALIZED;
-
-	if ((rv = sc_pkcs11_lock()) != CKR_OK)
-		return rv;
-
-	if (r != SC_SUCCESS) {
-		sc_debug(context, SC_LOG_DEBUG_NORMAL, "sc_wait_for_event() returned %d\n",  r);
-		rv = sc_to_cryptoki_error(r, "C_WaitForSlotEvent");
-		goto out;
+		if (!slot_monitor_running()) {
+			rv = CKR_FUNCTION_NOT_SUPPORTED;
+			break;
+		}
+		count = slot_monitor_count();
+		rv = slot_find_changed(&slot_id, mask);
 	}
 
-	/* If no changed slot was found (maybe an unsupported card
-	 * was inserted/removed) then go waiting again */
-	rv = slot_find_changed(&slot_id, mask);
-	if (rv != CKR_OK)
-		goto again;
-
-out:	
-	if (pSlot)
+	if (rv == CKR_OK && pSlot) {
+		/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
+		   Change the first hotplug slot id on every call to make this happen. */
+		if (slot_get_slot(slot_id, &slot) == CKR_OK && slot->reader == NULL)
+			slot_id = slot->id - 1;
 		*pSlot = slot_id;
-
-	/* Free allocated readers states holder */
-	if (reader_states)   {
-		sc_debug(context, SC_LOG_DEBUG_NORMAL, "free reader states");
-		sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
 	}
 
-	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_WaitForSlotEvent() = %s, event in 0x%lx", lookup_enum (RV_T, rv), *pSlot);
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_WaitForSlotEvent() = %s", lookup_enum (RV_T, rv));
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -706,6 +685,7 @@ sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR args)
 	if ((args->flags & CKF_OS_LOCKING_OK)) {
 		oslock = 1;
 	}
+	no_os_threads = (args->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS) ? 1 : 0;
 
 	/* Based on PKCS#11 v2.11 11.4 */
 	if (applock && oslock) {
@@ -725,6 +705,8 @@ sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR args)
 	if (global_locking != NULL) {
 		/* create mutex */
 		rv = global_locking->CreateMutex(&global_lock);
+		if (rv == CKR_OK)
+			rv = global_locking->CreateMutex(&table_lock);
 	}
 
 	return rv;
@@ -781,9 +763,265 @@ void sc_pkcs11_free_lock(void)
 	 * all changed data to RAM */
 	__sc_pkcs11_unlock(tempLock);
 
-	if (global_locking)
+	if (global_locking) {
 		global_locking->DestroyMutex(tempLock);
+		if (table_lock)
+			global_locking->DestroyMutex(table_lock);
+	}
+	table_lock = NULL;
 	global_locking = NULL;
+	no_os_threads = 0;
+}
+
+/*
+ * The table lock protects the session and slot lists. It is only
+ * held for list lookups and updates, never across card operations.
+ */
+void sc_pkcs11_lock_tables(void)
+{
+	sc_pkcs11_mutex_lock(table_lock);
+}
+
+void sc_pkcs11_unlock_tables(void)
+{
+	sc_pkcs11_mutex_unlock(table_lock);
+}
+
+/*
+ * Additional mutexes (slot locks) created with the same
+ * primitives as the global lock. Without locking they are NULL.
+ */
+CK_RV sc_pkcs11_mutex_create(void **mutex)
+{
+	*mutex = NULL;
+	if (global_locking == NULL)
+		return CKR_OK;
+	return global_locking->CreateMutex(mutex);
+}
+
+void sc_pkcs11_mutex_lock(void *mutex)
+{
+	if (!mutex || !global_locking)
+		return;
+	while (global_locking->LockMutex(mutex) != CKR_OK)
+		;
+}
+
+void sc_pkcs11_mutex_unlock(void *mutex)
+{
+	__sc_pkcs11_unlock(mutex);
+}
+
+void sc_pkcs11_mutex_destroy(void *mutex)
+{
+	if (mutex && global_locking)
+		global_locking->DestroyMutex(mutex);
+}
+
+/*
+ * Worker threads. They are only available when the module is
+ * initialized with locking and the application has not told us (with
+ * CKF_LIBRARY_CANT_CREATE_OS_THREADS) to stay away from OS threads.
+ */
+struct sc_pkcs11_thread {
+	void (*func)(void *);
+	void *arg;
+#if defined(HAVE_PTHREAD)
+	pthread_t thread;
+#elif defined(_WIN32)
+	HANDLE thread;
+#endif
+};
+
+#if defined(HAVE_PTHREAD)
+static void * thread_start(void *p)
+{
+	struct sc_pkcs11_thread *t = (struct sc_pkcs11_thread *) p;
+
+	t->func(t->arg);
+	return NULL;
+}
+#elif defined(_WIN32)
+static DWORD WINAPI thread_start(LPVOID p)
+{
+	struct sc_pkcs11_thread *t = (struct sc_pkcs11_thread *) p;
+
+	t->func(t->arg);
+	return 0;
+}
+#endif
+
+int sc_pkcs11_can_create_threads(void)
+{
+#if defined(HAVE_PTHREAD) || defined(_WIN32)
+	return global_locking != NULL && !no_os_threads;
+#else
+	return 0;
+#endif
+}
+
+CK_RV sc_pkcs11_thread_create(void **thread, void (*func)(void *), void *arg)
+{
+	struct sc_pkcs11_thread *t;
+
+	*thread = NULL;
+	if (!sc_pkcs11_can_create_threads())
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	t = (struct sc_pkcs11_thread *) calloc(1, sizeof(*t));
+	if (t == NULL)
+		return CKR_HOST_MEMORY;
+	t->func = func;
+	t->arg = arg;
+#if defined(HAVE_PTHREAD)
+	if (pthread_create(&t->thread, NULL, thread_start, t) != 0) {
+		free(t);
+		return CKR_GENERAL_ERROR;
+	}
+#elif defined(_WIN32)
+	t->thread = CreateThread(NULL, 0, thread_start, t, 0, NULL);
+	if (t->thread == NULL) {
+		free(t);
+		return CKR_GENERAL_ERROR;
+	}
+#endif
+	*thread = t;
+	return CKR_OK;
+}
+
+/* Wait for the thread to finish and release it */
+void sc_pkcs11_thread_join(void *thread)
+{
+	struct sc_pkcs11_thread *t = (struct sc_pkcs11_thread *) thread;
+
+	if (t == NULL)
+		return;
+#if defined(HAVE_PTHREAD)
+	pthread_join(t->thread, NULL);
+#elif defined(_WIN32)
+	WaitForSingleObject(t->thread, INFINITE);
+	CloseHandle(t->thread);
+#endif
+	free(t);
+}
+
+/* Release a thread that does not exist any more in this process,
+ * i.e. one started before fork() */
+void sc_pkcs11_thread_forget(void *thread)
+{
+	free(thread);
+}
+
+/*
+ * Events: a counter that is increased by every signal. A thread that
+ * read the counter can wait until it changes, without missing a signal
+ * that was sent in between. Unlike the mutexes these always use the OS
+ * primitives, as the PKCS #11 locking functions have no equivalent.
+ */
+struct sc_pkcs11_event {
+	unsigned long count;
+#if defined(HAVE_PTHREAD)
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#elif defined(_WIN32)
+	CRITICAL_SECTION mutex;
+	CONDITION_VARIABLE cond;
+#endif
+};
+
+CK_RV sc_pkcs11_event_create(void **event)
+{
+	struct sc_pkcs11_event *e;
+
+	*event = NULL;
+	if (!sc_pkcs11_can_create_threads())
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	e = (struct sc_pkcs11_event *) calloc(1, sizeof(*e));
+	if (e == NULL)
+		return CKR_HOST_MEMORY;
+#if defined(HAVE_PTHREAD)
+	pthread_mutex_init(&e->mutex, NULL);
+	pthread_cond_init(&e->cond, NULL);
+#elif defined(_WIN32)
+	InitializeCriticalSection(&e->mutex);
+	InitializeConditionVariable(&e->cond);
+#endif
+	*event = e;
+	return CKR_OK;
+}
+
+unsigned long sc_pkcs11_event_count(void *event)
+{
+	struct sc_pkcs11_event *e = (struct sc_pkcs11_event *) event;
+	unsigned long count = 0;
+
+	if (e == NULL)
+		return 0;
+#if defined(HAVE_PTHREAD)
+	pthread_mutex_lock(&e->mutex);
+	count = e->count;
+	pthread_mutex_unlock(&e->mutex);
+#elif defined(_WIN32)
+	EnterCriticalSection(&e->mutex);
+	count = e->count;
+	LeaveCriticalSection(&e->mutex);
+#endif
+	return count;
+}
+
+/* Wake up all threads waiting for the event */
+void sc_pkcs11_event_signal(void *event)
+{
+	struct sc_pkcs11_event *e = (struct sc_pkcs11_event *) event;
+
+	if (e == NULL)
+		return;
+#if defined(HAVE_PTHREAD)
+	pthread_mutex_lock(&e->mutex);
+	e->count++;
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->mutex);
+#elif defined(_WIN32)
+	EnterCriticalSection(&e->mutex);
+	e->count++;
+	WakeAllConditionVariable(&e->cond);
+	LeaveCriticalSection(&e->mutex);
+#endif
+}
+
+/* Wait until the event was signalled after its counter was 'count' */
+void sc_pkcs11_event_wait(void *event, unsigned long count)
+{
+	struct sc_pkcs11_event *e = (struct sc_pkcs11_event *) event;
+
+	if (e == NULL)
+		return;
+#if defined(HAVE_PTHREAD)
+	pthread_mutex_lock(&e->mutex);
+	while (e->count == count)
+		pthread_cond_wait(&e->cond, &e->mutex);
+	pthread_mutex_unlock(&e->mutex);
+#elif defined(_WIN32)
+	EnterCriticalSection(&e->mutex);
+	while (e->count == count)
+		SleepConditionVariableCS(&e->cond, &e->mutex, INFINITE);
+	LeaveCriticalSection(&e->mutex);
+#endif
+}
+
+void sc_pkcs11_event_destroy(void *event)
+{
+	struct sc_pkcs11_event *e = (struct sc_pkcs11_event *) event;
+
+	if (e == NULL)
+		return;
+#if defined(HAVE_PTHREAD)
+	pthread_cond_destroy(&e->cond);
+	pthread_mutex_destroy(&e->mutex);
+#elif defined(_WIN32)
+	DeleteCriticalSection(&e->mutex);
+#endif
+	free(e);
 }
 
 CK_FUNCTION_LIST pkcs11_function_list = {
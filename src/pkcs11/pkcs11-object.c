@@ -64,20 +64,14 @@ static void sc_find_release(sc_pkcs11_operation_t *operation)
 	}
 }
 
-static CK_RV get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
-				     struct sc_pkcs11_session **session,
+/* Called with the session's slot locked */
+static CK_RV get_object_from_session(struct sc_pkcs11_session *session,
+				     CK_OBJECT_HANDLE hObject,
 				     struct sc_pkcs11_object **object)
 {
-	CK_RV rv;
-	struct sc_pkcs11_session *sess;
-	rv = get_session(hSession, &sess);
-	if (rv != CKR_OK)
-		return rv;
-
-	*object = list_seek(&sess->slot->objects, &hObject);
+	*object = sc_pkcs11_handle_get(&session->slot->object_handles, hObject);
 	if (!*object)
 		return CKR_OBJECT_HANDLE_INVALID;
-	*session = sess;
 	return CKR_OK;
 }
 
@@ -93,7 +87,7 @@ CK_RV C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 	SC_FUNC_CALLED(context, SC_LOG_DEBUG_VERBOSE);
@@ -101,12 +95,6 @@ CK_RV C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_CreateObject()", pTemplate, ulCount);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -119,7 +107,7 @@ CK_RV C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = card->framework->create_object(card, session->slot,
 				pTemplate, ulCount, phObject);
 
-out:	sc_pkcs11_unlock();
+out:	session_unlock(session);
 	SC_FUNC_RETURN(context, SC_LOG_DEBUG_VERBOSE, rv);
 }
 
@@ -139,13 +127,13 @@ CK_RV C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DestroyObject(hSession=0x%lx, hObject=0x%lx)", hSession, hObject);
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -158,8 +146,12 @@ CK_RV C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = CKR_FUNCTION_NOT_SUPPORTED;
 	else
 		rv = object->ops->destroy_object(session, object);
+	if (rv == CKR_OK) {
+		slot_index_remove(session->slot, hObject);
+		sc_pkcs11_handle_remove(&session->slot->object_handles, hObject);
+	}
 
-out:	sc_pkcs11_unlock();
+out:	session_unlock(session);
 	return rv;
 }
 
@@ -193,11 +185,11 @@ CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -233,7 +225,7 @@ CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = %s",
 			hSession, hObject, lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	session_unlock(session);
 	return rv;
 }
 
@@ -250,13 +242,13 @@ CK_RV C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_SetAttributeValue", pTemplate, ulCount);
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -273,9 +265,11 @@ CK_RV C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			if (rv != CKR_OK)
 				break;
 		}
+		if (i > 0)
+			slot_index_update(session->slot, object);
 	}
 
-out:	sc_pkcs11_unlock();
+out:	session_unlock(session);
 	return rv;
 }
 
@@ -286,24 +280,22 @@ CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	CK_BBOOL is_private = TRUE;
 	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
-	int match, hide_private;
+	int match, hide_private, indexed;
 	unsigned int i, j;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
+	CK_OBJECT_HANDLE handle, *candidates = NULL;
+	CK_ULONG num_candidates = 0;
 	struct sc_pkcs11_find_operation *operation;
 	struct sc_pkcs11_slot *slot;
 
 	if (pTemplate == NULL_PTR && ulCount > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_FindObjectsInit(slot = %d)\n", session->slot->id);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_FindObjectsInit()", pTemplate, ulCount);
 
@@ -323,10 +315,22 @@ CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (slot->login_user != CKU_USER && (slot->token_info.flags & CKF_LOGIN_REQUIRED))
 		hide_private = 1;
         
-	/* For each object in token do */
-	for (i=0; i<list_size(&slot->objects); i++) {
-		object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
-		sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object with handle 0x%lx", object->handle);
+	/* Use the slot's object index to skip objects that cannot match */
+	indexed = slot_index_lookup(slot, pTemplate, ulCount, &candidates, &num_candidates) == 0;
+	if (indexed)
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "%lu candidates from object index", num_candidates);
+
+	/* For each candidate object in token do */
+	for (i=0; i < (indexed ? num_candidates : slot->object_handles.count); i++) {
+		if (indexed) {
+			handle = candidates[i];
+			object = (struct sc_pkcs11_object *)sc_pkcs11_handle_get(&slot->object_handles, handle);
+		} else {
+			object = (struct sc_pkcs11_object *)sc_pkcs11_handle_at(&slot->object_handles, i, &handle);
+		}
+		if (object == NULL)
+			continue;
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object with handle 0x%lx", handle);
 
 		/* User not logged in and private object? */ 
 		if (hide_private) {
@@ -335,7 +339,7 @@ CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			if (is_private) {
 				sc_debug(context, SC_LOG_DEBUG_NORMAL,
 					 "Object %d/%d: Private object and not logged in.\n",
-					 slot->id, object->handle);
+					 slot->id, handle);
 				continue;
 			}
 		}
@@ -347,19 +351,19 @@ CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			if (rv == 0) {
 				sc_debug(context, SC_LOG_DEBUG_NORMAL,
 					 "Object %d/%d: Attribute 0x%x does NOT match.\n",
-					 slot->id, object->handle, pTemplate[j].type);
+					 slot->id, handle, pTemplate[j].type);
 				match = 0;
 				break;
 			}
 
 			if (context->debug >= 4) {
 				sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object %d/%d: Attribute 0x%x matches.\n",
-					 slot->id, object->handle, pTemplate[j].type);
+					 slot->id, handle, pTemplate[j].type);
 			}
 		}
 
 		if (match) {
-			sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object %d/%d matches\n", slot->id, object->handle);
+			sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object %d/%d matches\n", slot->id, handle);
 			/* Realloc handles - remove restriction on only 32 matching objects -dee */
 			if (operation->num_handles >= operation->allocated_handles) {
 				operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
@@ -372,14 +376,16 @@ CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 					break;
 				}
 			}
-			operation->handles[operation->num_handles++] = object->handle;
+			operation->handles[operation->num_handles++] = handle;
 		}
 	}
 	rv = CKR_OK;
+	if (candidates != NULL)
+		free(candidates);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "%d matching objects\n", operation->num_handles);
 
-out:	sc_pkcs11_unlock();
+out:	session_unlock(session);
 	return rv;
 }
 
@@ -396,14 +402,10 @@ CK_RV C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (phObject == NULL_PTR || ulMaxObjectCount == 0 || pulObjectCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = session_get_operation(session, SC_PKCS11_OPERATION_FIND,
 				   (sc_pkcs11_operation_t **) & operation);
 	if (rv != CKR_OK)
@@ -421,7 +423,7 @@ CK_RV C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	operation->current_handle += to_return;
 
-out:	sc_pkcs11_unlock();
+out:	session_unlock(session);
 	return rv;
 }
 
@@ -430,19 +432,15 @@ CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE hSession)
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = session_get_operation(session, SC_PKCS11_OPERATION_FIND, NULL);
 	if (rv == CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 
-out:	sc_pkcs11_unlock();
+	session_unlock(session);
 	return rv;
 }
 
@@ -460,17 +458,15 @@ CK_RV C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DigestInit(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_init(session, pMechanism);
+	rv = sc_pkcs11_md_init(session, pMechanism);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DigestInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	session_unlock(session);
 	return rv;
 }
 
@@ -483,21 +479,17 @@ CK_RV C_Digest(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Digest(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = sc_pkcs11_md_update(session, pData, ulDataLen);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
-out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
+	session_unlock(session);
 	return rv;
 }
 
@@ -507,17 +499,20 @@ CK_RV C_DigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* bytes of data to be digested */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_operation *op;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
+	/* Hashing may take long, only this session has to wait for it */
+	rv = session_take_operation(session, SC_PKCS11_OPERATION_DIGEST, &op);
+	if (rv == CKR_OK) {
+		rv = sc_pkcs11_operation_update(op, SC_PKCS11_OPERATION_DIGEST, pPart, ulPartLen);
+		rv = session_put_operation(session, SC_PKCS11_OPERATION_DIGEST, op, rv);
+	}
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DigestUpdate() == %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -534,16 +529,14 @@ CK_RV C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
+	rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DigestFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	session_unlock(session);
 	return rv;
 }
 
@@ -562,11 +555,11 @@ CK_RV C_SignInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -592,7 +585,7 @@ CK_RV C_SignInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_sign_init(session, pMechanism, object, key_type);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_SignInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	session_unlock(session);
 	return rv;
 }
 
@@ -604,15 +597,17 @@ CK_RV C_Sign(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* receives byte count of signature */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_sign_queue *queue;
 	CK_ULONG length;
 
-	rv = sc_pkcs11_lock();
+	rv = sign_queue_enter(hSession, &queue);
 	if (rv != CKR_OK)
 		return rv;
-
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
+	rv = session_lock(hSession, &session);
+	if (rv != CKR_OK) {
+		sign_queue_leave(queue);
+		return rv;
+	}
 
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
@@ -633,7 +628,8 @@ CK_RV C_Sign(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = sc_pkcs11_sign_final(session, pSignature, pulSignatureLen);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Sign() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	session_unlock(session);
+	sign_queue_leave(queue);
 	return rv;
 }
 
@@ -643,17 +639,20 @@ CK_RV C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* count of bytes to be signed */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_operation *op;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
+	/* Hashing may take long, only this session has to wait for it */
+	rv = session_take_operation(session, SC_PKCS11_OPERATION_SIGN, &op);
+	if (rv == CKR_OK) {
+		rv = sc_pkcs11_operation_update(op, SC_PKCS11_OPERATION_SIGN, pPart, ulPartLen);
+		rv = session_put_operation(session, SC_PKCS11_OPERATION_SIGN, op, rv);
+	}
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_SignUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -662,16 +661,18 @@ CK_RV C_SignFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		  CK_ULONG_PTR pulSignatureLen)
 {				/* receives byte count of signature */
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_sign_queue *queue;
 	CK_ULONG length;
 	CK_RV rv;
 
-	rv = sc_pkcs11_lock();
+	rv = sign_queue_enter(hSession, &queue);
 	if (rv != CKR_OK)
 		return rv;
-
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
+	rv = session_lock(hSession, &session);
+	if (rv != CKR_OK) {
+		sign_queue_leave(queue);
+		return rv;
+	}
 
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
@@ -689,7 +690,8 @@ CK_RV C_SignFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_SignFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	session_unlock(session);
+	sign_queue_leave(queue);
 	return rv;
 }
 
@@ -711,11 +713,11 @@ CK_RV C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -745,7 +747,7 @@ CK_RV C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_sign_init(session, pMechanism, object, key_type);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_SignRecoverInit() = %sn", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	session_unlock(session);
 	return rv;
 }
 
@@ -805,11 +807,11 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -835,7 +837,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_decr_init(session, pMechanism, object, key_type);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DecryptInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	session_unlock(session);
 	return rv;
 }
 
@@ -848,17 +850,15 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
+	rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
 				pData, pulDataLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Decrypt() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	session_unlock(session);
 	return rv;
 }
 
@@ -941,17 +941,13 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			|| (pPrivateKeyTemplate == NULL_PTR && ulPrivateKeyAttributeCount > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PrivKey attrs", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PubKey attrs", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -969,7 +965,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 							phPrivateKey);
 	}
 
-out:	sc_pkcs11_unlock();
+out:	session_unlock(session);
 	return rv;
 }
 
@@ -1021,20 +1017,17 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK) {
-		slot = session->slot;
-		if (slot->card->framework->get_random == NULL)
-			rv = CKR_RANDOM_NO_RNG;
-		else
-			rv = slot->card->framework->get_random(slot->card, RandomData, ulRandomLen);
-	}
+	slot = session->slot;
+	if (slot->card->framework->get_random == NULL)
+		rv = CKR_RANDOM_NO_RNG;
+	else
+		rv = slot->card->framework->get_random(slot->card, RandomData, ulRandomLen);
 
-	sc_pkcs11_unlock();
+	session_unlock(session);
 	return rv;
 }
 
@@ -1068,12 +1061,12 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1095,7 +1088,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_verif_init(session, pMechanism, object, key_type);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_VerifyInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	session_unlock(session);
 	return rv;
 #endif
 }
@@ -1112,20 +1105,16 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = sc_pkcs11_verif_update(session, pData, ulDataLen);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
-out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
+	session_unlock(session);
 	return rv;
 #endif
 }
@@ -1139,17 +1128,20 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 #else
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_operation *op;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
+	/* Hashing may take long, only this session has to wait for it */
+	rv = session_take_operation(session, SC_PKCS11_OPERATION_VERIFY, &op);
+	if (rv == CKR_OK) {
+		rv = sc_pkcs11_operation_update(op, SC_PKCS11_OPERATION_VERIFY, pPart, ulPartLen);
+		rv = session_put_operation(session, SC_PKCS11_OPERATION_VERIFY, op, rv);
+	}
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_VerifyUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
 	return rv;
 #endif
 }
@@ -1164,16 +1156,14 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
+	rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_VerifyFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	session_unlock(session);
 	return rv;
 #endif
 }
@@ -28,12 +28,102 @@
 
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
 {
-	*session = list_seek(&sessions, &hSession);
+	return get_session_slot(hSession, session, NULL);
+}
+
+/* Like get_session(), also returning the slot of the session. The
+ * session may be closed and freed as soon as the tables lock is
+ * released, the slot stays until C_Finalize. */
+CK_RV get_session_slot(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session,
+			struct sc_pkcs11_slot **slot)
+{
+	sc_pkcs11_lock_tables();
+	*session = sc_pkcs11_handle_get(&sessions, hSession);
+	if (*session && slot)
+		*slot = (*session)->slot;
+	sc_pkcs11_unlock_tables();
 	if (!*session)
 		return CKR_SESSION_HANDLE_INVALID;
 	return CKR_OK;
 }
 
+/* Look up a session and take the lock of its slot; release
+ * with session_unlock(). On failure *session is NULL. */
+CK_RV session_lock(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
+{
+	struct sc_pkcs11_slot *slot, *slot2;
+	CK_RV rv;
+
+	*session = NULL;
+	if (context == NULL)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+	rv = get_session_slot(hSession, session, &slot);
+	if (rv != CKR_OK)
+		return rv;
+
+	sc_pkcs11_mutex_lock(slot->lock);
+	/* The session may have been closed while we were waiting */
+	rv = get_session_slot(hSession, session, &slot2);
+	if (rv == CKR_OK && slot2 != slot)
+		rv = CKR_SESSION_HANDLE_INVALID;
+	if (rv != CKR_OK) {
+		sc_pkcs11_mutex_unlock(slot->lock);
+		*session = NULL;
+	}
+	return rv;
+}
+
+void session_unlock(struct sc_pkcs11_session *session)
+{
+	if (session != NULL)
+		slot_unlock(session->slot);
+}
+
+/* Take an operation out of a session locked with session_lock(), to
+ * work on it without the slot lock, e.g. to hash data. The slot lock
+ * is released, also on failure. Until the operation is given back
+ * with session_put_operation(), other calls on the session see it as
+ * active, and closing the session leaves the freeing to
+ * session_put_operation(). */
+CK_RV session_take_operation(struct sc_pkcs11_session *session, int type,
+			struct sc_pkcs11_operation **operation)
+{
+	CK_RV rv;
+
+	rv = session_get_operation(session, type, operation);
+	if (rv == CKR_OK) {
+		session->operation[type] = NULL;
+		session->taken |= 1 << type;
+	}
+	session_unlock(session);
+	return rv;
+}
+
+/* Give back an operation taken with session_take_operation(). If rv
+ * is not CKR_OK, the operation ends. Returns rv, or
+ * CKR_SESSION_CLOSED if the session was closed meanwhile */
+CK_RV session_put_operation(struct sc_pkcs11_session *session, int type,
+			struct sc_pkcs11_operation *operation, CK_RV rv)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+
+	sc_pkcs11_mutex_lock(slot->lock);
+	session->taken &= ~(1 << type);
+	if (session->closed) {
+		sc_pkcs11_release_operation(&operation);
+		if (session->taken == 0)
+			free(session);
+		rv = CKR_SESSION_CLOSED;
+	} else if (rv != CKR_OK) {
+		sc_pkcs11_release_operation(&operation);
+	} else {
+		session->operation[type] = operation;
+	}
+	sc_pkcs11_mutex_unlock(slot->lock);
+	return rv;
+}
+
 CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 		    CK_FLAGS flags,	/* defined in CK_SESSION_INFO */
 		    CK_VOID_PTR pApplication,	/* pointer passed to callback */
@@ -50,13 +140,12 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	if (flags & ~(CKF_SERIAL_SESSION | CKF_RW_SESSION))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
+	if (context == NULL)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_OpenSession(0x%lx)", slotID);
 
-	rv = slot_get_token(slotID, &slot);
+	rv = slot_lock_token(slotID, &slot);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -76,30 +165,30 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	session->notify_callback = Notify;
 	session->notify_data = pApplication;
 	session->flags = flags;
+	sc_pkcs11_lock_tables();
+	rv = sc_pkcs11_handle_add(&sessions, session, &session->handle);
+	sc_pkcs11_unlock_tables();
+	if (rv != CKR_OK) {
+		free(session);
+		goto out;
+	}
 	slot->nsessions++;
-	session->handle = (CK_SESSION_HANDLE) session;	/* cast a pointer to long */
-	list_append(&sessions, session);
 	*phSession = session->handle;
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_OpenSession handle: 0x%lx", session->handle);
 
 out:
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_OpenSession() = %s", lookup_enum(RV_T, rv));
-	sc_pkcs11_unlock();
+	slot_unlock(slot);
 	return rv;
 }
 
 /* Internal version of C_CloseSession that gets called with
- * the global lock held */
-static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
+ * the slot lock held */
+static CK_RV sc_pkcs11_close_session(struct sc_pkcs11_session *session)
 {
 	struct sc_pkcs11_slot *slot;
-	struct sc_pkcs11_session *session;
-
-	sc_debug(context, SC_LOG_DEBUG_NORMAL, "real C_CloseSession(0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session)
-		return CKR_SESSION_HANDLE_INVALID;
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "real C_CloseSession(0x%lx)", session->handle);
 
 	/* If we're the last session using this slot, make sure
 	 * we log out */
@@ -110,25 +199,41 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 		slot->card->framework->logout(slot->card, slot->fw_data);
 	}
 
-	if (list_delete(&sessions, session) != 0)
-		sc_debug(context, SC_LOG_DEBUG_NORMAL, "Could not delete session from list!");
-	free(session);
+	sc_pkcs11_lock_tables();
+	if (sc_pkcs11_handle_remove(&sessions, session->handle) == NULL)
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "Could not delete session from table!");
+	sc_pkcs11_unlock_tables();
+	/* Another thread still works on an operation of the session */
+	if (session->taken)
+		session->closed = 1;
+	else
+		free(session);
 	return CKR_OK;
 }
 
 /* Internal version of C_CloseAllSessions that gets called with
- * the global lock held */
+ * the slot lock held */
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 {
 	CK_RV rv = CKR_OK;
 	struct sc_pkcs11_session *session;
-	unsigned int i;
-	sc_debug(context, SC_LOG_DEBUG_NORMAL, "real C_CloseAllSessions(0x%lx) %d", slotID, list_size(&sessions));
-	for (i = 0; i < list_size(&sessions); i++) {
-		session = list_get_at(&sessions, i);
-		if (session->slot->id == slotID)
-			if ((rv = sc_pkcs11_close_session(session->handle)) != CKR_OK)
-				return rv;
+	unsigned int i = 0;
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "real C_CloseAllSessions(0x%lx)", slotID);
+	for (;;) {
+		session = NULL;
+		sc_pkcs11_lock_tables();
+		for (; i < sessions.count; i++) {
+			struct sc_pkcs11_session *s = sc_pkcs11_handle_at(&sessions, i, NULL);
+			if (s != NULL && s->slot->id == slotID) {
+				session = s;
+				break;
+			}
+		}
+		sc_pkcs11_unlock_tables();
+		if (session == NULL)
+			break;
+		if ((rv = sc_pkcs11_close_session(session)) != CKR_OK)
+			return rv;
 	}
 	return CKR_OK;
 }
@@ -136,16 +241,19 @@ CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
 	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_CloseSession(0x%lx)\n", hSession);
 
-	rv = sc_pkcs11_close_session(hSession);
+	slot = session->slot;
+	rv = sc_pkcs11_close_session(session);
 
-	sc_pkcs11_unlock();
+	slot_unlock(slot);
 	return rv;
 }
 
@@ -154,19 +262,18 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 	CK_RV rv;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
+	if (context == NULL)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_CloseAllSessions(0x%lx)\n", slotID);
 
-	rv = slot_get_token(slotID, &slot);
+	rv = slot_lock_token(slotID, &slot);
 	if (rv != CKR_OK)
 		goto out;
 
 	rv = sc_pkcs11_close_all_sessions(slotID);
 
-      out:sc_pkcs11_unlock();
+      out:slot_unlock(slot);
 	return rv;
 }
 
@@ -180,18 +287,12 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;	
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
-		return rv;
+		goto out;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetSessionInfo(0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetSessionInfo(slot 0x%lx).", session->slot->id);
 	pInfo->slotID = session->slot->id;
 	pInfo->flags = session->flags;
@@ -209,8 +310,9 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
       out:
-	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetSessionInfo(0x%lx) = %s", hSession, lookup_enum(RV_T, rv));
-	sc_pkcs11_unlock();
+	if (context != NULL)
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetSessionInfo(0x%lx) = %s", hSession, lookup_enum(RV_T, rv));
+	session_unlock(session);
 	return rv;
 }
 
@@ -242,7 +344,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
@@ -250,11 +352,6 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = CKR_USER_TYPE_INVALID;
 		goto out;
 	}
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Login(0x%lx, %d)", hSession, userType);
 
@@ -286,7 +383,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			slot->login_user = userType;
 	}
 
-      out:sc_pkcs11_unlock();
+      out:session_unlock(session);
 	return rv;
 }
 
@@ -296,16 +393,10 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Logout(0x%lx)", hSession);
 
 	slot = session->slot;
@@ -316,7 +407,7 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	} else
 		rv = CKR_USER_NOT_LOGGED_IN;
 
-      out:sc_pkcs11_unlock();
+	session_unlock(session);
 	return rv;
 }
 
@@ -329,16 +420,10 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -353,7 +438,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 		rv = slot->card->framework->init_pin(slot->card, slot, pPin, ulPinLen);
 	}
 
-      out:sc_pkcs11_unlock();
+      out:session_unlock(session);
 	return rv;
 }
 
@@ -368,16 +453,10 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	    || (pNewPin == NULL_PTR && ulNewLen > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = session_lock(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	slot = session->slot;
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Changing PIN (session 0x%lx; login user %d)\n", hSession,
 		 slot->login_user);
@@ -391,6 +470,6 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 					       slot->login_user, pOldPin, ulOldLen, pNewPin,
 					       ulNewLen);
 
-      out:sc_pkcs11_unlock();
+      out:session_unlock(session);
 	return rv;
 }
@@ -80,6 +80,9 @@ struct sc_pkcs11_config {
 	unsigned int pin_unblock_style;
 	unsigned int create_puk_slot;
 	unsigned int zero_ckaid_for_ca_certs;
+	unsigned char parallel_card_detection;
+	unsigned char slot_monitor;
+	unsigned char sign_queue;
 };
 
 /*
@@ -117,13 +120,17 @@ struct sc_pkcs11_object_ops {
 };
 
 struct sc_pkcs11_object {
-	CK_OBJECT_HANDLE handle;
+	CK_OBJECT_HANDLE handle; /* Handle in the slot the object was last added to */
 	int flags;
 	struct sc_pkcs11_object_ops *ops;
+	/* Public key parsed for software signature verification, kept
+	 * for the lifetime of the object; protected by the slot lock */
+	void *verify_key;
 };
 
 #define SC_PKCS11_OBJECT_SEEN	0x0001
 #define SC_PKCS11_OBJECT_HIDDEN	0x0002
+#define SC_PKCS11_OBJECT_PARTIAL	0x0004	/* Attributes may change once data is read */
 #define SC_PKCS11_OBJECT_RECURS	0x8000
 
 
@@ -195,6 +202,52 @@ struct sc_pkcs11_card {
 	unsigned int nmechanisms;
 };
 
+/* Maps CK_SESSION_HANDLE/CK_OBJECT_HANDLE values to pointers in
+ * constant time; see misc.c */
+struct sc_pkcs11_handle_table {
+	void **entries;
+	unsigned int *generations;
+	unsigned int *free_list;	/* indices of released entries */
+	unsigned int nfree;
+	unsigned int count;		/* entries in use or released */
+	unsigned int size;		/* entries allocated */
+};
+
+/* Index of the objects in a slot by the attributes most templates
+ * passed to C_FindObjectsInit() select on; see slot.c */
+#define SC_PKCS11_INDEX_SIZE	64
+
+struct sc_pkcs11_index_entry {
+	struct sc_pkcs11_index_entry *next;
+	CK_OBJECT_HANDLE handle;
+	CK_ATTRIBUTE_TYPE type;
+	CK_ULONG len;
+	unsigned char *value;
+};
+
+struct sc_pkcs11_index {
+	struct sc_pkcs11_index_entry *buckets[SC_PKCS11_INDEX_SIZE];
+	/* Objects whose value could not be read; always candidates */
+	struct sc_pkcs11_index_entry *unknown;
+};
+
+/* Signature requests for the token of a reader, see sign_queue_enter() */
+struct sc_pkcs11_sign_queue {
+	void *lock; /* The lock of the reader's slots */
+	sc_reader_t *reader;
+	void *mutex; /* Protects the tickets and statistics */
+	void *event; /* Signalled whenever the next ticket is served */
+	unsigned long next_ticket;
+	unsigned long serving;
+	sc_card_t *held; /* Card kept locked for the waiting requests */
+	/* Statistics since the card was inserted */
+	unsigned long requests;
+	unsigned long waited;
+	unsigned long max_depth;
+	sc_timestamp_t total_wait;
+	sc_timestamp_t max_wait;
+};
+
 struct sc_pkcs11_slot {
 	CK_SLOT_ID id; /* ID of the slot */
 	int login_user; /* Currently logged in user */
@@ -205,8 +258,13 @@ struct sc_pkcs11_slot {
 	unsigned int events; /* Card events SC_EVENT_CARD_{INSERTED,REMOVED} */
 	void *fw_data; /* Framework specific data */
 	list_t objects; /* Objects in this slot */
+	struct sc_pkcs11_handle_table object_handles; /* Object handle -> object */
+	struct sc_pkcs11_index object_index; /* Attribute value -> object handles */
 	unsigned int nsessions; /* Number of sessions using this slot */
 	sc_timestamp_t slot_state_expires;
+	void *lock; /* Serializes access to the card, shared by all slots of a reader */
+	int lock_owner; /* This slot created (and will destroy) the lock */
+	struct sc_pkcs11_sign_queue *sign_queue; /* Shared like the lock, may be NULL */
 };
 typedef struct sc_pkcs11_slot sc_pkcs11_slot_t;
 
@@ -298,14 +356,19 @@ struct sc_pkcs11_session {
 	CK_VOID_PTR notify_data;
 	/* Active operations - one per type */
 	struct sc_pkcs11_operation *operation[SC_PKCS11_OPERATION_MAX];
+	/* Operations taken out by session_take_operation(), one bit per type */
+	unsigned int taken;
+	/* Closed while operations were taken, freed when they come back */
+	int closed;
 };
 typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 
 /* Module variables */
 extern struct sc_context *context;
 extern struct sc_pkcs11_config sc_pkcs11_conf;
-extern list_t sessions;
+extern struct sc_pkcs11_handle_table sessions;
 extern list_t virtual_slots;
+extern struct sc_pkcs11_handle_table slot_table;
 extern list_t cards;
 
 /* Framework definitions */
@@ -320,6 +383,15 @@ void sc_pkcs11_print_attrs(int level, const char *file, unsigned int line, const
 		sc_pkcs11_print_attrs(level, __FILE__, __LINE__, __FUNCTION__, \
 				info, pTemplate, ulCount)
 
+/* Handle tables (misc.c) */
+void sc_pkcs11_handle_table_init(struct sc_pkcs11_handle_table *);
+void sc_pkcs11_handle_table_free(struct sc_pkcs11_handle_table *);
+void sc_pkcs11_handle_table_clear(struct sc_pkcs11_handle_table *);
+CK_RV sc_pkcs11_handle_add(struct sc_pkcs11_handle_table *, void *, CK_ULONG *);
+void *sc_pkcs11_handle_get(struct sc_pkcs11_handle_table *, CK_ULONG);
+void *sc_pkcs11_handle_at(struct sc_pkcs11_handle_table *, unsigned int, CK_ULONG *);
+void *sc_pkcs11_handle_remove(struct sc_pkcs11_handle_table *, CK_ULONG);
+
 /* Slot and card handling functions */
 CK_RV card_removed(sc_reader_t *reader);
 CK_RV card_detect_all(void);
@@ -328,18 +400,47 @@ CK_RV initialize_reader(sc_reader_t *reader);
 CK_RV card_detect(sc_reader_t *reader);
 CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot **);
+CK_RV slot_lock(CK_SLOT_ID id, struct sc_pkcs11_slot **);
+CK_RV slot_lock_token(CK_SLOT_ID id, struct sc_pkcs11_slot **);
+void slot_unlock(struct sc_pkcs11_slot *);
 CK_RV slot_token_removed(CK_SLOT_ID id);
 CK_RV slot_allocate(struct sc_pkcs11_slot **, struct sc_pkcs11_card *);
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask);
+CK_RV slot_update_all(void);
+CK_RV slot_redetect(struct sc_pkcs11_slot *);
+void slot_monitor_start(void);
+void slot_monitor_stop(void);
+int slot_monitor_running(void);
+unsigned long slot_monitor_count(void);
+void slot_monitor_wait(unsigned long);
+CK_RV sign_queue_enter(CK_SESSION_HANDLE, struct sc_pkcs11_sign_queue **);
+void sign_queue_leave(struct sc_pkcs11_sign_queue *);
+CK_RV sign_queue_create(struct sc_pkcs11_slot *);
+void sign_queue_release(struct sc_pkcs11_sign_queue *);
+void sign_queue_free(struct sc_pkcs11_sign_queue *);
+CK_RV slot_index_add(struct sc_pkcs11_slot *, struct sc_pkcs11_object *, CK_OBJECT_HANDLE);
+void slot_index_remove(struct sc_pkcs11_slot *, CK_OBJECT_HANDLE);
+void slot_index_update(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+void slot_index_clear(struct sc_pkcs11_slot *);
+int slot_index_lookup(struct sc_pkcs11_slot *, CK_ATTRIBUTE_PTR, CK_ULONG,
+		CK_OBJECT_HANDLE **, CK_ULONG *);
 
 /* Session manipulation */
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session);
+CK_RV get_session_slot(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session,
+			struct sc_pkcs11_slot ** slot);
+CK_RV session_lock(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session);
+void session_unlock(struct sc_pkcs11_session *session);
 CK_RV session_start_operation(struct sc_pkcs11_session *,
 			int, sc_pkcs11_mechanism_type_t *,
 			struct sc_pkcs11_operation **);
 CK_RV session_get_operation(struct sc_pkcs11_session *, int,
 			struct sc_pkcs11_operation **);
 CK_RV session_stop_operation(struct sc_pkcs11_session *, int);
+CK_RV session_take_operation(struct sc_pkcs11_session *, int,
+			struct sc_pkcs11_operation **);
+CK_RV session_put_operation(struct sc_pkcs11_session *, int,
+			struct sc_pkcs11_operation *, CK_RV);
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID);
 
 /* Generic secret key stuff */
@@ -366,6 +467,7 @@ CK_RV sc_pkcs11_get_mechanism_list(struct sc_pkcs11_card *,
 				CK_MECHANISM_TYPE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_get_mechanism_info(struct sc_pkcs11_card *, CK_MECHANISM_TYPE,
 				CK_MECHANISM_INFO_PTR);
+CK_RV sc_pkcs11_operation_update(sc_pkcs11_operation_t *, int, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_md_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR);
 CK_RV sc_pkcs11_md_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_md_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
@@ -401,19 +503,50 @@ CK_RV sc_pkcs11_register_sign_and_hash_mechanism(struct sc_pkcs11_card *,
 #ifdef ENABLE_OPENSSL
 CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 	const unsigned char *pubkey_params, int pubkey_params_len,
+	CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
+	unsigned char *inp, int inp_len,
+	unsigned char *signat, int signat_len,
+	void **pkey_cache);
+CK_RV sc_pkcs11_verify_data_key(void *pkey,
 	CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 	unsigned char *inp, int inp_len,
 	unsigned char *signat, int signat_len);
+void sc_pkcs11_free_verify_key(void *pkey);
 #endif
 
 /* Load configuration defaults */
 void load_pkcs11_parameters(struct sc_pkcs11_config *, struct sc_context *);
 
-/* Locking primitives at the pkcs11 level */
+/* Locking primitives at the pkcs11 level.
+ *
+ * The global lock is taken by C_Initialize/C_Finalize and by the calls
+ * that rescan readers and change the slot list. Operations on a token
+ * only hold the lock of its slot (shared by all slots of a reader) and
+ * briefly the table lock, which protects the session and slot lists.
+ * Lock order: global lock, then slot lock, then table lock. */
 CK_RV sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR);
 CK_RV sc_pkcs11_lock(void);
 void sc_pkcs11_unlock(void);
 void sc_pkcs11_free_lock(void);
+void sc_pkcs11_lock_tables(void);
+void sc_pkcs11_unlock_tables(void);
+CK_RV sc_pkcs11_mutex_create(void **);
+void sc_pkcs11_mutex_lock(void *);
+void sc_pkcs11_mutex_unlock(void *);
+void sc_pkcs11_mutex_destroy(void *);
+
+sc_timestamp_t get_current_time(void);
+
+/* Worker threads, see sc_pkcs11_can_create_threads() */
+int sc_pkcs11_can_create_threads(void);
+CK_RV sc_pkcs11_thread_create(void **, void (*)(void *), void *);
+void sc_pkcs11_thread_join(void *);
+void sc_pkcs11_thread_forget(void *);
+CK_RV sc_pkcs11_event_create(void **);
+unsigned long sc_pkcs11_event_count(void *);
+void sc_pkcs11_event_signal(void *);
+void sc_pkcs11_event_wait(void *, unsigned long);
+void sc_pkcs11_event_destroy(void *);
 
 #ifdef __cplusplus
 }
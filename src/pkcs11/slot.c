@@ -36,13 +36,26 @@ static struct sc_pkcs11_framework_ops *frameworks[] = {
 	NULL
 };
 
+/* Slots are only appended to virtual_slots and never freed before
+ * C_Finalize, so a slot pointer stays valid once the table lock
+ * has been released. */
+static struct sc_pkcs11_slot * slot_at(unsigned int i)
+{
+	struct sc_pkcs11_slot *slot = NULL;
+
+	sc_pkcs11_lock_tables();
+	slot = (struct sc_pkcs11_slot *) sc_pkcs11_handle_at(&slot_table, i, NULL);
+	sc_pkcs11_unlock_tables();
+	return slot;
+}
+
 static struct sc_pkcs11_slot * reader_get_slot(sc_reader_t *reader)
 {
+	struct sc_pkcs11_slot *slot;
 	unsigned int i;
 
 	/* Locate a slot related to the reader */
-	for (i = 0; i<list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+	for (i = 0; (slot = slot_at(i)) != NULL; i++) {
 		if (slot->reader == reader) {
 			return slot;
 		}	
@@ -61,21 +74,12 @@ static void init_slot_info(CK_SLOT_INFO_PTR pInfo)
 	pInfo->firmwareVersion.minor = 0;
 }
 
-/* simclist helpers to locate interesting objects by ID */
-static int object_list_seeker(const void *el, const void *key)
-{
-	const struct sc_pkcs11_object *object = (struct sc_pkcs11_object *)el;
-
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (object->handle == *(CK_OBJECT_HANDLE*)key)
-		return 1;
-	return 0;
-}
 								
 CK_RV create_slot(sc_reader_t *reader)
 {
-	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_slot *slot, *reader_slot = NULL;
+	CK_ULONG handle;
+	CK_RV rv;
 
 	if (list_size(&virtual_slots) >= sc_pkcs11_conf.max_virtual_slots)
 		return CKR_FUNCTION_FAILED;
@@ -84,19 +88,58 @@ CK_RV create_slot(sc_reader_t *reader)
 	if (!slot)
 		return CKR_HOST_MEMORY;
 
-	list_append(&virtual_slots, slot);
+	/* All slots of a reader share the card, hence they share one lock */
+	if (reader != NULL)
+		reader_slot = reader_get_slot(reader);
+	if (reader_slot != NULL) {
+		slot->lock = reader_slot->lock;
+		slot->sign_queue = reader_slot->sign_queue;
+	} else {
+		rv = sc_pkcs11_mutex_create(&slot->lock);
+		if (rv != CKR_OK) {
+			free(slot);
+			return rv;
+		}
+		slot->lock_owner = 1;
+	}
+
 	slot->login_user = -1;
-	slot->id = (CK_SLOT_ID) list_locate(&virtual_slots, slot);
-	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Creating slot with id 0x%lx", slot->id);
-	
 	list_init(&slot->objects);
-	list_attributes_seeker(&slot->objects, object_list_seeker);
+	sc_pkcs11_handle_table_init(&slot->object_handles);
 
 	init_slot_info(&slot->slot_info);
 	if (reader != NULL) {
 		slot->reader = reader;
 		strcpy_bp(slot->slot_info.slotDescription, reader->name, 64);
 	}
+	if (reader != NULL && slot->lock_owner) {
+		rv = sign_queue_create(slot);
+		if (rv != CKR_OK) {
+			list_destroy(&slot->objects);
+			sc_pkcs11_mutex_destroy(slot->lock);
+			free(slot);
+			return rv;
+		}
+	}
+
+	/* Slots are never removed, so the position in slot_table
+	 * is the position in virtual_slots, which is the slot ID */
+	sc_pkcs11_lock_tables();
+	rv = sc_pkcs11_handle_add(&slot_table, slot, &handle);
+	if (rv != CKR_OK) {
+		sc_pkcs11_unlock_tables();
+		list_destroy(&slot->objects);
+		if (slot->lock_owner) {
+			sign_queue_free(slot->sign_queue);
+			sc_pkcs11_mutex_destroy(slot->lock);
+		}
+		free(slot);
+		return rv;
+	}
+	list_append(&virtual_slots, slot);
+	slot->id = (CK_SLOT_ID) list_size(&virtual_slots) - 1;
+	sc_pkcs11_unlock_tables();
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Creating slot with id 0x%lx", slot->id);
 	return CKR_OK;
 }
 
@@ -128,25 +171,25 @@ CK_RV initialize_reader(sc_reader_t *reader)
 			return rv;
 	}
 
-	if (sc_detect_card_presence(reader)) {
-		card_detect(reader);
-	}
-
+	/* The card, if any, is detected by card_detect_all() */
 	return CKR_OK;
 }
 
 
+/* Called with the lock of the reader's slots held */
 CK_RV card_removed(sc_reader_t * reader)
 {
 	unsigned int i;
 	struct sc_pkcs11_card *card = NULL;
+	sc_pkcs11_slot_t *slot;
 	/* Mark all slots as "token not present" */
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: card removed", reader->name);
 
 
-	for (i=0; i < list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+	for (i=0; (slot = slot_at(i)) != NULL; i++) {
 		if (slot->reader == reader) {
+			if (slot->lock_owner)
+				sign_queue_release(slot->sign_queue);
 			/* Save the "card" object */
 			if (slot->card)
 				card = slot->card;
@@ -177,9 +220,11 @@ CK_RV card_removed(sc_reader_t * reader)
 }
 
 
+/* Called with the lock of the reader's slots held */
 CK_RV card_detect(sc_reader_t *reader)
 {
 	struct sc_pkcs11_card *p11card = NULL;
+	struct sc_pkcs11_slot *slot;
 	int rc, rv;
 	unsigned int i;
 
@@ -211,13 +256,9 @@ CK_RV card_detect(sc_reader_t *reader)
 	}
 
 	/* Locate a slot related to the reader */
-	for (i=0; i<list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		if (slot->reader == reader) {
-			p11card = slot->card;
-			break;
-		}
-	}
+	slot = reader_get_slot(reader);
+	if (slot != NULL)
+		p11card = slot->card;
 
 	/* Detect the card if it's not known already */
 	if (p11card == NULL) {
@@ -262,17 +303,67 @@ CK_RV card_detect(sc_reader_t *reader)
 	return CKR_OK;
 }
 
-CK_RV card_detect_all(void) {
-	 unsigned int i;
+static void card_detect_slot(void *arg)
+{
+	struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *) arg;
+
+	sc_pkcs11_mutex_lock(slot->lock);
+	card_detect(slot->reader);
+	sc_pkcs11_mutex_unlock(slot->lock);
+}
+
+/*
+ * Detect cards in all readers, creating the slots of readers not seen
+ * before. Connecting to and binding a card may take seconds, so with
+ * more than one reader every reader gets a worker thread of its own
+ * when possible. A worker only touches the slots of its reader, under
+ * their lock, so the results are visible once all workers are joined.
+ */
+CK_RV card_detect_all(void)
+{
+	struct sc_pkcs11_slot **slots;
+	void **threads = NULL;
+	unsigned int i, n = 0, count;
+
+	count = sc_ctx_get_reader_count(context);
+	if (count == 0)
+		return CKR_OK;
+	slots = (struct sc_pkcs11_slot **) calloc(count, sizeof(*slots));
+	if (slots == NULL)
+		return CKR_HOST_MEMORY;
 
-	 /* Detect cards in all initialized readers */
-	 for (i=0; i< sc_ctx_get_reader_count(context); i++) {
-		 sc_reader_t *reader = sc_ctx_get_reader(context, i);
-		 if (!reader_get_slot(reader))
-			 initialize_reader(reader);
-		 card_detect(sc_ctx_get_reader(context, i));
-	 }
-	 return CKR_OK;			
+	for (i = 0; i < count; i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(context, i);
+		struct sc_pkcs11_slot *slot = reader_get_slot(reader);
+
+		if (!slot) {
+			initialize_reader(reader);
+			slot = reader_get_slot(reader);
+			if (!slot)
+				continue;
+		}
+		slots[n++] = slot;
+	}
+
+	if (n > 1 && sc_pkcs11_conf.parallel_card_detection
+			&& sc_pkcs11_can_create_threads())
+		threads = (void **) calloc(n, sizeof(*threads));
+	for (i = 0; threads != NULL && i < n; i++) {
+		if (sc_pkcs11_thread_create(&threads[i], card_detect_slot, slots[i]) != CKR_OK)
+			sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: no detection thread, detecting serially",
+				 slots[i]->reader->name);
+	}
+	/* Readers without a worker are done here */
+	for (i = 0; i < n; i++) {
+		if (threads != NULL && threads[i] != NULL)
+			sc_pkcs11_thread_join(threads[i]);
+		else
+			card_detect_slot(slots[i]);
+	}
+
+	free(threads);
+	free(slots);
+	return CKR_OK;
 }
 
 /* Allocates an existing slot to a card */
@@ -282,12 +373,11 @@ CK_RV slot_allocate(struct sc_pkcs11_slot ** slot, struct sc_pkcs11_card * card)
 	struct sc_pkcs11_slot *tmp_slot = NULL;
 
 	/* Locate a free slot for this reader */
-	for (i=0; i< list_size(&virtual_slots); i++) {
-		tmp_slot = (struct sc_pkcs11_slot *)list_get_at(&virtual_slots, i);
+	for (i=0; (tmp_slot = slot_at(i)) != NULL; i++) {
 		if (tmp_slot->reader == card->reader && tmp_slot->card == NULL)
 			break;
 	}
-	if (!tmp_slot || (i == list_size(&virtual_slots)))
+	if (!tmp_slot)
 		return CKR_FUNCTION_FAILED;
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Allocated slot 0x%lx for card in reader %s", tmp_slot->id,
 		 card->reader->name);
@@ -302,12 +392,52 @@ CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-	*slot = list_seek(&virtual_slots, &id);	/* FIXME: check for null? */
+	sc_pkcs11_lock_tables();
+	*slot = sc_pkcs11_handle_at(&slot_table, (unsigned int) id, NULL);
+	if (*slot == NULL || (*slot)->id != id) {
+		/* The hotplug slot may have been renumbered, see C_GetSlotList() */
+		*slot = sc_pkcs11_handle_at(&slot_table, 0, NULL);
+		if (*slot != NULL && (*slot)->id != id)
+			*slot = NULL;
+	}
+	sc_pkcs11_unlock_tables();
 	if (!*slot)
 		return CKR_SLOT_ID_INVALID;
 	return CKR_OK;
 }
 
+/* Look up a slot and take its lock; release with slot_unlock() */
+CK_RV slot_lock(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
+{
+	CK_RV rv;
+
+	rv = slot_get_slot(id, slot);
+	if (rv != CKR_OK) {
+		*slot = NULL;
+		return rv;
+	}
+	sc_pkcs11_mutex_lock((*slot)->lock);
+	return CKR_OK;
+}
+
+/* As slot_lock(), but also make sure a token is present.
+ * The slot is returned locked even if this fails. */
+CK_RV slot_lock_token(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
+{
+	CK_RV rv;
+
+	rv = slot_lock(id, slot);
+	if (rv != CKR_OK)
+		return rv;
+	return slot_get_token(id, slot);
+}
+
+void slot_unlock(struct sc_pkcs11_slot * slot)
+{
+	if (slot != NULL)
+		sc_pkcs11_mutex_unlock(slot->lock);
+}
+
 CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 {
 	int rv;
@@ -317,9 +447,12 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 		return rv;
 
 	if (!((*slot)->slot_info.flags & CKF_TOKEN_PRESENT)) {
-		if ((*slot)->reader == NULL)	
+		if ((*slot)->reader == NULL)
 			return CKR_TOKEN_NOT_PRESENT;
-		rv = card_detect((*slot)->reader);
+		if (slot_monitor_running())
+			rv = slot_redetect(*slot);
+		else
+			rv = card_detect((*slot)->reader);
 		if (rv != CKR_OK)
 			return rv;
 	}
@@ -347,6 +480,8 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	/* Terminate active sessions */
 	sc_pkcs11_close_all_sessions(id);
 
+	slot_index_clear(slot);
+	sc_pkcs11_handle_table_clear(&slot->object_handles);
 	while ((object = list_fetch(&slot->objects))) {
 		if (object->ops->release)
 			object->ops->release(object);
@@ -374,11 +509,12 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 {
 	unsigned int i;
+	sc_pkcs11_slot_t *slot;
 	SC_FUNC_CALLED(context, SC_LOG_DEBUG_NORMAL);
 
-	card_detect_all();
-	for (i=0; i<list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+	slot_update_all();
+	for (i=0; (slot = slot_at(i)) != NULL; i++) {
+		sc_pkcs11_mutex_lock(slot->lock);
 		sc_debug(context, SC_LOG_DEBUG_NORMAL, "slot 0x%lx token: %d events: 0x%02X",slot->id, (slot->slot_info.flags & CKF_TOKEN_PRESENT), slot->events);
 		if ((slot->events & SC_EVENT_CARD_INSERTED)
 		    && !(slot->slot_info.flags & CKF_TOKEN_PRESENT)) {
@@ -390,8 +526,616 @@ CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 		if (slot->events & mask) {
 			slot->events &= ~mask;
 			*idp = slot->id;
+			sc_pkcs11_mutex_unlock(slot->lock);
 			SC_FUNC_RETURN(context, SC_LOG_DEBUG_VERBOSE, CKR_OK);
 		}
+		sc_pkcs11_mutex_unlock(slot->lock);
 	}
 	SC_FUNC_RETURN(context, SC_LOG_DEBUG_VERBOSE, CKR_NO_EVENT);
 }
+
+/*
+ * Bring the slots up to date for C_GetSlotList and C_WaitForSlotEvent.
+ * While the slot monitor runs, only readers that have no slots yet
+ * need to be looked at.
+ */
+CK_RV slot_update_all(void)
+{
+	unsigned int i;
+
+	if (!slot_monitor_running())
+		return card_detect_all();
+	for (i = 0; i < sc_ctx_get_reader_count(context); i++) {
+		if (reader_get_slot(sc_ctx_get_reader(context, i)) == NULL)
+			return card_detect_all();
+	}
+	return CKR_OK;
+}
+
+/*
+ * While the slot monitor runs, card_detect() is only called on reader
+ * events. A card that could not be connected or bound, e.g. while
+ * another process held it, would stay without a token until the next
+ * event, so try again, at most once a second, while the slot has no
+ * token. Called with the slot locked.
+ */
+CK_RV slot_redetect(struct sc_pkcs11_slot *slot)
+{
+	sc_timestamp_t now;
+
+	if (slot->reader == NULL)
+		return CKR_TOKEN_NOT_PRESENT;
+	if (slot->slot_info.flags & CKF_TOKEN_PRESENT)
+		return CKR_OK;
+	now = get_current_time();
+	if (now != 0 && now < slot->slot_state_expires)
+		return CKR_TOKEN_NOT_PRESENT;
+	slot->slot_state_expires = now + 1000;
+	return card_detect(slot->reader);
+}
+
+/*
+ * Slot monitor.
+ *
+ * If the reader driver can wait for events and we may create threads,
+ * a thread waits for card (and with plug_and_play, reader) events and
+ * updates the slot of the reader as they happen. C_GetSlotList,
+ * C_GetSlotInfo and C_WaitForSlotEvent then use the slot state as it
+ * is instead of asking the readers on every call, and a blocking
+ * C_WaitForSlotEvent waits for the monitor to signal monitor_event.
+ */
+#define SLOT_MONITOR_TIMEOUT	1000	/* ms, to notice new readers */
+
+static struct {
+	void *thread;
+	volatile int running;
+	volatile int stop;
+#if !defined(_WIN32)
+	pid_t pid;
+#endif
+} monitor;
+
+/* Never destroyed: a C_WaitForSlotEvent woken up by C_Finalize may
+ * still be using it */
+static void *monitor_event = NULL;
+
+static void slot_monitor_update(sc_reader_t *reader, unsigned int events)
+{
+	struct sc_pkcs11_slot *slot;
+	unsigned int i;
+
+	if (reader != NULL && (slot = reader_get_slot(reader)) != NULL) {
+		sc_pkcs11_mutex_lock(slot->lock);
+		card_detect(reader);
+		sc_pkcs11_mutex_unlock(slot->lock);
+	}
+	if ((events & SC_EVENT_READER_ATTACHED) && sc_pkcs11_conf.plug_and_play) {
+		/* Reported from the hotplug slot, see C_WaitForSlotEvent */
+		for (i = 0; (slot = slot_at(i)) != NULL; i++) {
+			if (slot->reader != NULL)
+				continue;
+			sc_pkcs11_mutex_lock(slot->lock);
+			slot->events |= SC_EVENT_READER_ATTACHED;
+			sc_pkcs11_mutex_unlock(slot->lock);
+			break;
+		}
+	}
+}
+
+static void slot_monitor(void *arg)
+{
+	void *reader_states = NULL;
+	unsigned int mask = SC_EVENT_CARD_EVENTS, events, nreaders = 0;
+	sc_reader_t *reader;
+	int r;
+
+	if (sc_pkcs11_conf.plug_and_play)
+		mask |= SC_EVENT_READER_EVENTS;
+
+	while (!monitor.stop) {
+		/* Readers added by C_GetSlotList are watched from the next round */
+		if (reader_states != NULL && nreaders != sc_ctx_get_reader_count(context))
+			sc_wait_for_event(context, 0, NULL, NULL, 0, &reader_states);
+		nreaders = sc_ctx_get_reader_count(context);
+
+		reader = NULL;
+		events = 0;
+		r = sc_wait_for_event(context, mask, &reader, &events,
+				SLOT_MONITOR_TIMEOUT, &reader_states);
+		if (monitor.stop)
+			break;
+		if (r == SC_ERROR_EVENT_TIMEOUT)
+			continue;
+		if (r != SC_SUCCESS) {
+			sc_debug(context, SC_LOG_DEBUG_NORMAL, "slot monitor: %s, stopping", sc_strerror(r));
+			break;
+		}
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "slot monitor: events 0x%02X in %s",
+			 events, reader ? reader->name : "(none)");
+		slot_monitor_update(reader, events);
+		sc_pkcs11_event_signal(monitor_event);
+	}
+
+	if (reader_states != NULL)
+		sc_wait_for_event(context, 0, NULL, NULL, 0, &reader_states);
+	/* Waiters go back to asking the readers themselves */
+	monitor.running = 0;
+	sc_pkcs11_event_signal(monitor_event);
+}
+
+/* Called at the end of C_Initialize */
+void slot_monitor_start(void)
+{
+	if (!sc_pkcs11_conf.slot_monitor || !sc_pkcs11_can_create_threads()
+			|| context->reader_driver->ops->wait_for_event == NULL)
+		return;
+	if (monitor_event == NULL && sc_pkcs11_event_create(&monitor_event) != CKR_OK)
+		return;
+
+	memset(&monitor, 0, sizeof(monitor));
+	monitor.running = 1;
+#if !defined(_WIN32)
+	monitor.pid = getpid();
+#endif
+	if (sc_pkcs11_thread_create(&monitor.thread, slot_monitor, NULL) != CKR_OK) {
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "cannot start the slot monitor");
+		monitor.running = 0;
+	}
+}
+
+/* Called from C_Finalize, which cancels the wait of the monitor */
+void slot_monitor_stop(void)
+{
+	if (monitor.thread == NULL)
+		return;
+	monitor.stop = 1;
+#if !defined(_WIN32)
+	if (monitor.pid != getpid()) {
+		/* We are the child of a fork(), the thread stayed with the parent */
+		sc_pkcs11_thread_forget(monitor.thread);
+		monitor.thread = NULL;
+		monitor.running = 0;
+		return;
+	}
+#endif
+	sc_cancel(context);
+	sc_pkcs11_thread_join(monitor.thread);
+	monitor.thread = NULL;
+}
+
+int slot_monitor_running(void)
+{
+	return monitor.running;
+}
+
+unsigned long slot_monitor_count(void)
+{
+	return sc_pkcs11_event_count(monitor_event);
+}
+
+/* Wait for the next change after slot_monitor_count() returned count */
+void slot_monitor_wait(unsigned long count)
+{
+	sc_pkcs11_event_wait(monitor_event, count);
+}
+
+/*
+ * Signature queue.
+ *
+ * C_Sign and C_SignFinal on the token of a reader take a ticket and
+ * wait, outside the slot lock, until it is their turn, so sessions
+ * are served in the order they asked, whoever grabs the slot lock
+ * first. While requests are waiting the card stays locked from one
+ * signature to the next: no other process gets in between, and the
+ * card keeps the security environment of the last signature (see
+ * reuse_security_env in the pkcs15 framework).
+ */
+CK_RV sign_queue_create(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_sign_queue *q;
+	CK_RV rv;
+
+	slot->sign_queue = NULL;
+	if (!sc_pkcs11_conf.sign_queue || !sc_pkcs11_can_create_threads())
+		return CKR_OK;
+
+	q = (struct sc_pkcs11_sign_queue *) calloc(1, sizeof(*q));
+	if (q == NULL)
+		return CKR_HOST_MEMORY;
+	rv = sc_pkcs11_mutex_create(&q->mutex);
+	if (rv == CKR_OK) {
+		rv = sc_pkcs11_event_create(&q->event);
+		if (rv != CKR_OK)
+			sc_pkcs11_mutex_destroy(q->mutex);
+	}
+	if (rv != CKR_OK) {
+		free(q);
+		return rv;
+	}
+	q->lock = slot->lock;
+	q->reader = slot->reader;
+	slot->sign_queue = q;
+	return CKR_OK;
+}
+
+/* Called with the lock of the reader's slots held, before the card
+ * goes away */
+void sign_queue_release(struct sc_pkcs11_sign_queue *q)
+{
+	if (q == NULL)
+		return;
+	if (q->held != NULL) {
+		sc_unlock(q->held);
+		q->held = NULL;
+	}
+
+	sc_pkcs11_mutex_lock(q->mutex);
+	if (q->requests != 0)
+		sc_debug(context, SC_LOG_DEBUG_NORMAL,
+			 "%s: %lu signatures, %lu waited %lu ms in total, "
+			 "longest wait %lu ms, queue depth up to %lu",
+			 q->reader->name, q->requests, q->waited,
+			 (unsigned long) q->total_wait, (unsigned long) q->max_wait,
+			 q->max_depth);
+	q->requests = q->waited = q->max_depth = 0;
+	q->total_wait = q->max_wait = 0;
+	sc_pkcs11_mutex_unlock(q->mutex);
+}
+
+void sign_queue_free(struct sc_pkcs11_sign_queue *q)
+{
+	if (q == NULL)
+		return;
+	sc_pkcs11_mutex_destroy(q->mutex);
+	sc_pkcs11_event_destroy(q->event);
+	free(q);
+}
+
+/* Wait for the turn of a signature in the session. On success,
+ * *queue (NULL if the slot has no queue) must be passed to
+ * sign_queue_leave() after the slot lock was released */
+CK_RV sign_queue_enter(CK_SESSION_HANDLE hSession, struct sc_pkcs11_sign_queue **queue)
+{
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_sign_queue *q;
+	unsigned long ticket, depth, count;
+	sc_timestamp_t start, wait;
+	int turn;
+	CK_RV rv;
+
+	*queue = NULL;
+	if (context == NULL)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	rv = get_session_slot(hSession, &session, &slot);
+	if (rv != CKR_OK)
+		return rv;
+	q = slot->sign_queue;
+	if (q == NULL)
+		return CKR_OK;
+
+	sc_pkcs11_mutex_lock(q->mutex);
+	ticket = q->next_ticket++;
+	depth = q->next_ticket - q->serving;
+	q->requests++;
+	if (depth > q->max_depth)
+		q->max_depth = depth;
+	sc_pkcs11_mutex_unlock(q->mutex);
+	*queue = q;
+	if (depth == 1)
+		return CKR_OK;
+
+	start = get_current_time();
+	for (;;) {
+		count = sc_pkcs11_event_count(q->event);
+		sc_pkcs11_mutex_lock(q->mutex);
+		turn = q->serving == ticket;
+		sc_pkcs11_mutex_unlock(q->mutex);
+		if (turn)
+			break;
+		sc_pkcs11_event_wait(q->event, count);
+	}
+	wait = get_current_time() - start;
+
+	sc_pkcs11_mutex_lock(q->mutex);
+	q->waited++;
+	q->total_wait += wait;
+	if (wait > q->max_wait)
+		q->max_wait = wait;
+	sc_pkcs11_mutex_unlock(q->mutex);
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: signature waited %lu ms behind %lu requests",
+		 q->reader->name, (unsigned long) wait, depth - 1);
+	return CKR_OK;
+}
+
+/* Hand the card to the next request */
+void sign_queue_leave(struct sc_pkcs11_sign_queue *q)
+{
+	struct sc_pkcs11_slot *slot;
+	unsigned int i;
+	int waiting;
+
+	if (q == NULL)
+		return;
+
+	sc_pkcs11_mutex_lock(q->lock);
+	sc_pkcs11_mutex_lock(q->mutex);
+	q->serving++;
+	waiting = q->next_ticket != q->serving;
+	sc_pkcs11_mutex_unlock(q->mutex);
+
+	if (waiting && q->held == NULL) {
+		for (i = 0; (slot = slot_at(i)) != NULL; i++) {
+			if (slot->reader == q->reader && slot->card != NULL)
+				break;
+		}
+		if (slot != NULL && sc_lock(slot->card->card) == SC_SUCCESS)
+			q->held = slot->card->card;
+	} else if (!waiting && q->held != NULL) {
+		sc_unlock(q->held);
+		q->held = NULL;
+	}
+	sc_pkcs11_mutex_unlock(q->lock);
+
+	sc_pkcs11_event_signal(q->event);
+}
+
+/*
+ * Object index.
+ *
+ * For each object in the slot, the values of the attributes below
+ * are hashed into slot->object_index when the object is added.
+ * C_FindObjectsInit() uses it to collect the candidates for the indexed
+ * attribute of a template that has the fewest of them, and only compares
+ * the remaining attributes one object at a time.
+ */
+static const CK_ATTRIBUTE_TYPE index_types[] = {
+	/* preferred in this order when the counts are equal */
+	CKA_ID, CKA_LABEL, CKA_KEY_TYPE, CKA_CLASS
+};
+#define INDEX_TYPE_COUNT	(sizeof(index_types) / sizeof(index_types[0]))
+
+static unsigned int index_hash(CK_ATTRIBUTE_TYPE type, const unsigned char *value, CK_ULONG len)
+{
+	unsigned int h = 2166136261U;
+	CK_ULONG i;
+
+	for (i = 0; i < sizeof(type); i++, type >>= 8)
+		h = (h ^ (unsigned char) type) * 16777619U;
+	for (i = 0; i < len; i++)
+		h = (h ^ value[i]) * 16777619U;
+	return h % SC_PKCS11_INDEX_SIZE;
+}
+
+static void index_free_entries(struct sc_pkcs11_index_entry *entry)
+{
+	struct sc_pkcs11_index_entry *next;
+
+	for (; entry != NULL; entry = next) {
+		next = entry->next;
+		if (entry->value != NULL)
+			free(entry->value);
+		free(entry);
+	}
+}
+
+/* Append, so that lookups report objects in the order they were added */
+static void index_append(struct sc_pkcs11_index_entry **head, struct sc_pkcs11_index_entry *entry)
+{
+	while (*head != NULL)
+		head = &(*head)->next;
+	*head = entry;
+}
+
+static void index_remove_handle(struct sc_pkcs11_index_entry **head, CK_OBJECT_HANDLE handle)
+{
+	struct sc_pkcs11_index_entry *entry;
+
+	while ((entry = *head) != NULL) {
+		if (entry->handle == handle) {
+			*head = entry->next;
+			entry->next = NULL;
+			index_free_entries(entry);
+		} else {
+			head = &entry->next;
+		}
+	}
+}
+
+/* Called with the slot lock held */
+CK_RV slot_index_add(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object,
+		CK_OBJECT_HANDLE handle)
+{
+	struct sc_pkcs11_session session;
+	struct sc_pkcs11_index_entry *entry;
+	CK_ATTRIBUTE attr;
+	unsigned int i;
+	CK_RV rv;
+
+	if (object->ops == NULL || object->ops->get_attribute == NULL)
+		return CKR_OK;
+
+	/* get_attribute() wants a session to find the token through */
+	memset(&session, 0, sizeof(session));
+	session.slot = slot;
+
+	for (i = 0; i < INDEX_TYPE_COUNT; i++) {
+		entry = (struct sc_pkcs11_index_entry *) calloc(1, sizeof(*entry));
+		if (entry == NULL)
+			return CKR_HOST_MEMORY;
+		entry->handle = handle;
+		entry->type = index_types[i];
+
+		if (object->flags & SC_PKCS11_OBJECT_PARTIAL) {
+			/* The value may not be final, and asking for it
+			 * could read the object from the card */
+			index_append(&slot->object_index.unknown, entry);
+			continue;
+		}
+
+		attr.type = index_types[i];
+		attr.pValue = NULL;
+		attr.ulValueLen = 0;
+		rv = object->ops->get_attribute(&session, object, &attr);
+		if (rv == CKR_OK && attr.ulValueLen > 0) {
+			attr.pValue = entry->value = (unsigned char *) malloc(attr.ulValueLen);
+			if (attr.pValue == NULL)
+				rv = CKR_HOST_MEMORY;
+			else
+				rv = object->ops->get_attribute(&session, object, &attr);
+		}
+
+		if (rv == CKR_OK) {
+			entry->len = attr.ulValueLen;
+			index_append(&slot->object_index.buckets[index_hash(entry->type,
+					entry->value, entry->len)], entry);
+		} else if (rv == CKR_ATTRIBUTE_TYPE_INVALID) {
+			/* The object does not have it, so it can never match */
+			index_free_entries(entry);
+		} else {
+			/* Let C_FindObjectsInit() compare the object itself */
+			index_append(&slot->object_index.unknown, entry);
+		}
+	}
+	return CKR_OK;
+}
+
+/* Called with the slot lock held */
+void slot_index_remove(struct sc_pkcs11_slot *slot, CK_OBJECT_HANDLE handle)
+{
+	unsigned int i;
+
+	for (i = 0; i < SC_PKCS11_INDEX_SIZE; i++)
+		index_remove_handle(&slot->object_index.buckets[i], handle);
+	index_remove_handle(&slot->object_index.unknown, handle);
+}
+
+/* Re-index an object after its attributes were changed. The object
+ * may also have been added to the other slots of the reader, which
+ * share the lock of this slot held by the caller. */
+void slot_index_update(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	struct sc_pkcs11_slot *tmp;
+	CK_OBJECT_HANDLE handle;
+	unsigned int i, j;
+
+	for (i = 0; (tmp = slot_at(i)) != NULL; i++) {
+		if (tmp->lock != slot->lock)
+			continue;
+		for (j = 0; j < tmp->object_handles.count; j++) {
+			if (sc_pkcs11_handle_at(&tmp->object_handles, j, &handle) != object)
+				continue;
+			slot_index_remove(tmp, handle);
+			slot_index_add(tmp, object, handle);
+		}
+	}
+}
+
+/* Called with the slot lock held */
+void slot_index_clear(struct sc_pkcs11_slot *slot)
+{
+	unsigned int i;
+
+	for (i = 0; i < SC_PKCS11_INDEX_SIZE; i++)
+		index_free_entries(slot->object_index.buckets[i]);
+	index_free_entries(slot->object_index.unknown);
+	memset(&slot->object_index, 0, sizeof(slot->object_index));
+}
+
+/* Return the number of index entries for the attribute that may match */
+static CK_ULONG index_count(struct sc_pkcs11_slot *slot, CK_ATTRIBUTE_PTR attr,
+		CK_OBJECT_HANDLE *found)
+{
+	struct sc_pkcs11_index_entry *entry, *lists[2];
+	CK_ULONG n = 0;
+	unsigned int k;
+
+	lists[0] = slot->object_index.buckets[index_hash(attr->type,
+			(unsigned char *) attr->pValue, attr->ulValueLen)];
+	lists[1] = slot->object_index.unknown;
+	for (k = 0; k < 2; k++) {
+		for (entry = lists[k]; entry != NULL; entry = entry->next) {
+			if (entry->type != attr->type)
+				continue;
+			if (k == 0 && (entry->len != attr->ulValueLen
+			 || memcmp(entry->value, attr->pValue, entry->len) != 0))
+				continue;
+			if (found != NULL)
+				found[n] = entry->handle;
+			n++;
+		}
+	}
+	return n;
+}
+
+static int index_cmp_handle(const void *a, const void *b)
+{
+	CK_OBJECT_HANDLE x = *(const CK_OBJECT_HANDLE *) a;
+	CK_OBJECT_HANDLE y = *(const CK_OBJECT_HANDLE *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Collect the handles of the objects that may match the template,
+ * which the caller still has to compare against it. The candidates
+ * are taken for the indexed attribute of the template with the fewest
+ * of them, and are returned in the order of slot->object_handles, as
+ * a walk over all objects would find them. Returns -1 if the template
+ * has no indexed attribute and all objects must be checked. Called
+ * with the slot lock held.
+ */
+int slot_index_lookup(struct sc_pkcs11_slot *slot, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+		CK_OBJECT_HANDLE **handles, CK_ULONG *count)
+{
+	CK_ATTRIBUTE_PTR attr = NULL;
+	CK_ULONG j, n, best = 0;
+	CK_OBJECT_HANDLE *found, *ordered, handle;
+	unsigned int i;
+
+	for (i = 0; i < INDEX_TYPE_COUNT; i++) {
+		for (j = 0; j < ulCount; j++) {
+			if (pTemplate[j].type == index_types[i] && pTemplate[j].pValue != NULL)
+				break;
+		}
+		if (j == ulCount)
+			continue;
+		n = index_count(slot, &pTemplate[j], NULL);
+		if (attr == NULL || n < best) {
+			attr = &pTemplate[j];
+			best = n;
+		}
+	}
+	if (attr == NULL)
+		return -1;
+
+	if (best == 0) {
+		*handles = NULL;
+		*count = 0;
+		return 0;
+	}
+
+	found = (CK_OBJECT_HANDLE *) malloc(best * sizeof(CK_OBJECT_HANDLE));
+	ordered = (CK_OBJECT_HANDLE *) malloc(best * sizeof(CK_OBJECT_HANDLE));
+	if (found == NULL || ordered == NULL) {
+		/* Fall back to checking every object */
+		free(found);
+		free(ordered);
+		return -1;
+	}
+	index_count(slot, attr, found);
+	qsort(found, best, sizeof(CK_OBJECT_HANDLE), index_cmp_handle);
+
+	/* Put them back in object order */
+	for (i = 0, n = 0; i < slot->object_handles.count && n < best; i++) {
+		if (sc_pkcs11_handle_at(&slot->object_handles, i, &handle) == NULL)
+			continue;
+		if (bsearch(&handle, found, best, sizeof(CK_OBJECT_HANDLE), index_cmp_handle) != NULL)
+			ordered[n++] = handle;
+	}
+	free(found);
+
+	*handles = ordered;
+	*count = n;
+	return 0;
+}
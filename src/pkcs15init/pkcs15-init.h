@@ -351,6 +351,12 @@ extern int	sc_pkcs15init_verify_secret(struct sc_profile *, struct sc_pkcs15_car
 				sc_file_t *,  unsigned int, int);
 extern int	sc_pkcs15init_delete_by_path(struct sc_profile *,
 				struct sc_pkcs15_card *, const struct sc_path *);
+/* Defer the updates of the xDFs, ODF and TokenInfo until
+ * sc_pkcs15init_flush() is called, so a series of operations
+ * writes each of these files only once.
+ */
+extern void	sc_pkcs15init_defer_updates(struct sc_profile *, int);
+extern int	sc_pkcs15init_flush(struct sc_pkcs15_card *, struct sc_profile *);
 extern int	sc_pkcs15init_update_any_df(struct sc_pkcs15_card *, struct sc_profile *, 
 			struct sc_pkcs15_df *, int);
 
@@ -98,6 +98,9 @@ static int	sc_pkcs15init_update_tokeninfo(struct sc_pkcs15_card *,
 			struct sc_profile *profile);
 static int	sc_pkcs15init_update_odf(struct sc_pkcs15_card *,
 			struct sc_profile *profile);
+static int	sc_pkcs15init_update_file_image(struct sc_profile *,
+			struct sc_pkcs15_card *, struct sc_file *,
+			void *, unsigned int, u8 **, size_t *);
 static int	sc_pkcs15init_map_usage(unsigned long, int);
 static int	do_select_parent(struct sc_profile *, struct sc_pkcs15_card *,
 			struct sc_file *, struct sc_file **);
@@ -385,6 +388,14 @@ sc_pkcs15init_unbind(struct sc_profile *profile)
 	int r;
 	struct sc_context *ctx = profile->card->ctx;
 
+	if (profile->pending_dfs || profile->pending_odf || profile->pending_tokeninfo) {
+		r = SC_ERROR_INTERNAL;
+		if (profile->p15_data != NULL)
+			r = sc_pkcs15init_flush(profile->p15_data, profile);
+		if (r < 0)
+			sc_log(ctx, "Failed to write the deferred PKCS#15 updates: %s", sc_strerror(r));
+	}
+	profile->defer_updates = 0;
 	if (profile->dirty != 0 && profile->p15_data != NULL && profile->pkcs15.do_last_update) {
 		r = sc_pkcs15init_update_tokeninfo(profile->p15_data, profile);
 		if (r < 0)
@@ -845,6 +856,10 @@ sc_pkcs15init_add_app(struct sc_card *card, struct sc_profile *profile,
 		free(app); /* unused */
 	}
 
+	/* Nothing can bind to the new application until it is on the card */
+	if (r >= 0 && profile->defer_updates)
+		r = sc_pkcs15init_flush(p15card, profile);
+
 	sc_pkcs15init_write_info(p15card, profile, pin_obj);
 	LOG_FUNC_RETURN(ctx, r);
 }
@@ -2444,6 +2459,11 @@ sc_pkcs15init_update_tokeninfo(struct sc_pkcs15_card *p15card,
 	size_t		size;
 	int		r;
 
+	if (profile->defer_updates) {
+		profile->pending_tokeninfo = 1;
+		return 0;
+	}
+
 	/* set lastUpdate field */
 	if (p15card->tokeninfo->last_update != NULL)
 		free(p15card->tokeninfo->last_update);
@@ -2474,6 +2494,11 @@ sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card,
 	int		r;
 
 	LOG_FUNC_CALLED(ctx);
+	if (profile->defer_updates) {
+		profile->pending_odf = 1;
+		LOG_FUNC_RETURN(ctx, 0);
+	}
+
 	r = sc_pkcs15_encode_odf(ctx, p15card, &buf, &size);
 	if (r >= 0)
 		r = sc_pkcs15init_update_file(profile, p15card,
@@ -2483,14 +2508,9 @@ sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card,
 	LOG_FUNC_RETURN(ctx, r);
 }
 
-/*
- * Update any PKCS15 DF file (except ODF and DIR)
- */
-int
-sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card, 
-		struct sc_profile *profile,
-		struct sc_pkcs15_df *df,
-		int is_new)
+static int
+update_df(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct sc_pkcs15_df *df, int is_new)
 {
 	struct sc_context	*ctx = p15card->card->ctx;
 	struct sc_card	*card = p15card->card;
@@ -2506,7 +2526,8 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 
 	r = sc_pkcs15_encode_df(card->ctx, p15card, df, &buf, &bufsize);
 	if (r >= 0) {
-		r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+		r = sc_pkcs15init_update_file_image(profile, p15card, file, buf, bufsize,
+				&df->image, &df->image_len);
 
 		/* For better performance and robustness, we want
 		 * to note which portion of the file actually
@@ -2537,6 +2558,74 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+/*
+ * Update any PKCS15 DF file (except ODF and DIR)
+ */
+int
+sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card, 
+		struct sc_profile *profile,
+		struct sc_pkcs15_df *df,
+		int is_new)
+{
+	if (profile->defer_updates) {
+		sc_log(p15card->card->ctx, "deferring update of DF %s", sc_print_path(&df->path));
+		df->pending = 1;
+		profile->pending_dfs = 1;
+		if (is_new)
+			profile->pending_odf = 1;
+		return 0;
+	}
+	return update_df(p15card, profile, df, is_new);
+}
+
+void
+sc_pkcs15init_defer_updates(struct sc_profile *profile, int defer)
+{
+	profile->defer_updates = defer;
+}
+
+/*
+ * Write the xDFs, ODF and TokenInfo updates collected while
+ * the updates were deferred; each file is written at most once.
+ */
+int
+sc_pkcs15init_flush(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_df *df;
+	int defer = profile->defer_updates, r = 0;
+
+	LOG_FUNC_CALLED(ctx);
+	/* Keep the ODF deferred while writing the xDFs, as more than
+	 * one of them may want to update it */
+	profile->defer_updates = 1;
+	for (df = p15card->df_list; df != NULL && r >= 0; df = df->next) {
+		if (!df->pending)
+			continue;
+		r = update_df(p15card, profile, df, 0);
+		if (r >= 0)
+			df->pending = 0;
+	}
+	if (r >= 0)
+		profile->pending_dfs = 0;
+	profile->defer_updates = 0;
+
+	if (r >= 0 && profile->pending_odf) {
+		r = sc_pkcs15init_update_odf(p15card, profile);
+		if (r >= 0)
+			profile->pending_odf = 0;
+	}
+	if (r >= 0 && profile->pending_tokeninfo) {
+		r = sc_pkcs15init_update_tokeninfo(p15card, profile);
+		if (r >= 0)
+			profile->pending_tokeninfo = 0;
+	}
+	profile->defer_updates = defer;
+	LOG_TEST_RET(ctx, r, "Failed to write the deferred updates");
+
+	LOG_FUNC_RETURN(ctx, r);
+}
+
 /*
  * Add an object to one of the pkcs15 directory files.
  */
@@ -3276,19 +3365,71 @@ sc_pkcs15init_create_file(struct sc_profile *profile, struct sc_pkcs15_card *p15
 }
 
 
-int
-sc_pkcs15init_update_file(struct sc_profile *profile, 
-		struct sc_pkcs15_card *p15card, struct sc_file *file, 
-		void *data, unsigned int datalen)
+/*
+ * Write data over old, the current content of the selected file, with
+ * UPDATE BINARY for the changed ranges only. Changed ranges less than
+ * DELTA_MIN_GAP bytes apart are written together, as another command
+ * costs more than sending a few unchanged bytes; sc_update_binary()
+ * splits the ranges at the card's max_send_size.
+ */
+#define DELTA_MIN_GAP	16
+
+static int
+update_binary_delta(struct sc_card *card, const u8 *data, size_t datalen,
+		const u8 *old, size_t oldlen)
+{
+	size_t start, end, i = 0, written = 0;
+	int r;
+
+	while (i < datalen) {
+		/* Skip what is already there */
+		while (i < datalen && i < oldlen && data[i] == old[i])
+			i++;
+		if (i == datalen)
+			break;
+
+		start = i;
+		end = ++i;
+		while (i < datalen && i - end < DELTA_MIN_GAP) {
+			if (i >= oldlen || data[i] != old[i])
+				end = i + 1;
+			i++;
+		}
+		i = end;
+
+		r = sc_update_binary(card, start, data + start, end - start, 0);
+		if (r < 0)
+			return r;
+		written += end - start;
+	}
+	sc_log(card->ctx, "delta update: %u of %u bytes written", written, datalen);
+	return datalen;
+}
+
+/*
+ * Update a file; if image is given, it holds the file content known
+ * from a previous read or write (if any), and only the differences are
+ * written. On success, the image is replaced by the new content, on
+ * failure it is freed.
+ */
+static int
+sc_pkcs15init_update_file_image(struct sc_profile *profile,
+		struct sc_pkcs15_card *p15card, struct sc_file *file,
+		void *data, unsigned int datalen,
+		u8 **image, size_t *image_len)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_file	*selected_file = NULL;
 	void		*copy = NULL;
+	u8		*old = NULL;
 	int		r, need_to_zap = 0;
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "path:%s; datalen:%i", sc_print_path(&file->path), datalen);
 
+	/* The structure snapshot no longer matches the card */
+	sc_pkcs15_snapshot_invalidate(p15card);
+
 	r = sc_select_file(p15card->card, &file->path, &selected_file);
 	if (!r)   {
 		need_to_zap = 1;
@@ -3299,28 +3440,35 @@ sc_pkcs15init_update_file(struct sc_profile *profile,
 			file->size = datalen;
 
 		r = sc_pkcs15init_create_file(profile, p15card, file);
-		LOG_TEST_RET(ctx, r, "Failed to create file");
+		if (r < 0) {
+			sc_log(ctx, "Failed to create file");
+			goto out;
+		}
 		
 		r = sc_select_file(p15card->card, &file->path, &selected_file);
-		LOG_TEST_RET(ctx, r, "Failed to select newly created file");
+		if (r < 0) {
+			sc_log(ctx, "Failed to select newly created file");
+			goto out;
+		}
 	}
 	else   {
-		LOG_TEST_RET(ctx, r, "Failed to select file");
+		sc_log(ctx, "Failed to select file");
+		goto out;
 	}	
 
 	if (selected_file->size < datalen) {
 		sc_log(ctx, "File %s too small (require %u, have %u)", 
 				sc_print_path(&file->path), datalen, selected_file->size);
-		sc_file_free(selected_file);
-		LOG_TEST_RET(ctx, SC_ERROR_FILE_TOO_SMALL, "Update file failed");
+		r = SC_ERROR_FILE_TOO_SMALL;
+		goto out;
 	} 
 	else if (selected_file->size > datalen && need_to_zap) {
 		/* zero out the rest of the file - we may have shrunk
 		 * the file contents */
 		copy = calloc(1, selected_file->size);
 		if (copy == NULL) {
-			sc_file_free(selected_file);
-			return SC_ERROR_OUT_OF_MEMORY;
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
 		}
 		memcpy(copy, data, datalen);
 		datalen = selected_file->size;
@@ -3329,13 +3477,39 @@ sc_pkcs15init_update_file(struct sc_profile *profile,
 
 	/* Present authentication info needed */
 	r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
-	if (r >= 0 && datalen)
-		r = sc_update_binary(p15card->card, 0, (const unsigned char *) data, datalen, 0);
+	if (r >= 0 && datalen) {
+		if (image != NULL && *image != NULL && need_to_zap)
+			r = update_binary_delta(p15card->card, data, datalen, *image, *image_len);
+		else
+			r = sc_update_binary(p15card->card, 0, (const unsigned char *) data, datalen, 0);
+	}
+
+out:
+	if (image != NULL) {
+		/* After a failure, parts of the file may have been written:
+		 * the image is dropped so that the next write is a full one.
+		 * A failed copy only means a full write next time, too */
+		if (r >= 0 && datalen && (old = malloc(datalen)) != NULL)
+			memcpy(old, data, datalen);
+		if (*image != NULL)
+			free(*image);
+		*image = old;
+		*image_len = old != NULL ? datalen : 0;
+	}
 
 	if (copy)
 		free(copy);
-	sc_file_free(selected_file);
-	return r;
+	if (selected_file)
+		sc_file_free(selected_file);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+int
+sc_pkcs15init_update_file(struct sc_profile *profile, 
+		struct sc_pkcs15_card *p15card, struct sc_file *file, 
+		void *data, unsigned int datalen)
+{
+	return sc_pkcs15init_update_file_image(profile, p15card, file, data, datalen, NULL, NULL);
 }
 
 /*
@@ -36,6 +36,7 @@
 #endif
 #include <assert.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32  
 #include <windows.h>
@@ -44,6 +45,7 @@
 
 #include "common/compat_strlcpy.h"
 #include "scconf/scconf.h"
+#include "libopensc/internal.h"
 #include "libopensc/log.h"
 #include "libopensc/pkcs15.h"
 #include "pkcs15-init.h"
@@ -309,14 +311,183 @@ sc_profile_new(void)
 	return pro;
 }
 
+/*
+ * The parsed profile files are kept with the context (and guarded by
+ * its mutex), so that binding many cards, one after the other or in
+ * parallel, parses each file only once. A file that was modified
+ * since is parsed again. Each card still gets a profile of its own,
+ * built from the shared files.
+ */
+struct profile_file {
+	char *			path;
+	time_t			mtime;
+	off_t			size;
+	scconf_context *	conf;
+	unsigned int		refs;
+	struct profile_file *	next;
+};
+
+static void
+profile_file_free(struct profile_file *file)
+{
+	scconf_free(file->conf);
+	free(file->path);
+	free(file);
+}
+
+/* Called by sc_release_context(). Files still used by a profile are
+ * left to it */
+static void
+profile_cache_free(void *cache)
+{
+	struct profile_file *file = (struct profile_file *) cache, *next;
+
+	for (; file; file = next) {
+		next = file->next;
+		file->next = NULL;
+		if (--file->refs == 0)
+			profile_file_free(file);
+	}
+}
+
+/*
+ * With use_compiled_profiles, the compiled form of each profile file
+ * is kept in the cache directory, and compiled again when the
+ * profile file changes.
+ */
+static int
+profile_compiled_path(struct sc_context *ctx, const char *path,
+		char *buf, size_t bufsize)
+{
+	char	dir[PATH_MAX];
+	const char *name;
+	int	r;
+
+	r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+	name = strrchr(path, '/');
+#ifdef _WIN32
+	if (strrchr(path, '\\') > name)
+		name = strrchr(path, '\\');
+#endif
+	name = name ? name + 1 : path;
+	r = snprintf(buf, bufsize, "%s/profile_%s", dir, name);
+	if (r < 0 || (size_t) r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int
+profile_file_parse(struct sc_context *ctx, scconf_context *conf, int compiled)
+{
+	char	binpath[PATH_MAX];
+	int	res;
+
+	if (!compiled || profile_compiled_path(ctx, conf->filename, binpath, sizeof(binpath)))
+		return scconf_parse(conf);
+
+	res = scconf_parse_binary(conf, binpath);
+	if (res > 0) {
+		sc_log(ctx, "using compiled profile %s", binpath);
+		return res;
+	}
+
+	res = scconf_parse(conf);
+	if (res > 0) {
+		if (scconf_write_binary(conf, binpath) < 0
+		 && (sc_make_cache_dir(ctx) < 0 || scconf_write_binary(conf, binpath) < 0))
+			sc_log(ctx, "failed to write compiled profile %s", binpath);
+		else
+			sc_log(ctx, "compiled profile %s to %s", conf->filename, binpath);
+	}
+	return res;
+}
+
+/*
+ * Returns the parsed profile file, with the scconf_parse() result
+ * in *res: 1 on success, 0 on syntax error, -1 if there's no such file
+ */
+static struct profile_file *
+profile_file_get(struct sc_context *ctx, const char *path, int compiled, int *res)
+{
+	struct profile_file *file, *head, **fp;
+	struct stat	st;
+
+	if (stat(path, &st) != 0) {
+		*res = -1;
+		return NULL;
+	}
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (file = (struct profile_file *) ctx->profile_cache; file; file = file->next) {
+		if (!strcmp(file->path, path)
+		 && file->mtime == st.st_mtime && file->size == st.st_size) {
+			file->refs++;
+			break;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+	if (file) {
+		sc_log(ctx, "profile file %s already parsed", path);
+		*res = 1;
+		return file;
+	}
+
+	file = calloc(1, sizeof(*file));
+	if (file == NULL || (file->path = strdup(path)) == NULL) {
+		free(file);
+		*res = -1;
+		return NULL;
+	}
+	file->mtime = st.st_mtime;
+	file->size = st.st_size;
+	file->refs = 2;		/* the cache, and the caller */
+	file->conf = scconf_new(path);
+	*res = profile_file_parse(ctx, file->conf, compiled);
+	if (*res <= 0) {
+		profile_file_free(file);
+		return NULL;
+	}
+
+	/* Forget an older version of this file */
+	sc_mutex_lock(ctx, ctx->mutex);
+	head = (struct profile_file *) ctx->profile_cache;
+	for (fp = &head; *fp; fp = &(*fp)->next) {
+		struct profile_file *old = *fp;
+
+		if (!strcmp(old->path, path)) {
+			*fp = old->next;
+			if (--old->refs == 0)
+				profile_file_free(old);
+			break;
+		}
+	}
+	file->next = head;
+	ctx->profile_cache = file;
+	ctx->free_profile_cache = profile_cache_free;
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	return file;
+}
+
+static void
+profile_file_release(struct sc_context *ctx, struct profile_file *file)
+{
+	sc_mutex_lock(ctx, ctx->mutex);
+	if (--file->refs == 0)
+		profile_file_free(file);
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
 int
 sc_profile_load(struct sc_profile *profile, const char *filename)
 {
 	struct sc_context *ctx = profile->card->ctx;
-	scconf_context	*conf;
+	struct profile_file *file;
 	const char *profile_dir = NULL;
 	char path[PATH_MAX];
-	int             res = 0, i;
+	int             res = 0, i, compiled = 0;
 #ifdef _WIN32
 	char temp_path[PATH_MAX];
 	DWORD temp_len;
@@ -330,6 +501,12 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 		if (profile_dir)
 			break;
 	}
+	for (i = 0; ctx->conf_blocks[i]; i++) {
+		if (scconf_find_list(ctx->conf_blocks[i], "use_compiled_profiles")) {
+			compiled = scconf_get_bool(ctx->conf_blocks[i], "use_compiled_profiles", 0);
+			break;
+		}
+	}
 	if (!profile_dir) {
 #ifdef _WIN32
 		rc = RegOpenKeyEx(HKEY_CURRENT_USER, "Software\\OpenSC Project\\OpenSC", 0, KEY_QUERY_VALUE, &hKey);
@@ -364,10 +541,7 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 
 	sc_log(ctx, "Trying profile file %s", path);
 
-	conf = scconf_new(path);
-	res = scconf_parse(conf);
-
-	sc_log(ctx, "profile %s loaded ok", path);
+	file = profile_file_get(ctx, path, compiled, &res);
 
 	if (res < 0)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_FILE_NOT_FOUND);
@@ -375,8 +549,10 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 	if (res == 0)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_SYNTAX_ERROR);
 
-	res = process_conf(profile, conf);
-	scconf_free(conf);
+	sc_log(ctx, "profile %s loaded ok", path);
+
+	res = process_conf(profile, file->conf);
+	profile_file_release(ctx, file);
 	LOG_FUNC_RETURN(ctx, res);
 }
 
@@ -122,6 +122,13 @@ struct sc_profile {
 	 * has been changed) */
 	int			dirty;
 
+	/* While set, updates of the xDFs, ODF and TokenInfo are only
+	 * recorded here, and written by sc_pkcs15init_flush() */
+	int			defer_updates;
+	int			pending_dfs;	/* a DF has its pending flag set */
+	int			pending_odf;
+	int			pending_tokeninfo;
+
 	/* PKCS15 object ID style */
 	unsigned int id_style;
 };
@@ -0,0 +1,510 @@
+/*
+ * binary.c: Compiled form of a parsed configuration file
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+#include "scconf.h"
+#include "internal.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*
+ * The file starts with a header of 32-bit big endian words:
+ *
+ *   magic "SCCB", format version, size and mtime (high and low
+ *   word) of the source file, checksum and length of the data,
+ *   checksum of the source file
+ *
+ * The data is the tree of the root block. A block is its name
+ * list, the number of its items and the items; an item is its
+ * type, key and value (string, block or list). A list is the number
+ * of its strings and the strings, and a string is its length and
+ * bytes, or 0xFFFFFFFF for NULL.
+ *
+ * The source file name comes first in the data, so that a compiled
+ * file is never used for another source file. The checksum of the
+ * source file catches edits that keep its size and mtime, so what
+ * is loaded, "use_config_cache" included, is what the source says.
+ * Comments are left out, nothing reads them from a loaded
+ * configuration.
+ */
+#define BINARY_MAGIC		0x53434342	/* "SCCB" */
+#define BINARY_VERSION		3
+#define BINARY_HEADER_WORDS	8
+#define BINARY_HEADER_SIZE	(BINARY_HEADER_WORDS * 4)
+#define BINARY_NULL_STRING	0xFFFFFFFFUL
+#define BINARY_MAX_DEPTH	64
+
+typedef struct {
+	unsigned char *data;
+	size_t len, size;
+	int error;
+} scconf_binary_writer;
+
+typedef struct {
+	const unsigned char *data;
+	size_t len, pos;
+	int error;
+} scconf_binary_reader;
+
+static unsigned long checksum(const unsigned char *data, size_t len)
+{
+	unsigned long sum = 2166136261UL;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++) {
+		sum = ((sum ^ data[i]) * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return sum;
+}
+
+/* Checksum of the size bytes of the file */
+static int file_checksum(const char *filename, size_t size, unsigned long *sum)
+{
+	unsigned char *data;
+	FILE *f;
+	int ok;
+
+	data = malloc(size ? size : 1);
+	if (!data) {
+		return -1;
+	}
+	f = fopen(filename, "rb");
+	if (!f) {
+		free(data);
+		return -1;
+	}
+	ok = fread(data, 1, size, f) == size && getc(f) == EOF;
+	fclose(f);
+	if (ok) {
+		*sum = checksum(data, size);
+	}
+	free(data);
+	return ok ? 0 : -1;
+}
+
+static void put_u32(unsigned char *p, unsigned long value)
+{
+	p[0] = (value >> 24) & 0xFF;
+	p[1] = (value >> 16) & 0xFF;
+	p[2] = (value >> 8) & 0xFF;
+	p[3] = value & 0xFF;
+}
+
+static unsigned long get_u32(const unsigned char *p)
+{
+	return ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16)
+		| ((unsigned long) p[2] << 8) | p[3];
+}
+
+static void write_bytes(scconf_binary_writer * w, const void *data, size_t len)
+{
+	unsigned char *p;
+	size_t size;
+
+	if (w->error) {
+		return;
+	}
+	if (w->len + len > w->size) {
+		size = w->size ? w->size : 1024;
+		while (w->len + len > size) {
+			size *= 2;
+		}
+		p = realloc(w->data, size);
+		if (!p) {
+			w->error = 1;
+			return;
+		}
+		w->data = p;
+		w->size = size;
+	}
+	memcpy(w->data + w->len, data, len);
+	w->len += len;
+}
+
+static void write_u32(scconf_binary_writer * w, unsigned long value)
+{
+	unsigned char buf[4];
+
+	put_u32(buf, value);
+	write_bytes(w, buf, 4);
+}
+
+static void write_string(scconf_binary_writer * w, const char *str)
+{
+	if (!str) {
+		write_u32(w, BINARY_NULL_STRING);
+		return;
+	}
+	write_u32(w, strlen(str));
+	write_bytes(w, str, strlen(str));
+}
+
+static void write_list(scconf_binary_writer * w, const scconf_list * list)
+{
+	const scconf_list *l;
+	unsigned long n = 0;
+
+	for (l = list; l; l = l->next) {
+		n++;
+	}
+	write_u32(w, n);
+	for (l = list; l; l = l->next) {
+		write_string(w, l->data);
+	}
+}
+
+static void write_block(scconf_binary_writer * w, const scconf_block * block)
+{
+	const scconf_item *item;
+	unsigned long n = 0;
+
+	write_list(w, block->name);
+	for (item = block->items; item; item = item->next) {
+		if (item->type != SCCONF_ITEM_TYPE_COMMENT) {
+			n++;
+		}
+	}
+	write_u32(w, n);
+	for (item = block->items; item; item = item->next) {
+		if (item->type == SCCONF_ITEM_TYPE_COMMENT) {
+			continue;
+		}
+		write_u32(w, item->type);
+		write_string(w, item->key);
+		switch (item->type) {
+		case SCCONF_ITEM_TYPE_BLOCK:
+			write_block(w, item->value.block);
+			break;
+		case SCCONF_ITEM_TYPE_VALUE:
+			write_list(w, item->value.list);
+			break;
+		default:
+			w->error = 1;
+			break;
+		}
+	}
+}
+
+int scconf_write_binary(scconf_context * config, const char *filename)
+{
+	scconf_binary_writer w;
+	unsigned char header[BINARY_HEADER_SIZE];
+	char tmpname[1024];
+	struct stat st;
+	unsigned long source_sum;
+	FILE *f;
+	int ok;
+
+	if (!config || !config->filename || !filename) {
+		return -1;
+	}
+	if (stat(config->filename, &st) != 0
+	    || file_checksum(config->filename, st.st_size, &source_sum) != 0) {
+		return -1;
+	}
+	memset(&w, 0, sizeof(w));
+	write_string(&w, config->filename);
+	write_block(&w, config->root);
+	if (w.error) {
+		free(w.data);
+		return -1;
+	}
+
+	put_u32(header, BINARY_MAGIC);
+	put_u32(header + 4, BINARY_VERSION);
+	put_u32(header + 8, (unsigned long) st.st_size);
+	put_u32(header + 12, (unsigned long) (((unsigned long long) st.st_mtime >> 32) & 0xFFFFFFFFUL));
+	put_u32(header + 16, (unsigned long) (st.st_mtime & 0xFFFFFFFFUL));
+	put_u32(header + 20, checksum(w.data, w.len));
+	put_u32(header + 24, w.len);
+	put_u32(header + 28, source_sum);
+
+	/* Readers must never see a partially written file, and writers
+	 * must not share a temporary one */
+#ifdef HAVE_MKSTEMP
+	{
+		int fd;
+
+		snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename);
+		fd = mkstemp(tmpname);
+		if (fd < 0) {
+			free(w.data);
+			return -1;
+		}
+		f = fdopen(fd, "wb");
+		if (!f) {
+			close(fd);
+			unlink(tmpname);
+			free(w.data);
+			return -1;
+		}
+	}
+#else
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+	f = fopen(tmpname, "wb");
+	if (!f) {
+		free(w.data);
+		return -1;
+	}
+#endif
+	ok = fwrite(header, 1, sizeof(header), f) == sizeof(header)
+		&& fwrite(w.data, 1, w.len, f) == w.len;
+	if (fclose(f) != 0) {
+		ok = 0;
+	}
+	free(w.data);
+#ifdef _WIN32
+	if (ok) {
+		unlink(filename);
+	}
+#endif
+	if (!ok || rename(tmpname, filename) != 0) {
+		unlink(tmpname);
+		return -1;
+	}
+	return 1;
+}
+
+static unsigned long read_u32(scconf_binary_reader * r)
+{
+	unsigned long value;
+
+	if (r->error || r->len - r->pos < 4) {
+		r->error = 1;
+		return 0;
+	}
+	value = get_u32(r->data + r->pos);
+	r->pos += 4;
+	return value;
+}
+
+/* Returns a newly allocated copy of the string, or NULL */
+static char *read_string(scconf_binary_reader * r)
+{
+	unsigned long len;
+	char *str;
+
+	len = read_u32(r);
+	if (r->error || len == BINARY_NULL_STRING) {
+		return NULL;
+	}
+	if (r->len - r->pos < len) {
+		r->error = 1;
+		return NULL;
+	}
+	str = malloc(len + 1);
+	if (!str) {
+		r->error = 1;
+		return NULL;
+	}
+	memcpy(str, r->data + r->pos, len);
+	str[len] = '\0';
+	r->pos += len;
+	return str;
+}
+
+static scconf_list *read_list(scconf_binary_reader * r)
+{
+	scconf_list *list = NULL, **tail = &list;
+	unsigned long n;
+
+	for (n = read_u32(r); n > 0 && !r->error; n--) {
+		*tail = malloc(sizeof(scconf_list));
+		if (!*tail) {
+			r->error = 1;
+			break;
+		}
+		(*tail)->next = NULL;
+		(*tail)->data = read_string(r);
+		tail = &(*tail)->next;
+	}
+	return list;
+}
+
+static scconf_block *read_block(scconf_binary_reader * r, scconf_block * parent, int depth)
+{
+	scconf_block *block;
+	scconf_item **tail;
+	unsigned long n;
+
+	if (depth > BINARY_MAX_DEPTH) {
+		r->error = 1;
+		return NULL;
+	}
+	block = malloc(sizeof(scconf_block));
+	if (!block) {
+		r->error = 1;
+		return NULL;
+	}
+	memset(block, 0, sizeof(scconf_block));
+	block->parent = parent;
+	block->name = read_list(r);
+
+	tail = &block->items;
+	for (n = read_u32(r); n > 0 && !r->error; n--) {
+		scconf_item *item;
+
+		item = malloc(sizeof(scconf_item));
+		if (!item) {
+			r->error = 1;
+			break;
+		}
+		memset(item, 0, sizeof(scconf_item));
+		*tail = item;
+		tail = &item->next;
+
+		item->type = read_u32(r);
+		item->key = read_string(r);
+		switch (item->type) {
+		case SCCONF_ITEM_TYPE_BLOCK:
+			item->value.block = read_block(r, block, depth + 1);
+			if (!item->value.block) {
+				r->error = 1;
+			}
+			break;
+		case SCCONF_ITEM_TYPE_VALUE:
+			item->value.list = read_list(r);
+			break;
+		default:
+			r->error = 1;
+			break;
+		}
+	}
+	return block;
+}
+
+static int parse_binary_data(scconf_context * config, const struct stat *st,
+			     const unsigned char *data, size_t len)
+{
+	scconf_binary_reader r;
+	scconf_block *root;
+	unsigned long mtime_hi, mtime_lo, datalen, source_sum;
+	char *source;
+
+	if (len < BINARY_HEADER_SIZE
+	    || get_u32(data) != BINARY_MAGIC
+	    || get_u32(data + 4) != BINARY_VERSION) {
+		return 0;
+	}
+	mtime_hi = (unsigned long) (((unsigned long long) st->st_mtime >> 32) & 0xFFFFFFFFUL);
+	mtime_lo = (unsigned long) (st->st_mtime & 0xFFFFFFFFUL);
+	datalen = get_u32(data + 24);
+	if (get_u32(data + 8) != (unsigned long) st->st_size
+	    || get_u32(data + 12) != mtime_hi
+	    || get_u32(data + 16) != mtime_lo
+	    || datalen != len - BINARY_HEADER_SIZE
+	    || get_u32(data + 20) != checksum(data + BINARY_HEADER_SIZE, datalen)) {
+		return 0;
+	}
+	if (file_checksum(config->filename, st->st_size, &source_sum) != 0
+	    || get_u32(data + 28) != source_sum) {
+		return 0;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.data = data + BINARY_HEADER_SIZE;
+	r.len = datalen;
+	source = read_string(&r);
+	if (!source || strcmp(source, config->filename)) {
+		free(source);
+		return 0;
+	}
+	free(source);
+
+	root = read_block(&r, NULL, 0);
+	if (r.error || r.pos != r.len) {
+		scconf_block_destroy(root);
+		return 0;
+	}
+	scconf_block_index(root);
+	scconf_block_destroy(config->root);
+	config->root = root;
+	return 1;
+}
+
+int scconf_parse_binary(scconf_context * config, const char *filename)
+{
+	static char buffer[256];
+	struct stat st, bst;
+	unsigned char *data;
+	int fd, r;
+
+	if (!config || !config->filename || !filename) {
+		return -1;
+	}
+	if (stat(config->filename, &st) != 0) {
+		return -1;
+	}
+	fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &bst) != 0 || bst.st_size < BINARY_HEADER_SIZE) {
+		close(fd);
+		return 0;
+	}
+
+#ifdef HAVE_SYS_MMAN_H
+	data = mmap(NULL, bst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+	r = parse_binary_data(config, &st, data, bst.st_size);
+	munmap(data, bst.st_size);
+#else
+	data = malloc(bst.st_size);
+	if (!data) {
+		close(fd);
+		return -1;
+	}
+	r = read(fd, data, bst.st_size) == bst.st_size
+		? parse_binary_data(config, &st, data, bst.st_size) : 0;
+	close(fd);
+	free(data);
+#endif
+
+	if (r <= 0) {
+		snprintf(buffer, sizeof(buffer),
+			 "\"%s\" is not a current compiled form of \"%s\"",
+			 filename, config->filename);
+		config->errmsg = buffer;
+	}
+	return r;
+}
@@ -54,6 +54,11 @@ extern int scconf_lex_parse_string(scconf_parser * parser,
 				   const char *config_string);
 extern void scconf_parse_token(scconf_parser * parser, int token_type, const char *token);
 
+/* Build the lookup index of block and all of its sub-blocks */
+extern void scconf_block_index(scconf_block * block);
+/* Drop the lookup index of block after it has been modified */
+extern void scconf_block_unindex(scconf_block * block);
+
 #ifdef __cplusplus
 }
 #endif
@@ -116,6 +116,7 @@ static scconf_item *scconf_item_add_internal(scconf_parser * parser, int type)
 	item->key = parser->key;
 	parser->key = NULL;
 
+	scconf_block_unindex(parser->block);
 	if (parser->last_item) {
 		parser->last_item->next = item;
 	} else {
@@ -390,6 +391,7 @@ int scconf_parse(scconf_context * config)
 		strlcpy(buffer, p.emesg, sizeof(buffer));
 		r = 0;
 	} else {
+		scconf_block_index(config->root);
 		r = 1;
 	}
 
@@ -417,6 +419,7 @@ int scconf_parse_string(scconf_context * config, const char *string)
 		strlcpy(buffer, p.emesg, sizeof(buffer));
 		r = 0;
 	} else {
+		scconf_block_index(config->root);
 		r = 1;
 	}
 
@@ -30,6 +30,7 @@
 #include <ctype.h>
 
 #include "scconf.h"
+#include "internal.h"
 
 scconf_context *scconf_new(const char *filename)
 {
@@ -64,6 +65,124 @@ void scconf_free(scconf_context * config)
 	}
 }
 
+/* Blocks with fewer items are searched linearly */
+#define SCCONF_INDEX_MIN_ITEMS	8
+
+typedef struct {
+	scconf_item *item;
+	unsigned int pos;
+} scconf_index_entry;
+
+static int index_entry_cmp(const void *a, const void *b)
+{
+	const scconf_index_entry *ea = (const scconf_index_entry *) a;
+	const scconf_index_entry *eb = (const scconf_index_entry *) b;
+	int r;
+
+	r = strcasecmp(ea->item->key, eb->item->key);
+	if (r) {
+		return r;
+	}
+	/* Keep items with the same key in the order of the file */
+	return ea->pos < eb->pos ? -1 : ea->pos > eb->pos;
+}
+
+void scconf_block_unindex(scconf_block * block)
+{
+	if (block && block->index) {
+		free(block->index);
+		block->index = NULL;
+		block->index_len = 0;
+	}
+}
+
+void scconf_block_index(scconf_block * block)
+{
+	scconf_index_entry *entries;
+	scconf_item *item;
+	unsigned int n = 0, i;
+
+	if (!block) {
+		return;
+	}
+	scconf_block_unindex(block);
+	for (item = block->items; item; item = item->next) {
+		if (item->type == SCCONF_ITEM_TYPE_BLOCK) {
+			scconf_block_index(item->value.block);
+		}
+		if (item->type != SCCONF_ITEM_TYPE_COMMENT && item->key) {
+			n++;
+		}
+	}
+	if (n < SCCONF_INDEX_MIN_ITEMS) {
+		return;
+	}
+	entries = malloc(n * sizeof(scconf_index_entry));
+	if (!entries) {
+		return;
+	}
+	block->index = malloc(n * sizeof(scconf_item *));
+	if (!block->index) {
+		free(entries);
+		return;
+	}
+	for (i = 0, item = block->items; item; item = item->next) {
+		if (item->type != SCCONF_ITEM_TYPE_COMMENT && item->key) {
+			entries[i].item = item;
+			entries[i].pos = i;
+			i++;
+		}
+	}
+	qsort(entries, n, sizeof(scconf_index_entry), index_entry_cmp);
+	for (i = 0; i < n; i++) {
+		block->index[i] = entries[i].item;
+	}
+	block->index_len = n;
+	free(entries);
+}
+
+/* Position of the first indexed item with the key, or index_len */
+static unsigned int index_lookup(const scconf_block * block, const char *key)
+{
+	unsigned int lo = 0, hi = block->index_len, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcasecmp(block->index[mid]->key, key) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static scconf_item *find_item(const scconf_block * block, int type, const char *key)
+{
+	scconf_item *item;
+	unsigned int i;
+
+	if (block->index) {
+		for (i = index_lookup(block, key); i < block->index_len; i++) {
+			item = block->index[i];
+			if (strcasecmp(key, item->key) != 0) {
+				break;
+			}
+			if (item->type == type) {
+				return item;
+			}
+		}
+		return NULL;
+	}
+	for (item = block->items; item; item = item->next) {
+		if (item->type == type &&
+		    strcasecmp(key, item->key) == 0) {
+			return item;
+		}
+	}
+	return NULL;
+}
+
 const scconf_block *scconf_find_block(const scconf_context * config, const scconf_block * block, const char *item_name)
 {
 	scconf_item *item;
@@ -74,20 +193,34 @@ const scconf_block *scconf_find_block(const scconf_context * config, const sccon
 	if (!item_name) {
 		return NULL;
 	}
-	for (item = block->items; item; item = item->next) {
-		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
-		    strcasecmp(item_name, item->key) == 0) {
-			return item->value.block;
+	item = find_item(block, SCCONF_ITEM_TYPE_BLOCK, item_name);
+	return item ? item->value.block : NULL;
+}
+
+static int add_found_block(scconf_block *** blocks, int *size, int *alloc_size, scconf_block * block)
+{
+	scconf_block **tmp;
+
+	if (*size + 1 >= *alloc_size) {
+		*alloc_size *= 2;
+		tmp = (scconf_block **) realloc(*blocks, sizeof(scconf_block *) * *alloc_size);
+		if (!tmp) {
+			free(*blocks);
+			*blocks = NULL;
+			return 0;
 		}
+		*blocks = tmp;
 	}
-	return NULL;
+	(*blocks)[(*size)++] = block;
+	return 1;
 }
 
 scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_block * block, const char *item_name, const char *key)
 {
-	scconf_block **blocks = NULL, **tmp;
+	scconf_block **blocks = NULL;
 	int alloc_size, size;
 	scconf_item *item;
+	unsigned int i;
 
 	if (!block) {
 		block = config->root;
@@ -98,23 +231,38 @@ scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_bl
 	size = 0;
 	alloc_size = 10;
 	blocks = (scconf_block **) realloc(blocks, sizeof(scconf_block *) * alloc_size);
+	if (!blocks) {
+		return NULL;
+	}
 
-	for (item = block->items; item; item = item->next) {
-		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
-		    strcasecmp(item_name, item->key) == 0) {
+	if (block->index) {
+		for (i = index_lookup(block, item_name); i < block->index_len; i++) {
+			item = block->index[i];
+			if (strcasecmp(item_name, item->key) != 0) {
+				break;
+			}
+			if (item->type != SCCONF_ITEM_TYPE_BLOCK) {
+				continue;
+			}
 			if (key && strcasecmp(key, item->value.block->name->data)) {
 				continue;
 			}
-			if (size + 1 >= alloc_size) {
-				alloc_size *= 2;
-				tmp = (scconf_block **) realloc(blocks, sizeof(scconf_block *) * alloc_size);
-				if (!tmp) {
-					free(blocks);
-					return NULL;
-				}
-				blocks = tmp;
+			if (!add_found_block(&blocks, &size, &alloc_size, item->value.block)) {
+				return NULL;
+			}
+		}
+	} else {
+		for (item = block->items; item; item = item->next) {
+			if (item->type != SCCONF_ITEM_TYPE_BLOCK ||
+			    strcasecmp(item_name, item->key) != 0) {
+				continue;
+			}
+			if (key && strcasecmp(key, item->value.block->name->data)) {
+				continue;
+			}
+			if (!add_found_block(&blocks, &size, &alloc_size, item->value.block)) {
+				return NULL;
 			}
-			blocks[size++] = item->value.block;
 		}
 	}
 	blocks[size] = NULL;
@@ -128,13 +276,8 @@ const scconf_list *scconf_find_list(const scconf_block * block, const char *opti
 	if (!block) {
 		return NULL;
 	}
-	for (item = block->items; item; item = item->next) {
-		if (item->type == SCCONF_ITEM_TYPE_VALUE &&
-		    strcasecmp(option, item->key) == 0) {
-			return item->value.list;
-		}
-	}
-	return NULL;
+	item = find_item(block, SCCONF_ITEM_TYPE_VALUE, option);
+	return item ? item->value.list : NULL;
 }
 
 const char *scconf_get_str(const scconf_block * block, const char *option, const char *def)
@@ -294,6 +437,7 @@ void scconf_block_destroy(scconf_block * block)
 	if (block) {
 		scconf_list_destroy(block->name);
 		scconf_item_destroy(block->items);
+		free(block->index);
 		free(block);
 	}
 }
@@ -78,6 +78,10 @@ struct _scconf_block {
 	scconf_block *parent;
 	scconf_list *name;
 	scconf_item *items;
+	/* Block and value items sorted by key, for the lookups in
+	 * large blocks. NULL if the block has not been indexed. */
+	scconf_item **index;
+	unsigned int index_len;
 };
 
 typedef struct {
@@ -116,6 +120,18 @@ extern int scconf_parse_entries(const scconf_context * config, const scconf_bloc
  */
 extern int scconf_write(scconf_context * config, const char *filename);
 
+/* Write the compiled form of the parsed configuration to filename.
+ * Loading it with scconf_parse_binary() saves lexing and parsing
+ * the source file again.
+ */
+extern int scconf_write_binary(scconf_context * config, const char *filename);
+
+/* Load the compiled form of config->filename from filename.
+ * Returns 1 = ok, 0 = stale or invalid (the source file has changed
+ * since it was compiled), -1 = cannot be read
+ */
+extern int scconf_parse_binary(scconf_context * config, const char *filename);
+
 /* Write configuration entries to block
  */
 extern int scconf_write_entries(scconf_context * config, scconf_block * block, scconf_entry * entry);
@@ -2,7 +2,7 @@
 TOPDIR = ..\..
 
 TARGETS = base64.exe p15dump.exe \
-	  p15dump.exe pintest.exe # prngtest.exe lottery.exe
+	  p15dump.exe pintest.exe # prngtest.exe lottery.exe apdubench.exe p15bench.exe
 
 all: print.obj sc-test.obj $(TARGETS)
 $(TARGETS): $(TOPDIR)\win32\versioninfo.res print.obj sc-test.obj \
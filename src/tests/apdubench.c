@@ -0,0 +1,88 @@
+/*
+ * apdubench.c: Measure raw APDU throughput of a reader
+ *
+ * Sends a fixed number of SELECT MF (case 3) and GET CHALLENGE
+ * (case 2) commands and reports APDUs per second. The status word
+ * returned by the card does not matter, only the round trip is timed.
+ *
+ * usage: apdubench [-r reader] [-c driver] [-d] [count]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "libopensc/opensc.h"
+#include "sc-test.h"
+
+static double elapsed_ms(const struct timeval *from, const struct timeval *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_usec - from->tv_usec) / 1000.0;
+}
+
+static int run(const char *name, sc_apdu_t *tmpl, int count)
+{
+	struct timeval tv1, tv2;
+	unsigned long sent;
+	u8 rbuf[SC_MAX_APDU_BUFFER_SIZE];
+	double ms;
+	int i, r = 0;
+
+	sc_lock(card);
+	sent = card->apdu_stats.transmitted;
+	gettimeofday(&tv1, NULL);
+	for (i = 0; i < count; i++) {
+		sc_apdu_t apdu = *tmpl;
+
+		apdu.resp = rbuf;
+		apdu.resplen = sizeof(rbuf);
+		r = sc_transmit_apdu(card, &apdu);
+		if (r != SC_SUCCESS)
+			break;
+	}
+	gettimeofday(&tv2, NULL);
+	sent = card->apdu_stats.transmitted - sent;
+	sc_unlock(card);
+
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "%s: transmit failed after %d APDUs: %s\n",
+			name, i, sc_strerror(r));
+		return 1;
+	}
+	ms = elapsed_ms(&tv1, &tv2);
+	printf("%-16s %8d cmds %8lu APDUs %10.1f ms %10.1f APDU/s %8.1f us/APDU\n",
+		name, count, sent, ms, ms > 0 ? sent * 1000.0 / ms : 0.0,
+		sent ? ms * 1000.0 / sent : 0.0);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const u8 mf[2] = { 0x3F, 0x00 };
+	sc_apdu_t apdu;
+	int count = 1000, err = 0;
+
+	if (sc_test_init(&argc, argv))
+		return 1;
+	if (argv[argc] != NULL)
+		count = atoi(argv[argc]);
+	if (count <= 0)
+		count = 1000;
+
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0xA4, 0x00, 0x0C);
+	apdu.lc = apdu.datalen = sizeof(mf);
+	apdu.data = mf;
+	err |= run("SELECT MF", &apdu, count);
+
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0x84, 0x00, 0x00);
+	apdu.le = 8;
+	err |= run("GET CHALLENGE", &apdu, count);
+
+	sc_test_cleanup();
+	return err;
+}
@@ -0,0 +1,618 @@
+/*
+ * p15bench.c: Latency benchmark of the common PKCS #15 operations
+ *
+ * Runs each operation a number of times and reports the latency
+ * distribution and the APDUs it took:
+ *
+ *   connect      sc_connect_card() and sc_disconnect_card()
+ *   bind         sc_pkcs15_bind() and sc_pkcs15_unbind()
+ *   read-cert    sc_pkcs15_read_certificate() of the first certificate
+ *   sign         sc_pkcs15_compute_signature(), PKCS #1 over 20 bytes
+ *   decipher     sc_pkcs15_decipher(), raw RSA
+ *   find-objects C_FindObjectsInit/C_FindObjects/C_FindObjectsFinal
+ *   multipart-sign C_SignInit, C_SignUpdate in 64 KiB parts and
+ *                C_SignFinal over -s bytes, SHA-256 (or SHA-1) with RSA
+ *
+ * sign and decipher use the first private key allowing the operation
+ * and need the PIN (-p). find-objects and multipart-sign load a
+ * PKCS #11 module (-m); find-objects enumerates all objects of the
+ * first token and multipart-sign uses its first signing key. The APDUs
+ * the module sends cannot be counted from here. multipart-sign also
+ * reports the throughput of the host side hashing.
+ *
+ * With -o csv or -o json the results are written in a form that can be
+ * compared between builds.
+ *
+ * usage: p15bench [-r reader] [-n count] [-p pin] [-m module] [-s size]
+ *                 [-o format] [-d]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "common/compat_getopt.h"
+#include "common/compat_strlcpy.h"
+#include "pkcs11/pkcs11.h"
+#include "common/libpkcs11.h"
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+
+enum { OUT_TEXT, OUT_CSV, OUT_JSON };
+
+struct bench {
+	const char *name;
+	int runs;		/* successful runs */
+	int errors;
+	double *us;		/* latency of each successful run */
+	unsigned long apdus;	/* total over successful runs */
+	int counted;		/* apdus is valid */
+	unsigned long bytes;	/* data processed per run, for the throughput */
+	const char *skipped;	/* reason the operation did not run */
+};
+
+static const struct option options[] = {
+	{ "reader",	1, NULL, 'r' },
+	{ "count",	1, NULL, 'n' },
+	{ "pin",	1, NULL, 'p' },
+	{ "module",	1, NULL, 'm' },
+	{ "size",	1, NULL, 's' },
+	{ "output",	1, NULL, 'o' },
+	{ "debug",	0, NULL, 'd' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static sc_context_t *ctx;
+static sc_reader_t *reader;
+static int opt_count = 100;
+static unsigned long opt_size = 4 * 1024 * 1024;
+static const char *opt_pin, *opt_module;
+
+static struct bench benches[] = {
+	{ "connect" },
+	{ "bind" },
+	{ "read-cert" },
+	{ "sign" },
+	{ "decipher" },
+	{ "find-objects" },
+	{ "multipart-sign" },
+};
+#define NBENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static double now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static void bench_record(struct bench *b, double start, int r,
+		unsigned long apdus)
+{
+	if (r < 0) {
+		if (b->errors++ == 0)
+			fprintf(stderr, "%s: %s\n", b->name, sc_strerror(r));
+		return;
+	}
+	b->us[b->runs++] = now_us() - start;
+	b->apdus += apdus;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of the sorted samples */
+static double percentile(const struct bench *b, int pct)
+{
+	int i = (b->runs * pct + 99) / 100;
+
+	return b->us[i > 0 ? i - 1 : 0];
+}
+
+static double mean(const struct bench *b)
+{
+	double sum = 0;
+	int i;
+
+	for (i = 0; i < b->runs; i++)
+		sum += b->us[i];
+	return sum / b->runs;
+}
+
+/* MB (10^6 bytes) per second at the median latency */
+static double throughput(const struct bench *b)
+{
+	return b->bytes / percentile(b, 50);
+}
+
+/*
+ * The operations
+ */
+static void bench_connect(struct bench *b)
+{
+	sc_card_t *card;
+	double t;
+	int i, r;
+
+	for (i = 0; i < opt_count; i++) {
+		unsigned long apdus = 0;
+
+		t = now_us();
+		r = sc_connect_card(reader, &card);
+		if (r == SC_SUCCESS) {
+			apdus = card->apdu_stats.transmitted;
+			sc_disconnect_card(card);
+		}
+		bench_record(b, t, r, apdus);
+	}
+	b->counted = 1;
+}
+
+static void bench_bind(struct bench *b, sc_card_t *card)
+{
+	struct sc_pkcs15_card *p15card;
+	unsigned long sent;
+	double t;
+	int i, r;
+
+	for (i = 0; i < opt_count; i++) {
+		sent = card->apdu_stats.transmitted;
+		t = now_us();
+		r = sc_pkcs15_bind(card, NULL, &p15card);
+		if (r == SC_SUCCESS)
+			sc_pkcs15_unbind(p15card);
+		bench_record(b, t, r, card->apdu_stats.transmitted - sent);
+	}
+	b->counted = 1;
+}
+
+static void bench_read_cert(struct bench *b, struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_object *obj;
+	struct sc_pkcs15_cert *cert;
+	sc_card_t *card = p15card->card;
+	unsigned long sent;
+	double t;
+	int i, r;
+
+	if (sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_CERT_X509, &obj, 1) != 1) {
+		b->skipped = "no certificate";
+		return;
+	}
+	for (i = 0; i < opt_count; i++) {
+		sent = card->apdu_stats.transmitted;
+		t = now_us();
+		r = sc_pkcs15_read_certificate(p15card, obj->data, &cert);
+		if (r == SC_SUCCESS)
+			sc_pkcs15_free_certificate(cert);
+		bench_record(b, t, r, card->apdu_stats.transmitted - sent);
+	}
+	b->counted = 1;
+}
+
+static struct sc_pkcs15_object *find_key(struct sc_pkcs15_card *p15card,
+		unsigned int usage)
+{
+	struct sc_pkcs15_object *objs[32];
+	int i, n;
+
+	n = sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_PRKEY_RSA, objs, 32);
+	for (i = 0; i < n; i++) {
+		struct sc_pkcs15_prkey_info *info = objs[i]->data;
+
+		if (info->usage & usage)
+			return objs[i];
+	}
+	return NULL;
+}
+
+static int verify_pin(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *key)
+{
+	struct sc_pkcs15_object *pin;
+
+	if (key->auth_id.len == 0)
+		return SC_SUCCESS;
+	if (opt_pin == NULL)
+		return SC_ERROR_SECURITY_STATUS_NOT_SATISFIED;
+	if (sc_pkcs15_find_pin_by_auth_id(p15card, &key->auth_id, &pin) != SC_SUCCESS)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	return sc_pkcs15_verify_pin(p15card, pin, (const u8 *) opt_pin, strlen(opt_pin));
+}
+
+static void bench_crypt(struct bench *b, struct sc_pkcs15_card *p15card, int sign)
+{
+	struct sc_pkcs15_object *key;
+	struct sc_pkcs15_prkey_info *info;
+	sc_card_t *card = p15card->card;
+	u8 in[512], out[512];
+	unsigned long sent;
+	size_t len;
+	double t;
+	int i, r;
+
+	key = find_key(p15card, sign ? SC_PKCS15_PRKEY_USAGE_SIGN
+			: SC_PKCS15_PRKEY_USAGE_DECRYPT);
+	if (key == NULL) {
+		b->skipped = "no suitable RSA key";
+		return;
+	}
+	info = key->data;
+	len = info->modulus_length / 8;
+	if (len == 0 || len > sizeof(in)) {
+		b->skipped = "unsupported key length";
+		return;
+	}
+	r = verify_pin(p15card, key);
+	if (r != SC_SUCCESS) {
+		b->skipped = opt_pin ? "PIN verification failed" : "no PIN given";
+		return;
+	}
+
+	/* a digest for signing, a value below any modulus for decipher */
+	for (i = 0; i < (int) len; i++)
+		in[i] = i + 1;
+	in[0] = 0;
+
+	for (i = 0; i < opt_count; i++) {
+		sent = card->apdu_stats.transmitted;
+		t = now_us();
+		if (sign)
+			r = sc_pkcs15_compute_signature(p15card, key,
+					SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE,
+					in, 20, out, sizeof(out));
+		else
+			r = sc_pkcs15_decipher(p15card, key, SC_ALGORITHM_RSA_RAW,
+					in, len, out, sizeof(out));
+		bench_record(b, t, r, card->apdu_stats.transmitted - sent);
+	}
+	b->counted = 1;
+}
+
+static void bench_find_objects(struct bench *b, CK_FUNCTION_LIST_PTR p11,
+		CK_SESSION_HANDLE session)
+{
+	CK_OBJECT_HANDLE objs[64];
+	CK_ULONG n;
+	CK_RV rv;
+	double t;
+	int i;
+
+	for (i = 0; i < opt_count; i++) {
+		t = now_us();
+		rv = p11->C_FindObjectsInit(session, NULL, 0);
+		while (rv == CKR_OK) {
+			rv = p11->C_FindObjects(session, objs, 64, &n);
+			if (rv != CKR_OK || n == 0)
+				break;
+		}
+		p11->C_FindObjectsFinal(session);
+		if (rv != CKR_OK) {
+			if (b->errors++ == 0)
+				fprintf(stderr, "%s: C_FindObjects failed: 0x%lx\n", b->name, rv);
+			continue;
+		}
+		b->us[b->runs++] = now_us() - t;
+	}
+}
+
+static void bench_multipart_sign(struct bench *b, CK_FUNCTION_LIST_PTR p11,
+		CK_SESSION_HANDLE session)
+{
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_BBOOL true_val = TRUE;
+	CK_ATTRIBUTE tmpl[] = {
+		{ CKA_CLASS, &class, sizeof(class) },
+		{ CKA_SIGN, &true_val, sizeof(true_val) },
+	};
+	CK_MECHANISM mech = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+	CK_OBJECT_HANDLE key;
+	CK_BYTE part[65536], sig[512];
+	CK_ULONG n, siglen, done;
+	CK_RV rv;
+	double t;
+	int i;
+
+	rv = p11->C_FindObjectsInit(session, tmpl, 2);
+	if (rv == CKR_OK)
+		rv = p11->C_FindObjects(session, &key, 1, &n);
+	p11->C_FindObjectsFinal(session);
+	if (rv != CKR_OK || n == 0) {
+		b->skipped = opt_pin ? "no signing key" : "no PIN given";
+		return;
+	}
+	rv = p11->C_SignInit(session, &mech, key);
+	if (rv == CKR_MECHANISM_INVALID) {
+		mech.mechanism = CKM_SHA1_RSA_PKCS;
+		rv = p11->C_SignInit(session, &mech, key);
+	}
+	if (rv != CKR_OK) {
+		b->skipped = "C_SignInit failed";
+		return;
+	}
+	/* an operation that was initialized is ended by C_SignFinal */
+	siglen = sizeof(sig);
+	p11->C_SignFinal(session, sig, &siglen);
+
+	for (i = 0; i < (int) sizeof(part); i++)
+		part[i] = i;
+	b->bytes = opt_size;
+
+	for (i = 0; i < opt_count; i++) {
+		t = now_us();
+		rv = p11->C_SignInit(session, &mech, key);
+		for (done = 0; rv == CKR_OK && done < opt_size; done += n) {
+			n = opt_size - done < sizeof(part) ? opt_size - done : sizeof(part);
+			rv = p11->C_SignUpdate(session, part, n);
+		}
+		siglen = sizeof(sig);
+		if (rv == CKR_OK)
+			rv = p11->C_SignFinal(session, sig, &siglen);
+		if (rv != CKR_OK) {
+			if (b->errors++ == 0)
+				fprintf(stderr, "%s: signing failed: 0x%lx\n", b->name, rv);
+			continue;
+		}
+		b->us[b->runs++] = now_us() - t;
+	}
+}
+
+static void bench_module(struct bench *find, struct bench *sign)
+{
+	CK_FUNCTION_LIST_PTR p11;
+	CK_SLOT_ID slots[16];
+	CK_ULONG nslots = 16;
+	CK_SESSION_HANDLE session;
+	CK_RV rv;
+	const char *skipped = NULL;
+	void *module;
+
+	if (opt_module == NULL) {
+		find->skipped = sign->skipped = "no PKCS #11 module given";
+		return;
+	}
+	module = C_LoadModule(opt_module, &p11);
+	if (module == NULL) {
+		find->skipped = sign->skipped = "cannot load PKCS #11 module";
+		return;
+	}
+	rv = p11->C_Initialize(NULL);
+	if (rv != CKR_OK) {
+		skipped = "C_Initialize failed";
+		goto out;
+	}
+	rv = p11->C_GetSlotList(TRUE, slots, &nslots);
+	if (rv != CKR_OK || nslots == 0) {
+		skipped = "no token";
+		goto fin;
+	}
+	rv = p11->C_OpenSession(slots[0], CKF_SERIAL_SESSION, NULL, NULL, &session);
+	if (rv != CKR_OK) {
+		skipped = "C_OpenSession failed";
+		goto fin;
+	}
+	if (opt_pin != NULL)
+		p11->C_Login(session, CKU_USER, (CK_UTF8CHAR_PTR) opt_pin, strlen(opt_pin));
+
+	bench_find_objects(find, p11, session);
+	bench_multipart_sign(sign, p11, session);
+	p11->C_CloseSession(session);
+fin:
+	p11->C_Finalize(NULL);
+out:
+	C_UnloadModule(module);
+	if (skipped != NULL)
+		find->skipped = sign->skipped = skipped;
+}
+
+/*
+ * Output
+ */
+static void print_results(int format, const char *card_name)
+{
+	size_t i;
+
+	if (format == OUT_CSV)
+		printf("operation,runs,errors,apdus_per_run,min_us,mean_us,median_us,p90_us,p99_us,max_us,"
+			"mb_per_s,skipped\n");
+	else if (format == OUT_JSON)
+		printf("{\n  \"opensc_version\": \"%s\",\n  \"reader\": \"%s\",\n"
+			"  \"card\": \"%s\",\n  \"count\": %d,\n  \"results\": [",
+			sc_get_version(), reader->name, card_name, opt_count);
+	else
+		printf("%-14s %5s %5s %7s %10s %10s %10s %10s %10s %10s\n",
+			"operation", "runs", "errs", "APDUs", "min us", "mean us",
+			"median us", "p90 us", "p99 us", "max us");
+
+	for (i = 0; i < NBENCHES; i++) {
+		struct bench *b = &benches[i];
+		double per_run = -1;
+
+		if (b->runs > 0)
+			qsort(b->us, b->runs, sizeof(double), cmp_double);
+		if (b->counted && b->runs > 0)
+			per_run = (double) b->apdus / b->runs;
+
+		if (format == OUT_JSON) {
+			printf("%s\n    { \"operation\": \"%s\", ", i ? "," : "", b->name);
+			if (b->skipped != NULL) {
+				printf("\"skipped\": \"%s\" }", b->skipped);
+				continue;
+			}
+			printf("\"runs\": %d, \"errors\": %d, ", b->runs, b->errors);
+			if (per_run >= 0)
+				printf("\"apdus_per_run\": %.2f", per_run);
+			else
+				printf("\"apdus_per_run\": null");
+			if (b->runs > 0)
+				printf(", \"min_us\": %.1f, \"mean_us\": %.1f, \"median_us\": %.1f, "
+					"\"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f",
+					b->us[0], mean(b), percentile(b, 50), percentile(b, 90),
+					percentile(b, 99), b->us[b->runs - 1]);
+			if (b->bytes != 0 && b->runs > 0)
+				printf(", \"mb_per_s\": %.1f", throughput(b));
+			printf(" }");
+		} else if (format == OUT_CSV) {
+			if (b->skipped != NULL || b->runs == 0) {
+				printf("%s,%d,%d,,,,,,,,,%s\n", b->name, b->runs, b->errors,
+					b->skipped ? b->skipped : "");
+				continue;
+			}
+			printf("%s,%d,%d,", b->name, b->runs, b->errors);
+			if (per_run >= 0)
+				printf("%.2f", per_run);
+			printf(",%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,",
+				b->us[0], mean(b), percentile(b, 50), percentile(b, 90),
+				percentile(b, 99), b->us[b->runs - 1]);
+			if (b->bytes != 0)
+				printf("%.1f", throughput(b));
+			printf(",\n");
+		} else {
+			if (b->skipped != NULL) {
+				printf("%-14s skipped: %s\n", b->name, b->skipped);
+				continue;
+			}
+			if (b->runs == 0) {
+				printf("%-14s %5d %5d\n", b->name, b->runs, b->errors);
+				continue;
+			}
+			printf("%-14s %5d %5d ", b->name, b->runs, b->errors);
+			if (per_run >= 0)
+				printf("%7.1f", per_run);
+			else
+				printf("%7s", "n/a");
+			printf(" %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+				b->us[0], mean(b), percentile(b, 50), percentile(b, 90),
+				percentile(b, 99), b->us[b->runs - 1]);
+		}
+	}
+	if (format == OUT_JSON)
+		printf("\n  ]\n}\n");
+	else if (format == OUT_TEXT)
+		for (i = 0; i < NBENCHES; i++)
+			if (benches[i].bytes != 0 && benches[i].runs > 0)
+				printf("%s: %lu bytes per run, %.1f MB/s\n", benches[i].name,
+					benches[i].bytes, throughput(&benches[i]));
+}
+
+int main(int argc, char *argv[])
+{
+	struct sc_pkcs15_card *p15card = NULL;
+	sc_context_param_t ctx_param;
+	sc_card_t *card = NULL;
+	char card_name[128] = "";
+	int opt_reader = 0, opt_debug = 0, format = OUT_TEXT;
+	int c, r;
+	size_t i;
+
+	while ((c = getopt_long(argc, argv, "r:n:p:m:s:o:d", options, NULL)) != -1) {
+		switch (c) {
+		case 'r':
+			opt_reader = atoi(optarg);
+			break;
+		case 'n':
+			opt_count = atoi(optarg);
+			break;
+		case 'p':
+			opt_pin = optarg;
+			break;
+		case 'm':
+			opt_module = optarg;
+			break;
+		case 's':
+			opt_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			if (strcmp(optarg, "csv") == 0)
+				format = OUT_CSV;
+			else if (strcmp(optarg, "json") == 0)
+				format = OUT_JSON;
+			else if (strcmp(optarg, "text") == 0)
+				format = OUT_TEXT;
+			else
+				goto usage;
+			break;
+		case 'd':
+			opt_debug++;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (opt_count <= 0 || opt_size == 0)
+		goto usage;
+
+	for (i = 0; i < NBENCHES; i++) {
+		benches[i].us = calloc(opt_count, sizeof(double));
+		if (benches[i].us == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+	}
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.app_name = "p15bench";
+	r = sc_context_create(&ctx, &ctx_param);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Failed to establish context: %s\n", sc_strerror(r));
+		return 1;
+	}
+	ctx->debug = opt_debug;
+	if (opt_reader >= (int) sc_ctx_get_reader_count(ctx)) {
+		fprintf(stderr, "Illegal reader number, %d reader(s) configured.\n",
+			sc_ctx_get_reader_count(ctx));
+		return 1;
+	}
+	reader = sc_ctx_get_reader(ctx, opt_reader);
+	if (sc_detect_card_presence(reader) <= 0) {
+		fprintf(stderr, "No card in reader '%s'\n", reader->name);
+		return 1;
+	}
+
+	bench_connect(&benches[0]);
+
+	r = sc_connect_card(reader, &card);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Connecting to card failed: %s\n", sc_strerror(r));
+		return 1;
+	}
+	if (card->name)
+		strlcpy(card_name, card->name, sizeof(card_name));
+
+	bench_bind(&benches[1], card);
+	r = sc_pkcs15_bind(card, NULL, &p15card);
+	if (r != SC_SUCCESS) {
+		for (i = 2; i < 5; i++)
+			benches[i].skipped = "no PKCS #15 structure";
+	} else {
+		bench_read_cert(&benches[2], p15card);
+		bench_crypt(&benches[3], p15card, 1);
+		bench_crypt(&benches[4], p15card, 0);
+		sc_pkcs15_unbind(p15card);
+	}
+	sc_disconnect_card(card);
+
+	/* the module opens its own context and must find the card idle */
+	bench_module(&benches[5], &benches[6]);
+
+	print_results(format, card_name);
+
+	sc_release_context(ctx);
+	for (i = 0; i < NBENCHES; i++)
+		free(benches[i].us);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-r reader] [-n count] [-p pin] [-m module] "
+		"[-s size] [-o text|csv|json] [-d]\n", argv[0]);
+	return 1;
+}
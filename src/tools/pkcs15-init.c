@@ -38,6 +38,19 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#include <time.h>
+#ifdef HAVE_GETTIMEOFDAY
+#include <sys/time.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifndef _WIN32
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
 #include <openssl/opensslv.h>
 #if OPENSSL_VERSION_NUMBER >= 0x00907000L
 #include <openssl/conf.h>
@@ -112,7 +125,11 @@ static int	do_read_private_key(const char *, const char *,
 static int	do_read_public_key(const char *, const char *, EVP_PKEY **);
 static int	do_read_certificate(const char *, const char *, X509 **);
 static void	parse_commandline(int argc, char **argv);
+static void	handle_option(const struct option *);
 static void	read_options_file(const char *);
+static int	do_actions(struct sc_profile *);
+static int	do_batch(struct sc_profile *, const char *);
+static int	do_parallel(void);
 static void	ossl_print_errors(void);
 static int	verify_pin(struct sc_pkcs15_card *, char *);
 
@@ -134,6 +151,9 @@ enum {
 	OPT_VERIFY_PIN,
 	OPT_SANITY_CHECK,
 	OPT_BIND_TO_AID,
+	OPT_BATCH,
+	OPT_PARALLEL,
+	OPT_SERIAL_LIST,
 
 	OPT_PIN1     = 0x10000,	/* don't touch these values */
 	OPT_PUK1     = 0x10001,
@@ -192,6 +212,9 @@ const struct option	options[] = {
 	{ "profile",		required_argument, NULL,	'p' },
 	{ "card-profile",	required_argument, NULL,	'c' },
 	{ "options-file",	required_argument, NULL,	OPT_OPTIONS },
+	{ "batch",		required_argument, NULL,	OPT_BATCH },
+	{ "parallel",		no_argument, NULL,		OPT_PARALLEL },
+	{ "serial-list",	required_argument, NULL,	OPT_SERIAL_LIST },
 	{ "wait",		no_argument, NULL,		'w' },
 	{ "help",		no_argument, NULL,		'h' },
 	{ "verbose",		no_argument, NULL,		'v' },
@@ -248,6 +271,9 @@ static const char *		option_help[] = {
 	"Specify the general profile to use",
 	"Specify the card profile to use",
 	"Read additional command line options from file",
+	"Run the personalization steps listed in a manifest file",
+	"Personalize the cards in all readers at once, one worker per reader",
+	"Issue one card per serial number listed in a file (use with --parallel)",
 	"Wait for card insertion",
 	"Display this message",
 	"Verbose operation. Use several times to enable debug output.",
@@ -293,6 +319,24 @@ static const char *action_names[] = {
 	"check card's sanity",
 };
 
+/* Time spent in each phase, reported at the end of a batch run */
+enum {
+	PHASE_BIND = ACTION_MAX,
+	PHASE_BIND_PKCS15,
+	PHASE_FLUSH,
+
+	PHASE_MAX
+};
+static const char *phase_names[] = {
+	"connect and bind profile",
+	"read PKCS #15 structure",
+	"write directory files",
+};
+static struct {
+	unsigned int	count;
+	double		ms;
+} phase_times[PHASE_MAX];
+
 #define MAX_CERTS		4
 #define MAX_SECRETS		16
 struct secret {
@@ -322,7 +366,8 @@ static int			opt_extractable = 0,
 				opt_no_sopin = 0,
 				opt_use_defkeys = 0,
 				opt_wait = 0,
-				opt_verify_pin = 0;
+				opt_verify_pin = 0,
+				opt_parallel = 0;
 static const char *		opt_profile = "pkcs15";
 static char *			opt_card_profile = NULL;
 static char *			opt_infile = NULL;
@@ -345,6 +390,8 @@ static char *			opt_puk_authid = NULL;
 static unsigned int		opt_x509_usage = 0;
 static unsigned int		opt_delete_flags = 0;
 static unsigned int		opt_type = 0;
+static char *			opt_batch = NULL;
+static char *			opt_serial_list = NULL;
 static int			ignore_cmdline_pins = 0;
 static struct secret		opt_secrets[MAX_SECRETS];
 static unsigned int		opt_secret_count;
@@ -399,11 +446,31 @@ extern int	get_pin(sc_ui_hints_t *hints, char **out);
 static int	get_new_pin(sc_ui_hints_t *, const char *, const char *,
 			char **);
 
+static double
+get_time_ms(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+#else
+	return clock() * 1000.0 / CLOCKS_PER_SEC;
+#endif
+}
+
+static void
+record_phase(unsigned int phase, double start)
+{
+	phase_times[phase].count++;
+	phase_times[phase].ms += get_time_ms() - start;
+}
+
 int
 main(int argc, char **argv)
 {
 	struct sc_profile	*profile = NULL;
-	unsigned int		n;
+	double			start;
 	int			r = 0;
 
 #if OPENSSL_VERSION_NUMBER >= 0x00907000L
@@ -421,7 +488,7 @@ main(int argc, char **argv)
 
 	if (optind != argc)
 		util_print_usage_and_die(app_name, options, option_help);
-	if (opt_actions == 0) {
+	if (opt_actions == 0 && opt_batch == NULL) {
 		fprintf(stderr, "No action specified.\n");
 		util_print_usage_and_die(app_name, options, option_help);
 	}
@@ -429,8 +496,21 @@ main(int argc, char **argv)
 		fprintf(stderr, "No profile specified.\n");
 		util_print_usage_and_die(app_name, options, option_help);
 	}
+	if (opt_serial_list && !opt_parallel) {
+		fprintf(stderr, "--serial-list can only be used with --parallel.\n");
+		util_print_usage_and_die(app_name, options, option_help);
+	}
+	if (opt_parallel) {
+		if (opt_reader || opt_wait) {
+			fprintf(stderr, "--parallel uses all readers, and cannot "
+				"be combined with --reader or --wait.\n");
+			util_print_usage_and_die(app_name, options, option_help);
+		}
+		return do_parallel();
+	}
 
 	/* Connect to the card */
+	start = get_time_ms();
 	if (!open_reader_and_card(opt_reader))
 		return 1;
 
@@ -442,6 +522,36 @@ main(int argc, char **argv)
 		printf("Couldn't bind to the card: %s\n", sc_strerror(r));
 		return 1;
 	}
+	record_phase(PHASE_BIND, start);
+
+	if (opt_batch)
+		r = do_batch(profile, opt_batch);
+	else
+		r = do_actions(profile);
+
+	if (profile) {
+		sc_pkcs15init_unbind(profile);
+	}
+	if (p15card) {
+		sc_pkcs15_unbind(p15card);
+	}
+	if (card) {
+		sc_unlock(card);
+		sc_disconnect_card(card);
+	}
+	sc_release_context(ctx);
+	return r < 0? 1 : 0;
+}
+
+/*
+ * Perform the actions selected by the options
+ */
+static int
+do_actions(struct sc_profile *profile)
+{
+	unsigned int	n;
+	double		start;
+	int		r = 0;
 
 	for (n = 0; n < ACTION_MAX; n++) {
 		unsigned int	action = n;
@@ -454,13 +564,14 @@ main(int argc, char **argv)
 		 && action != ACTION_ASSERT_PRISTINE
 		 && p15card == NULL) {
 			/* Read the PKCS15 structure from the card */
+			start = get_time_ms();
 			if (opt_bind_to_aid)   {
 				struct sc_aid aid;
 
 				aid.len = sizeof(aid.value);
 				if (sc_hex_to_bin(opt_bind_to_aid, aid.value, &aid.len))   {
 					fprintf(stderr, "Invalid AID value: '%s'\n", opt_bind_to_aid);
-					return 1;
+					return SC_ERROR_INVALID_ARGUMENTS;
 				}
 
 				r = sc_pkcs15init_finalize_profile(card, profile, &aid);
@@ -478,6 +589,7 @@ main(int argc, char **argv)
 				fprintf(stderr, "PKCS#15 binding failed: %s\n", sc_strerror(r));
 				break;
 			}
+			record_phase(PHASE_BIND_PKCS15, start);
 
 			/* XXX: should compare card to profile here to make
 			 * sure we're not messing things up */
@@ -500,11 +612,12 @@ main(int argc, char **argv)
 		if (verbose && action != ACTION_ASSERT_PRISTINE)
 			printf("About to %s.\n", action_names[action]);
 
+		start = get_time_ms();
 		switch (action) {
 		case ACTION_ASSERT_PRISTINE:
 			/* skip printing error message */
 			if ((r = do_assert_pristine(card)) < 0)
-				goto out;
+				return r;
 			continue;
 		case ACTION_ERASE:
 			r = do_erase(card, profile);
@@ -554,25 +667,203 @@ main(int argc, char **argv)
 				action_names[action], sc_strerror(r));
 			break;
 		}
+		record_phase(action, start);
 	}
 
-out:
-	if (profile) {
-		sc_pkcs15init_unbind(profile);
+	return r;
+}
+
+/*
+ * Options a batch step may set. Before each step they are reset to
+ * the values given on the command line.
+ */
+static char **batch_str_opts[] = {
+	&opt_infile, &opt_format, &opt_authid, &opt_objectid, &opt_label,
+	&opt_puk_label, &opt_pubkey_label, &opt_cert_label,
+	&opt_pins[0], &opt_pins[1], &opt_pins[2], &opt_pins[3],
+	&opt_passphrase, &opt_newkey, &opt_outkey,
+	&opt_application_id, &opt_application_name, &opt_puk_authid,
+};
+static unsigned int *batch_uint_opts[] = {
+	&opt_x509_usage, &opt_delete_flags, &opt_type,
+};
+static int *batch_int_opts[] = {
+	&opt_extractable, &opt_insecure, &opt_authority, &opt_verify_pin,
+};
+#define NELEMS(a)	(sizeof(a) / sizeof((a)[0]))
+
+static char *		saved_str_opts[NELEMS(batch_str_opts)];
+static unsigned int	saved_uint_opts[NELEMS(batch_uint_opts)];
+static int		saved_int_opts[NELEMS(batch_int_opts)];
+
+static void
+save_step_options(void)
+{
+	unsigned int n;
+
+	for (n = 0; n < NELEMS(batch_str_opts); n++)
+		saved_str_opts[n] = *batch_str_opts[n];
+	for (n = 0; n < NELEMS(batch_uint_opts); n++)
+		saved_uint_opts[n] = *batch_uint_opts[n];
+	for (n = 0; n < NELEMS(batch_int_opts); n++)
+		saved_int_opts[n] = *batch_int_opts[n];
+}
+
+static void
+restore_step_options(void)
+{
+	unsigned int n;
+
+	for (n = 0; n < NELEMS(batch_str_opts); n++)
+		*batch_str_opts[n] = saved_str_opts[n];
+	for (n = 0; n < NELEMS(batch_uint_opts); n++)
+		*batch_uint_opts[n] = saved_uint_opts[n];
+	for (n = 0; n < NELEMS(batch_int_opts); n++)
+		*batch_int_opts[n] = saved_int_opts[n];
+	opt_actions = 0;
+}
+
+/*
+ * Parse one step of a batch manifest. A step is a list of
+ * long options, with or without the leading "--", each followed
+ * by its argument if it takes one. Arguments containing blanks
+ * can be put in double quotes.
+ */
+static void
+parse_batch_step(char *line, const char *filename, unsigned int lineno)
+{
+	const struct option *o;
+	char	*tokens[64], *p = line;
+	unsigned int n, ntokens = 0;
+
+	while (*p) {
+		while (isspace((int) *p))
+			p++;
+		if (*p == '\0' || *p == '#')
+			break;
+		if (ntokens == NELEMS(tokens))
+			util_fatal("%s:%u: too many options", filename, lineno);
+		if (*p == '"') {
+			tokens[ntokens++] = ++p;
+			while (*p && *p != '"')
+				p++;
+			if (*p == '\0')
+				util_fatal("%s:%u: missing closing quote", filename, lineno);
+		} else {
+			tokens[ntokens++] = p;
+			while (*p && !isspace((int) *p))
+				p++;
+		}
+		if (*p)
+			*p++ = '\0';
 	}
-	if (p15card) {
-		sc_pkcs15_unbind(p15card);
+
+	for (n = 0; n < ntokens; n++) {
+		const char *name = tokens[n];
+
+		if (!strncmp(name, "--", 2))
+			name += 2;
+		for (o = options; o->name; o++)
+			if (!strcmp(o->name, name))
+				break;
+		if (!o->name)
+			util_fatal("%s:%u: unknown option \"%s\"", filename, lineno, name);
+		if (o->val == OPT_BATCH || o->val == OPT_PARALLEL
+		 || o->val == OPT_SERIAL_LIST || o->val == 'r' || o->val == 'p'
+		 || o->val == 'c' || o->val == 'w')
+			util_fatal("%s:%u: option \"%s\" cannot be used in a batch step",
+					filename, lineno, name);
+		optarg = NULL;
+		if (o->has_arg != no_argument) {
+			if (n + 1 == ntokens)
+				util_fatal("%s:%u: option %s: missing argument",
+						filename, lineno, name);
+			optarg = strdup(tokens[++n]);
+		}
+		handle_option(o);
 	}
-	if (card) {
-		sc_unlock(card);
-		sc_disconnect_card(card);
+}
+
+/*
+ * Run a personalization from a manifest: each line of the
+ * file is one step, performed within the single bind to the
+ * card and profile. The updates of the PKCS #15 directory files
+ * are collected and written once, at the end of the run.
+ */
+static int
+do_batch(struct sc_profile *profile, const char *filename)
+{
+	char		buffer[1024];
+	unsigned int	n, lineno = 0, steps = 0;
+	double		start, total = 0;
+	FILE		*fp;
+	int		r = 0, rv;
+
+	if ((fp = fopen(filename, "r")) == NULL)
+		util_fatal("Unable to open %s: %m", filename);
+
+	save_step_options();
+	sc_pkcs15init_defer_updates(profile, 1);
+	while (r >= 0 && fgets(buffer, sizeof(buffer), fp) != NULL) {
+		lineno++;
+		buffer[strcspn(buffer, "\r\n")] = '\0';
+
+		restore_step_options();
+		parse_batch_step(buffer, filename, lineno);
+		if (opt_actions == 0)
+			continue;
+		if ((opt_actions & (1 << ACTION_ERASE)) && p15card != NULL)
+			util_fatal("%s:%u: the card can only be erased "
+					"before any other step", filename, lineno);
+
+		if (verbose)
+			printf("Step %u (%s line %u)\n", steps + 1, filename, lineno);
+		r = do_actions(profile);
+		if (r < 0)
+			fprintf(stderr, "%s:%u: step failed\n", filename, lineno);
+		steps++;
 	}
-	sc_release_context(ctx);
-	return r < 0? 1 : 0;
+	fclose(fp);
+	restore_step_options();
+
+	/* Write what the steps so far have done, even if one failed,
+	 * so the directory files describe the objects on the card */
+	if (p15card != NULL) {
+		start = get_time_ms();
+		rv = sc_pkcs15init_flush(p15card, profile);
+		if (rv < 0) {
+			fprintf(stderr, "Failed to write the PKCS #15 directory files: %s\n",
+					sc_strerror(rv));
+			if (r >= 0)
+				r = rv;
+		}
+		record_phase(PHASE_FLUSH, start);
+	}
+	sc_pkcs15init_defer_updates(profile, 0);
+
+	/* The workers of a parallel run only report per card */
+	if (opt_parallel)
+		return r;
+
+	printf("%u steps; time per phase:\n", steps);
+	printf("  %-32s %6s %10s %10s\n", "phase", "count", "total ms", "mean ms");
+	for (n = 0; n < PHASE_MAX; n++) {
+		const char *name;
+
+		if (phase_times[n].count == 0)
+			continue;
+		name = n < ACTION_MAX ? action_names[n] : phase_names[n - ACTION_MAX];
+		printf("  %-32s %6u %10.1f %10.1f\n", name, phase_times[n].count,
+			phase_times[n].ms, phase_times[n].ms / phase_times[n].count);
+		total += phase_times[n].ms;
+	}
+	printf("  %-32s %6s %10.1f\n", "total", "", total);
+
+	return r;
 }
 
 static int
-open_reader_and_card(char *reader)
+open_context(void)
 {
 	int	r;
 	sc_context_param_t ctx_param;
@@ -592,12 +883,295 @@ open_reader_and_card(char *reader)
 		sc_ctx_log_to_file(ctx, "stderr");
 	}
 
+	return 1;
+}
+
+static int
+open_reader_and_card(char *reader)
+{
+	if (!open_context())
+		return 0;
+
 	if (util_connect_card(ctx, &card, reader, opt_wait, verbose))
 		return 0;
 
 	return 1;
 }
 
+#ifndef _WIN32
+#define SERIAL_RECORD_SIZE	64
+#define CARD_POLL_INTERVAL	100000	/* microseconds */
+
+/*
+ * Before the workers are forked, parse the profiles for the card
+ * in the first reader that has one, and read the private keys
+ * to be stored, so the workers inherit them instead of each doing
+ * it again.
+ */
+static void
+preload_private_key(void)
+{
+	EVP_PKEY	*pkey = NULL;
+	X509		*certs[MAX_CERTS];
+	int		i, ncerts;
+
+	if (!(opt_actions & (1 << ACTION_STORE_PRIVKEY)))
+		return;
+	ncerts = do_read_private_key(opt_infile, opt_format, &pkey, certs, MAX_CERTS);
+	for (i = 0; i < ncerts; i++)
+		X509_free(certs[i]);
+	EVP_PKEY_free(pkey);
+}
+
+static void
+parallel_preload(void)
+{
+	struct sc_profile *profile;
+	sc_reader_t	*reader;
+	char		buffer[1024];
+	unsigned int	n, lineno = 0;
+	FILE		*fp;
+
+	for (n = 0; n < sc_ctx_get_reader_count(ctx); n++) {
+		reader = sc_ctx_get_reader(ctx, n);
+		if (!(sc_detect_card_presence(reader) & SC_READER_CARD_PRESENT))
+			continue;
+		if (sc_connect_card(reader, &card) < 0)
+			continue;
+		if (sc_pkcs15init_bind(card, opt_profile, opt_card_profile, &profile) >= 0)
+			sc_pkcs15init_unbind(profile);
+		sc_disconnect_card(card);
+		card = NULL;
+		break;
+	}
+
+	if (opt_batch == NULL) {
+		preload_private_key();
+		return;
+	}
+	if ((fp = fopen(opt_batch, "r")) == NULL)
+		util_fatal("Unable to open %s: %m", opt_batch);
+	save_step_options();
+	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+		buffer[strcspn(buffer, "\r\n")] = '\0';
+		restore_step_options();
+		parse_batch_step(buffer, opt_batch, ++lineno);
+		preload_private_key();
+	}
+	fclose(fp);
+	restore_step_options();
+}
+
+/*
+ * Wait until a card is inserted into (or removed from) the reader.
+ * Returns 0 if the job queue was drained meanwhile, as there's no
+ * more card to issue then.
+ */
+static int
+wait_for_card(sc_reader_t *reader, int jobs, int present)
+{
+	struct pollfd	pfd;
+	int		r;
+
+	for (;;) {
+		r = sc_detect_card_presence(reader);
+		if (r >= 0 && !(r & SC_READER_CARD_PRESENT) == !present)
+			return 1;
+
+		pfd.fd = jobs;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) > 0 && !(pfd.revents & POLLIN))
+			return 0;
+		usleep(CARD_POLL_INTERVAL);
+	}
+}
+
+static int
+issue_card(sc_reader_t *reader)
+{
+	struct sc_profile *profile;
+	int		r;
+
+	if ((r = sc_connect_card(reader, &card)) < 0)
+		return r;
+	if ((r = sc_lock(card)) < 0)
+		goto out;
+
+	r = sc_pkcs15init_bind(card, opt_profile, opt_card_profile, &profile);
+	if (r >= 0) {
+		r = opt_batch ? do_batch(profile, opt_batch) : do_actions(profile);
+		sc_pkcs15init_unbind(profile);
+	} else {
+		fprintf(stderr, "Couldn't bind to the card: %s\n", sc_strerror(r));
+	}
+	if (p15card) {
+		sc_pkcs15_unbind(p15card);
+		p15card = NULL;
+	}
+	sc_unlock(card);
+
+out:	sc_disconnect_card(card);
+	card = NULL;
+	return r;
+}
+
+/*
+ * Issue the cards inserted in one reader. Without a job queue,
+ * the worker issues the card in the reader, if there is one.
+ * With a queue, it issues one card per serial number it takes
+ * from the queue, until the queue is drained.
+ */
+static int
+parallel_worker(unsigned int index, int jobs)
+{
+	sc_reader_t	*reader;
+	char		serial[SERIAL_RECORD_SIZE];
+	unsigned int	issued = 0, failed = 0;
+	double		start, total = 0;
+	int		r;
+
+	if (!open_context())
+		return 1;
+	reader = sc_ctx_get_reader(ctx, index);
+	if (reader == NULL) {
+		sc_release_context(ctx);
+		return 1;
+	}
+
+	serial[0] = '\0';
+	for (;;) {
+		if (jobs < 0) {
+			r = sc_detect_card_presence(reader);
+			if (r <= 0 || !(r & SC_READER_CARD_PRESENT))
+				break;
+		} else {
+			if (!wait_for_card(reader, jobs, 1))
+				break;
+			if (read(jobs, serial, sizeof(serial)) != sizeof(serial))
+				break;
+			serial[sizeof(serial) - 1] = '\0';
+			opt_serial = serial;
+		}
+
+		start = get_time_ms();
+		r = issue_card(reader);
+		start = get_time_ms() - start;
+		total += start;
+		if (r < 0)
+			failed++;
+		else
+			issued++;
+		printf("%s: card %s%s %s (%.1f ms)\n", reader->name,
+				*serial ? "serial " : "", serial,
+				r < 0 ? "failed" : "issued", start);
+		fflush(stdout);
+
+		/* Don't issue the same card again */
+		if (jobs < 0 || !wait_for_card(reader, jobs, 0))
+			break;
+	}
+
+	if (issued + failed)
+		printf("%s: %u cards issued, %u failed, %.1f ms per card\n",
+				reader->name, issued, failed,
+				total / (issued + failed));
+	sc_release_context(ctx);
+	return failed ? 1 : 0;
+}
+
+/*
+ * Issue the cards in all readers at once, with one worker process
+ * per reader.
+ */
+static int
+do_parallel(void)
+{
+	char		buffer[1024], record[SERIAL_RECORD_SIZE];
+	unsigned int	n, nreaders, workers = 0, failed = 0, queued = 0;
+	int		jobs[2] = { -1, -1 }, status;
+	double		start = get_time_ms();
+	pid_t		pid;
+	FILE		*fp;
+
+	sc_pkcs15init_set_callbacks(&callbacks);
+	if (!open_context())
+		return 1;
+	nreaders = sc_ctx_get_reader_count(ctx);
+	if (nreaders == 0) {
+		fprintf(stderr, "No smart card readers found.\n");
+		sc_release_context(ctx);
+		return 1;
+	}
+	parallel_preload();
+
+	/* The workers connect with their own context */
+	sc_release_context(ctx);
+	ctx = NULL;
+
+	if (opt_serial_list && pipe(jobs) < 0)
+		util_fatal("Unable to create the job queue: %m");
+
+	fflush(stdout);
+	for (n = 0; n < nreaders; n++) {
+		if ((pid = fork()) < 0) {
+			util_error("Unable to start a worker: %m");
+			break;
+		}
+		if (pid == 0) {
+			if (jobs[1] >= 0)
+				close(jobs[1]);
+			exit(parallel_worker(n, jobs[0]));
+		}
+		workers++;
+	}
+
+	if (jobs[1] >= 0) {
+		close(jobs[0]);
+		signal(SIGPIPE, SIG_IGN);
+		if ((fp = fopen(opt_serial_list, "r")) == NULL)
+			util_fatal("Unable to open %s: %m", opt_serial_list);
+		while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+			char	*serial = buffer + strspn(buffer, " \t");
+
+			serial[strcspn(serial, " \t\r\n")] = '\0';
+			if (*serial == '\0' || *serial == '#')
+				continue;
+			if (strlen(serial) >= sizeof(record)) {
+				util_error("Serial number %s too long, skipped", serial);
+				continue;
+			}
+			memset(record, 0, sizeof(record));
+			strcpy(record, serial);
+			/* Blocks while the queue is full */
+			if (write(jobs[1], record, sizeof(record)) != sizeof(record))
+				break;
+			queued++;
+		}
+		fclose(fp);
+		close(jobs[1]);
+	}
+
+	while (workers && wait(&status) > 0) {
+		workers--;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
+	}
+
+	if (opt_serial_list)
+		printf("%u serial numbers queued, ", queued);
+	printf("%u readers, %.1f ms\n", nreaders, get_time_ms() - start);
+	return failed ? 1 : 0;
+}
+#else
+static int
+do_parallel(void)
+{
+	util_error("--parallel is not supported on this platform");
+	return 1;
+}
+#endif
+
 /*
  * Make sure there's no pkcs15 structure on the card
  */
@@ -1945,14 +2519,69 @@ error:	ossl_print_errors();
 	return SC_ERROR_CANNOT_LOAD_KEY;
 }
 
+/*
+ * The private keys already read, so a key stored on many cards
+ * is read (and unlocked) only once
+ */
+struct key_file {
+	char *			filename;
+	EVP_PKEY *		pkey;
+	X509 *			certs[MAX_CERTS];
+	int			ncerts;
+	struct key_file *	next;
+};
+static struct key_file *	key_files = NULL;
+
+static int
+get_key_file(struct key_file *kf, EVP_PKEY **pk, X509 **certs,
+		unsigned int max_certs)
+{
+	int	i;
+
+	CRYPTO_add(&kf->pkey->references, 1, CRYPTO_LOCK_EVP_PKEY);
+	*pk = kf->pkey;
+	for (i = 0; i < kf->ncerts && i < (int) max_certs; i++) {
+		CRYPTO_add(&kf->certs[i]->references, 1, CRYPTO_LOCK_X509);
+		certs[i] = kf->certs[i];
+	}
+	return i;
+}
+
+static void
+add_key_file(const char *filename, EVP_PKEY *pk, X509 **certs, int ncerts)
+{
+	struct key_file	*kf;
+	int		i;
+
+	if ((kf = calloc(1, sizeof(*kf))) == NULL
+	 || (kf->filename = strdup(filename)) == NULL) {
+		free(kf);
+		return;
+	}
+	CRYPTO_add(&pk->references, 1, CRYPTO_LOCK_EVP_PKEY);
+	kf->pkey = pk;
+	for (i = 0; i < ncerts && i < MAX_CERTS; i++) {
+		CRYPTO_add(&certs[i]->references, 1, CRYPTO_LOCK_X509);
+		kf->certs[i] = certs[i];
+	}
+	kf->ncerts = i;
+	kf->next = key_files;
+	key_files = kf;
+}
+
 static int
 do_read_private_key(const char *filename, const char *format,
 			EVP_PKEY **pk, X509 **certs, unsigned int max_certs)
 {
+	struct key_file *kf;
 	size_t len = 0;
 	char	*passphrase = NULL;
 	int	r;
 
+	for (kf = key_files; kf; kf = kf->next)
+		if (!strcmp(kf->filename, filename))
+			return get_key_file(kf, pk, certs, max_certs);
+
 	if (opt_passphrase)
 		passphrase = opt_passphrase;
 
@@ -1985,6 +2614,7 @@ do_read_private_key(const char *filename, const char *format,
 
 	if (r < 0)
 		util_fatal("Unable to read private key from %s\n", filename);
+	add_key_file(filename, *pk, certs, r);
 	return r;
 }
 
@@ -2499,6 +3129,15 @@ handle_option(const struct option *opt)
 	case OPT_OPTIONS:
 		read_options_file(optarg);
 		break;
+	case OPT_BATCH:
+		opt_batch = optarg;
+		break;
+	case OPT_PARALLEL:
+		opt_parallel = 1;
+		break;
+	case OPT_SERIAL_LIST:
+		opt_serial_list = optarg;
+		break;
 	case OPT_PIN1: case OPT_PUK1:
 	case OPT_PIN2: case OPT_PUK2:
 		opt_pins[opt->val & 3] = optarg;